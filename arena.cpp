@@ -0,0 +1,92 @@
+#include "arena.h"
+
+// Chunks are sized so a typical call fits in the first one.  Anything beyond the retained size is given
+//  back once the thread leaves its outermost scope so a single huge call doesn't pin memory forever
+static const size_t cbChunkDefault = 16 * 1024;
+static const size_t cbRetainMax = 256 * 1024;
+
+ScratchArena &scratch_arena()
+{
+    static thread_local ScratchArena arena;
+    return arena;
+}
+
+ScratchArena::~ScratchArena()
+{
+    Chunk *pchunk = m_pchunkHead;
+    while (pchunk != nullptr)
+    {
+        Chunk *pnext = pchunk->pnext;
+        operator delete(pchunk);
+        pchunk = pnext;
+    }
+}
+
+ScratchArena::Chunk *ScratchArena::newChunk(size_t cbMin)
+{
+    size_t cb = cbChunkDefault;
+    if (cb < cbMin + alignof(max_align_t))
+        cb = cbMin + alignof(max_align_t);
+    Chunk *pchunk = static_cast<Chunk*>(operator new(sizeof(Chunk) + cb));
+    pchunk->pnext = nullptr;
+    pchunk->cb = cb;
+    return pchunk;
+}
+
+void *ScratchArena::alloc(size_t cb, size_t align)
+{
+    if (m_pchunkCur == nullptr)
+    {
+        if (m_pchunkHead == nullptr)
+            m_pchunkHead = newChunk(cb);
+        m_pchunkCur = m_pchunkHead;
+        m_ibCur = 0;
+    }
+
+    for (;;)
+    {
+        uintptr_t pbase = reinterpret_cast<uintptr_t>(m_pchunkCur->data());
+        uintptr_t pv = (pbase + m_ibCur + align - 1) & ~(uintptr_t)(align - 1);
+        if (pv + cb <= pbase + m_pchunkCur->cb)
+        {
+            m_ibCur = (pv + cb) - pbase;
+            return reinterpret_cast<void*>(pv);
+        }
+
+        // Move on to the next chunk, inserting a bigger one if what we kept from before is too small
+        Chunk *pnext = m_pchunkCur->pnext;
+        if (pnext == nullptr || pnext->cb < cb + align)
+        {
+            Chunk *pchunk = newChunk(cb + align);
+            pchunk->pnext = pnext;
+            m_pchunkCur->pnext = pchunk;
+            pnext = pchunk;
+        }
+        m_pchunkCur = pnext;
+        m_ibCur = 0;
+    }
+}
+
+void ScratchArena::rewind(const Mark &mark)
+{
+    m_pchunkCur = mark.pchunk;
+    m_ibCur = mark.ib;
+}
+
+void ScratchArena::trim()
+{
+    size_t cbRetained = 0;
+    Chunk **ppchunk = &m_pchunkHead;
+    while (*ppchunk != nullptr)
+    {
+        Chunk *pchunk = *ppchunk;
+        if (cbRetained + pchunk->cb > cbRetainMax && pchunk != m_pchunkHead)
+        {
+            *ppchunk = pchunk->pnext;
+            operator delete(pchunk);
+            continue;
+        }
+        cbRetained += pchunk->cb;
+        ppchunk = &pchunk->pnext;
+    }
+}
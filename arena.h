@@ -0,0 +1,139 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <new>
+#include <type_traits>
+
+/*
+ * Per thread bump allocator for the short lived buffers used while marshalling arguments between
+ *  V8 and the server.  Memory is handed out from chunks that are kept across invocations, so once
+ *  warmed up a call does not touch the heap.  Allocations are released all at once when the
+ *  outermost ArenaScope on the thread ends.
+ */
+class ScratchArena
+{
+    struct Chunk
+    {
+        Chunk *pnext;
+        size_t cb;
+        char *data() { return reinterpret_cast<char*>(this + 1); }
+    };
+
+public:
+    struct Mark
+    {
+        Chunk *pchunk;
+        size_t ib;
+    };
+
+    ~ScratchArena();
+
+    void *alloc(size_t cb, size_t align = alignof(max_align_t));
+    char *allocString(size_t cch) { return static_cast<char*>(alloc(cch, 1)); }
+
+    Mark mark() const { return Mark{m_pchunkCur, m_ibCur}; }
+    void rewind(const Mark &mark);
+
+    // Frees chunks beyond the retained size, only safe when nothing is allocated
+    void trim();
+
+    int m_cscopes = 0;
+
+private:
+    Chunk *newChunk(size_t cbMin);
+
+    Chunk *m_pchunkHead = nullptr;
+    Chunk *m_pchunkCur = nullptr;
+    size_t m_ibCur = 0;
+};
+
+ScratchArena &scratch_arena();
+
+// Everything allocated from the thread's arena inside this scope is released when it ends
+class ArenaScope
+{
+    ScratchArena &m_arena;
+    ScratchArena::Mark m_mark;
+
+public:
+    ArenaScope()
+        : m_arena(scratch_arena()), m_mark(m_arena.mark())
+    {
+        ++m_arena.m_cscopes;
+    }
+
+    ~ArenaScope()
+    {
+        m_arena.rewind(m_mark);
+        if (--m_arena.m_cscopes == 0)
+            m_arena.trim();
+    }
+
+    ArenaScope(const ArenaScope&) = delete;
+    ArenaScope &operator=(const ArenaScope&) = delete;
+};
+
+/*
+ * A vector for trivially copyable types with room for N elements inline.  If it outgrows that it
+ *  spills into the scratch arena, so it may only grow past N inside an ArenaScope and must not
+ *  outlive that scope.
+ */
+template<typename T, size_t N>
+class SmallVector
+{
+    static_assert(std::is_trivially_copyable<T>::value, "SmallVector elements are moved with memcpy");
+
+    T *m_p;
+    size_t m_c = 0;
+    size_t m_cmax = N;
+    alignas(T) unsigned char m_rgbInline[N * sizeof(T)];
+
+    void grow(size_t cmin)
+    {
+        size_t cmax = m_cmax * 2;
+        if (cmax < cmin)
+            cmax = cmin;
+        T *pNew = static_cast<T*>(scratch_arena().alloc(cmax * sizeof(T), alignof(T)));
+        memcpy(static_cast<void*>(pNew), m_p, m_c * sizeof(T));
+        m_p = pNew;
+        m_cmax = cmax;
+    }
+
+public:
+    SmallVector() : m_p(reinterpret_cast<T*>(m_rgbInline)) {}
+    SmallVector(const SmallVector&) = delete;
+    SmallVector &operator=(const SmallVector&) = delete;
+
+    void reserve(size_t c) { if (c > m_cmax) grow(c); }
+
+    void resize(size_t c)
+    {
+        reserve(c);
+        for (size_t i = m_c; i < c; ++i)
+            new (m_p + i) T();
+        m_c = c;
+    }
+
+    void push_back(const T &val)
+    {
+        if (m_c == m_cmax)
+            grow(m_c + 1);
+        m_p[m_c++] = val;
+    }
+
+    void clear() { m_c = 0; }
+
+    T *data() { return m_p; }
+    const T *data() const { return m_p; }
+    size_t size() const { return m_c; }
+    bool empty() const { return m_c == 0; }
+    T &operator[](size_t i) { return m_p[i]; }
+    const T &operator[](size_t i) const { return m_p[i]; }
+    T *begin() { return m_p; }
+    T *end() { return m_p + m_c; }
+};
+
+// Number of operator new calls made by this thread, used to verify the hot paths don't allocate
+uint64_t alloc_count_thread();
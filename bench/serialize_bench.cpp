@@ -0,0 +1,137 @@
+/*
+ * Compares a JSON round trip (JSON.stringify + JSON.parse) with the structured clone in serialize.cpp for the
+ *  value shapes scripts typically hand to keydb.serialize(), worker jobs and custom types.  Needs V8:
+ *  make V8_PATH=/path/to/v8 bench/serialize_bench && bench/serialize_bench
+ */
+#include "../serialize.h"
+#include <libplatform/libplatform.h>
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// serialize.cpp allocates through the server's allocator, plain malloc stands in for it here
+void *(*RedisModule_Realloc)(void *ptr, size_t bytes) = realloc;
+void (*RedisModule_Free)(void *ptr) = free;
+
+bool FGetBufferData(v8::Local<v8::Value> val, const char **prgch, size_t *pcch)
+{
+    if (val->IsArrayBufferView())
+    {
+        v8::Local<v8::ArrayBufferView> view = v8::Local<v8::ArrayBufferView>::Cast(val);
+        *prgch = (const char*)view->Buffer()->GetBackingStore()->Data() + view->ByteOffset();
+        *pcch = view->ByteLength();
+        return true;
+    }
+    return false;
+}
+
+struct BenchShape
+{
+    const char *szName;
+    const char *szSource;   // an expression building the value
+};
+
+static const BenchShape c_rgshape[] = {
+    { "small record", "({id: 12345, name: 'user:12345', email: 'someone@example.com', active: true, score: 98.5, tags: ['a', 'bb', 'ccc']})" },
+    { "1k numbers", "Array.from({length: 1000}, (_, i) => i * 1.5)" },
+    { "100 records", "Array.from({length: 100}, (_, i) => ({id: i, name: 'user:' + i, score: i / 3, tags: ['x', 'y'], addr: {city: 'Toronto', zip: 'M5V' + i}}))" },
+    { "deep nesting", "(function() { let v = {leaf: 'value'}; for (let i = 0; i < 64; ++i) v = {depth: i, child: v}; return v; })()" },
+    { "10k key object", "(function() { const o = {}; for (let i = 0; i < 10000; ++i) o['field' + i] = i; return o; })()" },
+    { "64KB string", "'x'.repeat(64 * 1024)" },
+};
+
+static v8::Local<v8::Value> build_shape(v8::Isolate *isolate, v8::Local<v8::Context> context, const char *szSource)
+{
+    v8::Local<v8::String> source = v8::String::NewFromUtf8(isolate, szSource).ToLocalChecked();
+    v8::Local<v8::Script> script = v8::Script::Compile(context, source).ToLocalChecked();
+    return script->Run(context).ToLocalChecked();
+}
+
+static double us_per_iter(std::chrono::steady_clock::duration dur, int citer)
+{
+    return std::chrono::duration<double, std::micro>(dur).count() / citer;
+}
+
+static bool FBenchShape(v8::Isolate *isolate, v8::Local<v8::Context> context, const BenchShape &shape)
+{
+    v8::HandleScope scope(isolate);
+    v8::Local<v8::Value> val = build_shape(isolate, context, shape.szSource);
+
+    size_t cbJson = 0, cbClone = 0;
+    {
+        v8::HandleScope scopeT(isolate);
+        v8::String::Utf8Value json(isolate, v8::JSON::Stringify(context, val).ToLocalChecked());
+        cbJson = json.length();
+        SerializedValue sv;
+        if (!serialize_value(isolate, context, val, &sv))
+            return false;
+        cbClone = sv.size();
+    }
+
+    // Scale the iteration count so every shape takes a similar amount of time
+    int citer = (int)std::max<size_t>(20, (32 * 1024 * 1024) / std::max(cbJson, (size_t)1));
+
+    auto start = std::chrono::steady_clock::now();
+    for (int iiter = 0; iiter < citer; ++iiter)
+    {
+        v8::HandleScope scopeT(isolate);
+        v8::Local<v8::String> json = v8::JSON::Stringify(context, val).ToLocalChecked();
+        if (v8::JSON::Parse(context, json).IsEmpty())
+            return false;
+    }
+    double usJson = us_per_iter(std::chrono::steady_clock::now() - start, citer);
+
+    start = std::chrono::steady_clock::now();
+    for (int iiter = 0; iiter < citer; ++iiter)
+    {
+        v8::HandleScope scopeT(isolate);
+        SerializedValue sv;
+        if (!serialize_value(isolate, context, val, &sv))
+            return false;
+        if (deserialize_value(isolate, context, sv.data(), sv.size()).IsEmpty())
+            return false;
+    }
+    double usClone = us_per_iter(std::chrono::steady_clock::now() - start, citer);
+
+    printf("%16s %10zu %10zu %12.2f %12.2f %8.2fx\n", shape.szName, cbJson, cbClone, usJson, usClone, usJson / usClone);
+    return true;
+}
+
+int main(int, char *argv[])
+{
+    v8::V8::InitializeICUDefaultLocation(argv[0]);
+    v8::V8::InitializeExternalStartupData(argv[0]);
+    std::unique_ptr<v8::Platform> platform = v8::platform::NewDefaultPlatform();
+    v8::V8::InitializePlatform(platform.get());
+    v8::V8::Initialize();
+
+    std::unique_ptr<v8::ArrayBuffer::Allocator> allocator(v8::ArrayBuffer::Allocator::NewDefaultAllocator());
+    v8::Isolate::CreateParams create_params;
+    create_params.array_buffer_allocator = allocator.get();
+    v8::Isolate *isolate = v8::Isolate::New(create_params);
+
+    int rc = 0;
+    {
+        v8::Isolate::Scope isolate_scope(isolate);
+        v8::HandleScope handle_scope(isolate);
+        v8::Local<v8::Context> context = v8::Context::New(isolate);
+        v8::Context::Scope context_scope(context);
+
+        printf("%16s %10s %10s %12s %12s %9s\n", "shape", "JSON B", "clone B", "JSON us/op", "clone us/op", "speedup");
+        for (const BenchShape &shape : c_rgshape)
+        {
+            if (!FBenchShape(isolate, context, shape))
+            {
+                fprintf(stderr, "FAIL: round trip of '%s' failed\n", shape.szName);
+                rc = 1;
+            }
+        }
+    }
+
+    isolate->Dispose();
+    v8::V8::Dispose();
+    return rc;
+}
@@ -0,0 +1,142 @@
+/*
+ * Checks the SHA-NI block function against the portable one and measures both, plus XXH64 which the
+ *  script cache uses for its fast path.  Needs no V8:  make bench/sha256_bench && bench/sha256_bench
+ *  Exits nonzero if the implementations disagree.
+ */
+#include "../sha256.h"
+#include "../xxhash64.h"
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+static void hash_split(const std::vector<BYTE> &vec, std::mt19937_64 &rng, BYTE rgbHash[SHA256_BLOCK_SIZE])
+{
+    SHA256_CTX ctx;
+    sha256_init(&ctx);
+    size_t ib = 0;
+    while (ib < vec.size())
+    {
+        // Uneven splits exercise the partial block handling in sha256_update
+        size_t cb = std::min<size_t>(vec.size() - ib, rng() % 200);
+        sha256_update(&ctx, vec.data() + ib, cb);
+        ib += cb;
+    }
+    sha256_final(&ctx, rgbHash);
+}
+
+static bool FCheckKnownVector()
+{
+    static const BYTE rgbExpected[SHA256_BLOCK_SIZE] = {
+        0xba, 0x78, 0x16, 0xbf, 0x8f, 0x01, 0xcf, 0xea, 0x41, 0x41, 0x40, 0xde, 0x5d, 0xae, 0x22, 0x23,
+        0xb0, 0x03, 0x61, 0xa3, 0x96, 0x17, 0x7a, 0x9c, 0xb4, 0x10, 0xff, 0x61, 0xf2, 0x00, 0x15, 0xad,
+    };
+    SHA256_CTX ctx;
+    BYTE rgbHash[SHA256_BLOCK_SIZE];
+    sha256_init(&ctx);
+    sha256_update(&ctx, (const BYTE*)"abc", 3);
+    sha256_final(&ctx, rgbHash);
+    return memcmp(rgbHash, rgbExpected, sizeof(rgbHash)) == 0;
+}
+
+static double mb_per_sec(size_t cb, int citer, std::chrono::steady_clock::duration dur)
+{
+    double sec = std::chrono::duration<double>(dur).count();
+    return (double)cb * citer / (1024 * 1024) / sec;
+}
+
+static double bench_sha256(const std::vector<BYTE> &vec, int citer)
+{
+    BYTE rgbHash[SHA256_BLOCK_SIZE];
+    auto start = std::chrono::steady_clock::now();
+    for (int iiter = 0; iiter < citer; ++iiter)
+    {
+        SHA256_CTX ctx;
+        sha256_init(&ctx);
+        sha256_update(&ctx, vec.data(), vec.size());
+        sha256_final(&ctx, rgbHash);
+    }
+    return mb_per_sec(vec.size(), citer, std::chrono::steady_clock::now() - start);
+}
+
+static double bench_xxhash64(const std::vector<BYTE> &vec, int citer)
+{
+    volatile uint64_t hash = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int iiter = 0; iiter < citer; ++iiter)
+        hash = hash + xxhash64(vec.data(), vec.size());
+    return mb_per_sec(vec.size(), citer, std::chrono::steady_clock::now() - start);
+}
+
+int main()
+{
+    bool fAccelerated = sha256_set_portable(true);
+    if (!FCheckKnownVector())
+    {
+        fprintf(stderr, "FAIL: portable SHA-256 of \"abc\" is wrong\n");
+        return 1;
+    }
+
+    if (fAccelerated)
+    {
+        sha256_set_portable(false);
+        if (!FCheckKnownVector())
+        {
+            fprintf(stderr, "FAIL: SHA-NI SHA-256 of \"abc\" is wrong\n");
+            return 1;
+        }
+
+        // Same inputs and the same update splits through both implementations
+        std::mt19937_64 rng(42);
+        for (int itest = 0; itest < 2000; ++itest)
+        {
+            std::vector<BYTE> vec(rng() % 5000);
+            for (auto &b : vec)
+                b = (BYTE)rng();
+            uint64_t seed = rng();
+
+            BYTE rgbPortable[SHA256_BLOCK_SIZE], rgbShani[SHA256_BLOCK_SIZE];
+            std::mt19937_64 rngSplit(seed);
+            sha256_set_portable(true);
+            hash_split(vec, rngSplit, rgbPortable);
+            rngSplit.seed(seed);
+            sha256_set_portable(false);
+            hash_split(vec, rngSplit, rgbShani);
+            if (memcmp(rgbPortable, rgbShani, sizeof(rgbPortable)) != 0)
+            {
+                fprintf(stderr, "FAIL: SHA-NI and portable digests differ for a %zu byte input (test %d)\n", vec.size(), itest);
+                return 1;
+            }
+        }
+        printf("SHA-NI matches the portable code on 2000 random inputs\n");
+    }
+    else
+    {
+        printf("CPU has no SHA extensions, only the portable code was checked\n");
+    }
+
+    printf("%10s %14s %14s %14s\n", "size", "portable MB/s", "SHA-NI MB/s", "XXH64 MB/s");
+    for (size_t cb : { (size_t)64, (size_t)1024, (size_t)16 * 1024, (size_t)256 * 1024 })
+    {
+        std::vector<BYTE> vec(cb, 0xa5);
+        int citer = (int)std::max<size_t>(16, (64 * 1024 * 1024) / cb);
+
+        sha256_set_portable(true);
+        double mbsPortable = bench_sha256(vec, citer);
+        double mbsShani = 0;
+        if (fAccelerated)
+        {
+            sha256_set_portable(false);
+            mbsShani = bench_sha256(vec, citer);
+        }
+        double mbsXxh = bench_xxhash64(vec, citer * 4);
+
+        if (fAccelerated)
+            printf("%10zu %14.1f %14.1f %14.1f\n", cb, mbsPortable, mbsShani, mbsXxh);
+        else
+            printf("%10zu %14.1f %14s %14.1f\n", cb, mbsPortable, "n/a", mbsXxh);
+    }
+    return 0;
+}
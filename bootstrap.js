@@ -9,10 +9,134 @@ keydb.call = function(...args)
     return _internal.call(...args);
 }
 
+// Like call() but bulk string replies are returned as a Uint8Array so binary data is preserved
+keydb.callBuffer = function(...args)
+{
+    return _internal.callBuffer(...args);
+}
+
+// Runs a batch of commands, e.g. keydb.callMany([['get', 'a'], ['hget', 'h', 'f']]), returning an array of
+//  replies.  A command that fails produces an Error object in its slot instead of throwing
+keydb.callMany = function(commands)
+{
+    return _internal.callMany(commands);
+}
+
+// Returns an object for operating on a key directly, e.g. keydb.key("foo").get()
+keydb.key = function(name)
+{
+    return _internal.key(name);
+}
+
+// Calls fn(key, event) after keys matching keyPattern change, e.g. keydb.on("hash expired", "user:*", fn).
+//  fn runs inside the notification and may only read.  With {batch: true} fn instead gets an array of
+//  [key, event] pairs once per event loop tick, and may write
+keydb.on = function(eventTypes, keyPattern, fn, options = {})
+{
+    return _internal.on(eventTypes, keyPattern, fn, options);
+}
+
+// Timers run on the server's event loop between commands, so a callback sees the keyspace atomically just
+//  like a command does.  Extra arguments are passed to fn as in the browser
+function _timerCallback(fn, args)
+{
+    if (typeof fn !== 'function')
+        throw new TypeError("timer callback must be a function");
+    return args.length ? () => fn(...args) : fn;
+}
+
+keydb.setTimeout = function(fn, delay = 0, ...args)
+{
+    return _internal.setTimer(_timerCallback(fn, args), delay, false);
+}
+
+keydb.setInterval = function(fn, delay = 0, ...args)
+{
+    return _internal.setTimer(_timerCallback(fn, args), delay, true);
+}
+
+keydb.clearTimeout = function(id)
+{
+    _internal.clearTimer(id);
+}
+
+keydb.clearInterval = keydb.clearTimeout;
+
+// Runs the startup script function named fnName on a worker thread with a copy of data, returning a Promise
+//  for its result.  Return the Promise from a command to reply once it finishes without holding up the server
+keydb.runInBackground = function(fnName, data)
+{
+    return _internal.runInBackground(fnName, data);
+}
+
+// Encodes a value in V8's compact binary structured clone format as a Uint8Array, which can be stored with
+//  call('set', key, buf) and read back with deserialize(callBuffer('get', key)) without going through a string
+keydb.serialize = function(value)
+{
+    return _internal.serialize(value);
+}
+
+keydb.deserialize = function(buffer)
+{
+    return _internal.deserialize(buffer);
+}
+
+// Returns decoder(value) for a string key, reusing the decoded value until the key changes.  The value is
+//  shared between calls so it must not be modified.  With {buffer: true} the decoder gets a Uint8Array
+keydb.cachedGet = function(key, decoder = JSON.parse, options = {})
+{
+    return _internal.cachedGet(key, decoder, options.buffer === true);
+}
+
+// Calls fn(key) for the next batch of keys and returns the cursor to pass next time, 0 once done.
+//  Options are {count, match, type}, with {handle: true} fn also gets a keydb.key() handle
+keydb.scan = function(cursor, fn, options = {})
+{
+    return _internal.scan(cursor, fn, options);
+}
+
+// Calls fn(field, value) for every member of a hash, set or zset, options are {match}
+keydb.scanKey = function(key, fn, options = {})
+{
+    return _internal.scanKey(key, fn, options);
+}
+
+// Creates a data type whose keys hold a live JS value, e.g. var Sketch = keydb.createType("sketch-js", {});
+//  Sketch.get(key) returns the value itself so changes to it are made in place, call Sketch.replicate(key)
+//  after changing it to persist and replicate it.  The optional hooks are rdbSave(value), rdbLoad(data) and
+//  memUsage(value)
+keydb.createType = function(name, hooks = {})
+{
+    var id = _internal.createType(name, hooks);
+    return {
+        name: name,
+        get: function(key) { return _internal.typeGet(id, key); },
+        set: function(key, value) { _internal.typeSet(id, key, value); },
+        replicate: function(key) { _internal.typeReplicate(id, key); },
+    };
+}
+
+// register() accepts either the positional form or an options object, e.g.:
+//  keydb.register(fn, {flags: "readonly", keyFirst: 1, keyLast: 1, keyStep: 1, args: ["string", "int64", "rest"]})
 keydb.register = function(fn, flags = "write deny-oom random", keyFirst = 0, keyLast = 0, keyStep = 0)
 {
+    var options = {};
+    if (typeof flags === 'object') {
+        options = flags;
+        flags = ('flags' in options) ? options.flags : "write deny-oom random";
+        keyFirst = ('keyFirst' in options) ? options.keyFirst : 0;
+        keyLast = ('keyLast' in options) ? options.keyLast : 0;
+        keyStep = ('keyStep' in options) ? options.keyStep : 0;
+    }
     this.commands += fn;
-    return _internal.register(fn, flags, keyFirst, keyLast, keyStep);
+    return _internal.register(fn, flags, keyFirst, keyLast, keyStep, options);
+}
+
+// Number of native allocations the module has made on this thread.  Comparing it before and after some
+//  calls shows whether they allocate outside of the V8 heap
+keydb.allocCount = function()
+{
+    return _internal.allocCount();
 }
 
 keydb.log = function()
@@ -27,6 +151,10 @@ keydb.log = function()
 }
 
 var console = {log: keydb.log}  // alias keydb.log to console.log
+var setTimeout = keydb.setTimeout;
+var setInterval = keydb.setInterval;
+var clearTimeout = keydb.clearTimeout;
+var clearInterval = keydb.clearInterval;
 var redis = keydb;  // Alias
 
 keydb.log("verbose", "ModJS firmware v0.1.0 initialized");
@@ -0,0 +1,153 @@
+#include "codecache.h"
+#include <string.h>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <experimental/filesystem>
+#include <functional>
+#include <thread>
+#include <unistd.h>
+#include "sha256.h"
+
+static std::string g_strCodeCacheDir;
+
+static const char rgchMagic[4] = { 'M', 'J', 'S', 'C' };
+
+struct CodeCacheHeader
+{
+    char rgchMagic[4];
+    char szV8Version[32];
+    BYTE hash[SHA256_BLOCK_SIZE];
+    uint32_t cbData;
+};
+
+static void hash_source(const char *rgch, size_t cch, BYTE hash[SHA256_BLOCK_SIZE])
+{
+    SHA256_CTX ctx;
+    sha256_init(&ctx);
+    sha256_update(&ctx, (const BYTE*)rgch, cch);
+    sha256_final(&ctx, hash);
+}
+
+static std::experimental::filesystem::path cache_path(const BYTE hash[SHA256_BLOCK_SIZE])
+{
+    static const char rgchHex[] = "0123456789abcdef";
+    std::string strName;
+    strName.reserve(SHA256_BLOCK_SIZE * 2 + 6);
+    for (int ib = 0; ib < SHA256_BLOCK_SIZE; ++ib)
+    {
+        strName += rgchHex[hash[ib] >> 4];
+        strName += rgchHex[hash[ib] & 0xf];
+    }
+    strName += ".cache";
+    return std::experimental::filesystem::path(g_strCodeCacheDir) / strName;
+}
+
+static void init_header(CodeCacheHeader *header, const BYTE hash[SHA256_BLOCK_SIZE], uint32_t cbData)
+{
+    memset(header, 0, sizeof(*header));
+    memcpy(header->rgchMagic, rgchMagic, sizeof(rgchMagic));
+    strncpy(header->szV8Version, v8::V8::GetVersion(), sizeof(header->szV8Version) - 1);
+    memcpy(header->hash, hash, SHA256_BLOCK_SIZE);
+    header->cbData = cbData;
+}
+
+void codecache_set_directory(const char *szDir)
+{
+    g_strCodeCacheDir = szDir;
+}
+
+bool codecache_enabled()
+{
+    return !g_strCodeCacheDir.empty();
+}
+
+v8::ScriptCompiler::CachedData *codecache_load(const char *rgch, size_t cch)
+{
+    if (!codecache_enabled())
+        return nullptr;
+
+    BYTE hash[SHA256_BLOCK_SIZE];
+    hash_source(rgch, cch, hash);
+    auto path = cache_path(hash);
+
+    std::ifstream file(path.c_str(), std::ios::binary);
+    if (!file)
+        return nullptr;
+
+    CodeCacheHeader header, headerExpected;
+    if (!file.read((char*)&header, sizeof(header)))
+        return nullptr;
+
+    // Anything produced by a different V8 or for different source is stale
+    init_header(&headerExpected, hash, header.cbData);
+    if (memcmp(&header, &headerExpected, sizeof(header)))
+    {
+        codecache_discard(rgch, cch);
+        return nullptr;
+    }
+
+    // A truncated or corrupt entry must not make us allocate whatever size its header claims
+    std::error_code ec;
+    uintmax_t cbFile = std::experimental::filesystem::file_size(path, ec);
+    if (ec || cbFile != sizeof(header) + (uintmax_t)header.cbData)
+    {
+        codecache_discard(rgch, cch);
+        return nullptr;
+    }
+
+    uint8_t *rgbData = new uint8_t[header.cbData];
+    if (!file.read((char*)rgbData, header.cbData))
+    {
+        delete [] rgbData;
+        codecache_discard(rgch, cch);
+        return nullptr;
+    }
+    return new v8::ScriptCompiler::CachedData(rgbData, (int)header.cbData, v8::ScriptCompiler::CachedData::BufferOwned);
+}
+
+void codecache_save(const char *rgch, size_t cch, const v8::ScriptCompiler::CachedData *data)
+{
+    if (!codecache_enabled() || data == nullptr || data->length <= 0)
+        return;
+
+    BYTE hash[SHA256_BLOCK_SIZE];
+    hash_source(rgch, cch, hash);
+    auto path = cache_path(hash);
+
+    CodeCacheHeader header;
+    init_header(&header, hash, (uint32_t)data->length);
+
+    // Write to a temporary file first so a concurrent reader never sees a partial entry.  The name is unique
+    //  per process and thread so two writers compiling the same script (isolate per thread, or two servers
+    //  sharing the directory) never interleave their bytes in one file.
+    std::error_code ec;
+    std::experimental::filesystem::create_directories(g_strCodeCacheDir, ec);
+    auto pathTemp = path;
+    pathTemp += ".tmp." + std::to_string(getpid()) + "." + std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id()));
+    {
+        std::ofstream file(pathTemp.c_str(), std::ios::binary | std::ios::trunc);
+        file.write((const char*)&header, sizeof(header));
+        file.write((const char*)data->data, data->length);
+        file.close();
+        if (!file)
+        {
+            std::experimental::filesystem::remove(pathTemp, ec);
+            return;
+        }
+    }
+    std::experimental::filesystem::rename(pathTemp, path, ec);
+    if (ec)
+        std::experimental::filesystem::remove(pathTemp, ec);
+}
+
+void codecache_discard(const char *rgch, size_t cch)
+{
+    if (!codecache_enabled())
+        return;
+
+    BYTE hash[SHA256_BLOCK_SIZE];
+    hash_source(rgch, cch, hash);
+    std::error_code ec;
+    std::experimental::filesystem::remove(cache_path(hash), ec);
+}
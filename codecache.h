@@ -0,0 +1,16 @@
+#pragma once
+
+#include <stddef.h>
+#include <v8.h>
+
+/*
+ * On disk cache of V8 code for startup scripts and required modules.  Entries are keyed by the SHA-256
+ *  of the source and record the V8 version that produced them, stale entries are discarded on load.
+ */
+void codecache_set_directory(const char *szDir);
+bool codecache_enabled();
+
+// Returns the cached data for this source or nullptr on a miss, ownership passes to the caller
+v8::ScriptCompiler::CachedData *codecache_load(const char *rgch, size_t cch);
+void codecache_save(const char *rgch, size_t cch, const v8::ScriptCompiler::CachedData *data);
+void codecache_discard(const char *rgch, size_t cch);
@@ -0,0 +1,167 @@
+#include "decodedcache.h"
+#include <atomic>
+#include <vector>
+#include <algorithm>
+#include <string.h>
+
+static size_t g_cbMax = 64 * 1024 * 1024;
+static const size_t cbEntryOverhead = 128;  // rough cost of the entry, its map slot and the handle
+
+static std::mutex g_mutexCaches;
+static std::vector<DecodedCache*> g_veccaches;
+static std::atomic<bool> g_fActive { false };
+
+// Bumped by every invalidation so a value read before a change isn't cached after it
+static std::atomic<uint64_t> g_seq { 0 };
+// Bumped when every entry becomes stale at once
+static std::atomic<uint64_t> g_epoch { 0 };
+
+static std::atomic<uint64_t> g_chits { 0 };
+static std::atomic<uint64_t> g_cmisses { 0 };
+static std::atomic<uint64_t> g_cevictions { 0 };
+static std::atomic<uint64_t> g_cinvalidations { 0 };
+
+static void build_key(std::string &str, int db, const char *rgchKey, size_t cchKey)
+{
+    str.assign((const char*)&db, sizeof(db));
+    str.append(rgchKey, cchKey);
+}
+
+DecodedCache::DecodedCache()
+{
+    std::unique_lock<std::mutex> lock(g_mutexCaches);
+    g_veccaches.push_back(this);
+}
+
+DecodedCache::~DecodedCache()
+{
+    std::unique_lock<std::mutex> lock(g_mutexCaches);
+    g_veccaches.erase(std::remove(g_veccaches.begin(), g_veccaches.end(), this), g_veccaches.end());
+}
+
+void DecodedCache::erase(std::list<Entry>::iterator itr)
+{
+    m_cb -= itr->cb;
+    m_map.erase(std::string_view(itr->strKey));
+    m_lru.erase(itr);
+}
+
+v8::Local<v8::Value> DecodedCache::lookup(v8::Isolate *isolate, int db, const char *rgchKey, size_t cchKey, long long msNow)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    build_key(m_strLookup, db, rgchKey, cchKey);
+    auto itrMap = m_map.find(std::string_view(m_strLookup));
+    if (itrMap == m_map.end())
+    {
+        g_cmisses.fetch_add(1, std::memory_order_relaxed);
+        return v8::Local<v8::Value>();
+    }
+
+    auto itr = itrMap->second;
+    if (itr->fStale || itr->epoch != g_epoch.load(std::memory_order_acquire) || (itr->msExpire != 0 && itr->msExpire <= msNow))
+    {
+        erase(itr);
+        g_cmisses.fetch_add(1, std::memory_order_relaxed);
+        return v8::Local<v8::Value>();
+    }
+
+    m_lru.splice(m_lru.begin(), m_lru, itr);
+    g_chits.fetch_add(1, std::memory_order_relaxed);
+    return itr->value.Get(isolate);
+}
+
+void DecodedCache::insert(v8::Isolate *isolate, int db, const char *rgchKey, size_t cchKey, v8::Local<v8::Value> value, size_t cb, long long msExpire, uint64_t seqRead)
+{
+    cb += cchKey + cbEntryOverhead;
+    if (cb > g_cbMax)
+        return;
+    g_fActive.store(true, std::memory_order_relaxed);
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    if (g_seq.load(std::memory_order_acquire) != seqRead)
+        return;
+
+    build_key(m_strLookup, db, rgchKey, cchKey);
+    auto itrMap = m_map.find(std::string_view(m_strLookup));
+    if (itrMap != m_map.end())
+        erase(itrMap->second);
+
+    while (!m_lru.empty() && m_cb + cb > g_cbMax)
+    {
+        erase(std::prev(m_lru.end()));
+        g_cevictions.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    m_lru.emplace_front();
+    Entry &entry = m_lru.front();
+    entry.strKey = m_strLookup;
+    entry.value.Reset(isolate, value);
+    entry.cb = cb;
+    entry.msExpire = msExpire;
+    entry.epoch = g_epoch.load(std::memory_order_acquire);
+    m_map.emplace(std::string_view(entry.strKey), m_lru.begin());
+    m_cb += cb;
+}
+
+void DecodedCache::invalidate(const char *rgchKey, size_t cchKey)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    auto itrMap = m_map.find(std::string_view(rgchKey, cchKey));
+    if (itrMap == m_map.end() || itrMap->second->fStale)
+        return;
+
+    // The handle can only be released with the isolate locked, so the entry waits at the back of the LRU
+    itrMap->second->fStale = true;
+    m_lru.splice(m_lru.end(), m_lru, itrMap->second);
+    g_cinvalidations.fetch_add(1, std::memory_order_relaxed);
+}
+
+void DecodedCache::clear()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_map.clear();
+    m_lru.clear();
+    m_cb = 0;
+}
+
+void decodedcache_set_max_bytes(size_t cb)
+{
+    g_cbMax = cb;
+}
+
+bool decodedcache_active()
+{
+    return g_fActive.load(std::memory_order_relaxed);
+}
+
+void decodedcache_invalidate(int db, const char *rgchKey, size_t cchKey)
+{
+    static thread_local std::string s_strKey;
+    g_seq.fetch_add(1, std::memory_order_acq_rel);
+    build_key(s_strKey, db, rgchKey, cchKey);
+
+    std::unique_lock<std::mutex> lock(g_mutexCaches);
+    for (DecodedCache *pcache : g_veccaches)
+        pcache->invalidate(s_strKey.data(), s_strKey.size());
+}
+
+void decodedcache_invalidate_all()
+{
+    g_seq.fetch_add(1, std::memory_order_acq_rel);
+    g_epoch.fetch_add(1, std::memory_order_acq_rel);
+}
+
+uint64_t decodedcache_seq()
+{
+    return g_seq.load(std::memory_order_acquire);
+}
+
+DecodedCacheStats decodedcache_stats()
+{
+    DecodedCacheStats stats;
+    stats.hits = g_chits.load(std::memory_order_relaxed);
+    stats.misses = g_cmisses.load(std::memory_order_relaxed);
+    stats.evictions = g_cevictions.load(std::memory_order_relaxed);
+    stats.invalidations = g_cinvalidations.load(std::memory_order_relaxed);
+    return stats;
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <list>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <v8.h>
+
+/*
+ * Decoded values for keydb.cachedGet(), bounded by an approximate byte size with LRU eviction.  Each isolate
+ *  has its own since the values are JS handles.  Keyspace events can arrive on any thread, so invalidation
+ *  only marks an entry stale and its handle is released later by a thread holding the isolate's lock.
+ */
+class DecodedCache
+{
+    struct Entry
+    {
+        std::string strKey;     // db number followed by the key name
+        v8::Global<v8::Value> value;
+        size_t cb;
+        long long msExpire;     // when the key expires in server time, 0 if it doesn't
+        uint64_t epoch;
+        bool fStale = false;
+    };
+
+    std::mutex m_mutex;
+    std::list<Entry> m_lru;     // most recently used first, stale entries are moved to the back
+    std::unordered_map<std::string_view, std::list<Entry>::iterator> m_map;
+    std::string m_strLookup;    // scratch buffer so lookups don't allocate
+    size_t m_cb = 0;
+
+    void erase(std::list<Entry>::iterator itr);
+
+public:
+    DecodedCache();
+    ~DecodedCache();
+
+    // Returns the value cached for the key, or an empty handle if there is none or the key has expired by
+    //  msNow.  Call with the isolate locked
+    v8::Local<v8::Value> lookup(v8::Isolate *isolate, int db, const char *rgchKey, size_t cchKey, long long msNow);
+    // seqRead is decodedcache_seq() from before the key was read, the value isn't cached if the key may
+    //  have changed since.  Hits stop once msExpire passes, expiring a key doesn't always raise an event
+    void insert(v8::Isolate *isolate, int db, const char *rgchKey, size_t cchKey, v8::Local<v8::Value> value, size_t cb, long long msExpire, uint64_t seqRead);
+    void invalidate(const char *rgchKey, size_t cchKey);
+    void clear();
+};
+
+// Maximum approximate size of each isolate's cache
+void decodedcache_set_max_bytes(size_t cb);
+
+// True once anything has been cached, until then keyspace events don't need to be looked at
+bool decodedcache_active();
+
+// Called for every change to a key, from any thread
+void decodedcache_invalidate(int db, const char *rgchKey, size_t cchKey);
+// Called when keys change without per key events (FLUSHDB, SWAPDB, loading a dataset)
+void decodedcache_invalidate_all();
+uint64_t decodedcache_seq();
+
+struct DecodedCacheStats
+{
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t invalidations;
+};
+DecodedCacheStats decodedcache_stats();
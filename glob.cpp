@@ -0,0 +1,112 @@
+#include "glob.h"
+
+bool glob_matches_all(const char *rgchPattern, size_t cchPattern)
+{
+    return cchPattern == 1 && rgchPattern[0] == '*';
+}
+
+// Matches a [...] class starting just after the '[', advancing *pich past the closing ']'
+static bool FMatchClass(const char *rgchPattern, size_t cchPattern, size_t *pich, char ch)
+{
+    size_t ich = *pich;
+    bool fNot = false;
+    bool fMatch = false;
+    if (ich < cchPattern && rgchPattern[ich] == '^')
+    {
+        fNot = true;
+        ++ich;
+    }
+
+    while (ich < cchPattern && rgchPattern[ich] != ']')
+    {
+        if (rgchPattern[ich] == '\\' && ich + 1 < cchPattern)
+        {
+            ++ich;
+            if (rgchPattern[ich] == ch)
+                fMatch = true;
+        }
+        else if (ich + 2 < cchPattern && rgchPattern[ich+1] == '-')
+        {
+            char chStart = rgchPattern[ich];
+            char chEnd = rgchPattern[ich+2];
+            if (chStart > chEnd)
+            {
+                char chT = chStart;
+                chStart = chEnd;
+                chEnd = chT;
+            }
+            if (ch >= chStart && ch <= chEnd)
+                fMatch = true;
+            ich += 2;
+        }
+        else if (rgchPattern[ich] == ch)
+        {
+            fMatch = true;
+        }
+        ++ich;
+    }
+
+    // An unterminated class runs to the end of the pattern, as it does in the server
+    *pich = (ich < cchPattern) ? ich + 1 : ich;
+    return fNot ? !fMatch : fMatch;
+}
+
+bool glob_match(const char *rgchPattern, size_t cchPattern, const char *rgch, size_t cch)
+{
+    // Iterative matching, on a mismatch we backtrack to just after the last '*'
+    size_t ichPat = 0, ich = 0;
+    size_t ichPatStar = (size_t)-1, ichStar = 0;
+    while (ich < cch)
+    {
+        if (ichPat < cchPattern)
+        {
+            char chPat = rgchPattern[ichPat];
+            if (chPat == '*')
+            {
+                while (ichPat < cchPattern && rgchPattern[ichPat] == '*')
+                    ++ichPat;
+                if (ichPat == cchPattern)
+                    return true;
+                ichPatStar = ichPat;
+                ichStar = ich;
+                continue;
+            }
+            if (chPat == '?')
+            {
+                ++ichPat;
+                ++ich;
+                continue;
+            }
+            if (chPat == '[')
+            {
+                size_t ichT = ichPat + 1;
+                if (FMatchClass(rgchPattern, cchPattern, &ichT, rgch[ich]))
+                {
+                    ichPat = ichT;
+                    ++ich;
+                    continue;
+                }
+            }
+            else
+            {
+                if (chPat == '\\' && ichPat + 1 < cchPattern)
+                    chPat = rgchPattern[++ichPat];
+                if (chPat == rgch[ich])
+                {
+                    ++ichPat;
+                    ++ich;
+                    continue;
+                }
+            }
+        }
+
+        if (ichPatStar == (size_t)-1)
+            return false;
+        ichPat = ichPatStar;
+        ich = ++ichStar;
+    }
+
+    while (ichPat < cchPattern && rgchPattern[ichPat] == '*')
+        ++ichPat;
+    return ichPat == cchPattern;
+}
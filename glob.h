@@ -0,0 +1,12 @@
+#pragma once
+
+#include <stddef.h>
+
+/*
+ * Glob style matching with the same syntax as the server's KEYS and SCAN MATCH: '*', '?', '[abc]', '[^a-z]'
+ *  and '\' to escape.  Lets us filter keys natively before entering V8.
+ */
+bool glob_match(const char *rgchPattern, size_t cchPattern, const char *rgch, size_t cch);
+
+// True if the pattern is "*", callers can skip matching entirely
+bool glob_matches_all(const char *rgchPattern, size_t cchPattern);
@@ -4,13 +4,99 @@
 #include <fstream>
 #include <streambuf>
 #include <stack>
+#include <algorithm>
+#include <ctype.h>
 #include <experimental/filesystem>
 #include "sha256.h"
 #include "version.h"
+#include "codecache.h"
+#include "arena.h"
+#include "glob.h"
+#include "serialize.h"
 
 void KeyDBExecuteCallback(const v8::FunctionCallbackInfo<v8::Value>& args);
+void KeyDBExecuteBufferCallback(const v8::FunctionCallbackInfo<v8::Value>& args);
+void KeyDBExecuteManyCallback(const v8::FunctionCallbackInfo<v8::Value>& args);
 void RegisterCommandCallback(const v8::FunctionCallbackInfo<v8::Value>& args);
 void LogCallback(const v8::FunctionCallbackInfo<v8::Value>& args);
+void KeyCallback(const v8::FunctionCallbackInfo<v8::Value>& args);
+void OnKeyspaceEventCallback(const v8::FunctionCallbackInfo<v8::Value>& args);
+void SetTimerCallback(const v8::FunctionCallbackInfo<v8::Value>& args);
+void ClearTimerCallback(const v8::FunctionCallbackInfo<v8::Value>& args);
+void RunInBackgroundCallback(const v8::FunctionCallbackInfo<v8::Value>& args);
+void CreateTypeCallback(const v8::FunctionCallbackInfo<v8::Value>& args);
+void CachedGetCallback(const v8::FunctionCallbackInfo<v8::Value>& args);
+void ScanCallback(const v8::FunctionCallbackInfo<v8::Value>& args);
+void ScanKeyCallback(const v8::FunctionCallbackInfo<v8::Value>& args);
+void TypeGetCallback(const v8::FunctionCallbackInfo<v8::Value>& args);
+void TypeSetCallback(const v8::FunctionCallbackInfo<v8::Value>& args);
+void TypeReplicateCallback(const v8::FunctionCallbackInfo<v8::Value>& args);
+v8::Local<v8::FunctionTemplate> CreateKeyTemplate(v8::Isolate *isolate);
+
+extern void *(*RedisModule_Alloc)(size_t bytes);
+extern void (*RedisModule_Free)(void *ptr);
+extern void *(*RedisModule_Calloc)(size_t nmemb, size_t size);
+
+// Backs ArrayBuffers with the server's allocator so they count towards used_memory and maxmemory.  The
+//  server's allocator aborts when it runs out, so buffers are held to a budget shared by every isolate.
+//  Returning nullptr makes V8 throw a RangeError in the script instead.
+class ModuleArrayBufferAllocator : public v8::ArrayBuffer::Allocator
+{
+    std::atomic<size_t> m_cbAllocated { 0 };
+    size_t m_cbMax = 1024ULL * 1024 * 1024;
+
+    bool FReserve(size_t length)
+    {
+        if (m_cbMax == 0)
+            return true;
+        size_t cbPrev = m_cbAllocated.fetch_add(length, std::memory_order_relaxed);
+        if (length > m_cbMax || cbPrev > m_cbMax - length)
+        {
+            m_cbAllocated.fetch_sub(length, std::memory_order_relaxed);
+            return false;
+        }
+        return true;
+    }
+
+public:
+    void setLimit(size_t cbMax) { m_cbMax = cbMax; }
+
+    virtual void *Allocate(size_t length) override
+    {
+        if (!FReserve(length))
+            return nullptr;
+        return RedisModule_Calloc(1, length);
+    }
+
+    virtual void *AllocateUninitialized(size_t length) override
+    {
+        if (!FReserve(length))
+            return nullptr;
+        return RedisModule_Alloc(length);
+    }
+
+    virtual void Free(void *data, size_t length) override
+    {
+        RedisModule_Free(data);
+        if (m_cbMax != 0)
+            m_cbAllocated.fetch_sub(length, std::memory_order_relaxed);
+    }
+};
+
+static ModuleArrayBufferAllocator s_arraybufferallocator;
+static size_t s_cbMaxOldGeneration = 0;
+static size_t s_cbMaxYoungGeneration = 0;
+
+void javascript_set_array_buffer_limit(size_t cbMax)
+{
+    s_arraybufferallocator.setLimit(cbMax);
+}
+
+void javascript_set_heap_limits(size_t cbMaxOld, size_t cbMaxYoung)
+{
+    s_cbMaxOldGeneration = cbMaxOld;
+    s_cbMaxYoungGeneration = cbMaxYoung;
+}
 
 void javascript_initialize()
 {
@@ -27,48 +113,6 @@ void javascript_shutdown()
     v8::V8::Dispose();
 }
 
-class HotScript
-{
-    v8::Persistent<v8::Script> m_script;
-    size_t m_cch;
-    BYTE m_hash[SHA256_BLOCK_SIZE];
-
-public:
-    HotScript(v8::Isolate *isolate, const char *rgch, size_t cch, v8::Local<v8::Script> script)
-        : m_script(isolate, script), m_cch(cch)
-    {
-        SHA256_CTX ctx;
-        sha256_init(&ctx);
-        sha256_update(&ctx, (BYTE*)rgch, cch);
-        sha256_final(&ctx, m_hash);
-    }
-
-    bool FGetScript(v8::Isolate *isolate, const char *rgch, size_t cch, v8::Local<v8::Script> *pscriptOut)
-    {
-        if (cch != m_cch)
-            return false;
-
-        BYTE hashT[SHA256_BLOCK_SIZE];
-        SHA256_CTX ctx;
-        sha256_init(&ctx);
-        sha256_update(&ctx, (BYTE*)rgch, cch);
-        sha256_final(&ctx, hashT);
-
-        return FGetScript(isolate, hashT, pscriptOut);
-    }
-
-    bool FGetScript(v8::Isolate *isolate, const BYTE *hash, v8::Local<v8::Script> *pscriptOut)
-    {
-        if (memcmp(m_hash, hash, SHA256_BLOCK_SIZE))
-            return false;
-
-        *pscriptOut = v8::Local<v8::Script>::New(isolate, m_script);
-        if (pscriptOut->IsEmpty())
-            return false;
-        return true;
-    }
-};
-
 template<typename T>
 class StackPopper
 {
@@ -117,24 +161,22 @@ std::experimental::filesystem::path find_module(std::experimental::filesystem::p
     return name;
 }
 
-/*static*/ void JSContext::RequireCallback(const v8::FunctionCallbackInfo<v8::Value>& args)
+// Resolves a require() specifier to the canonical path of the file to load, or an empty string if there is none.
+//  Results are memoized so the filesystem is only searched the first time a specifier is seen from a directory
+std::string JSContext::resolveModule(const std::string &strSpecifier, const std::string &strReferrerDir)
 {
-    static thread_local std::stack<std::experimental::filesystem::path> stackpath;
-    v8::Isolate *isolate = args.GetIsolate();
-
-    if (args.Length() != 1) return;
-
-    JSContext *jscontext = (JSContext*)isolate->GetData(0);
-
-    v8::HandleScope scope(isolate);
-    v8::Local<v8::Value> arg = args[0];
-    v8::String::Utf8Value utf8Path(isolate, arg);
-    
-    std::experimental::filesystem::path path(*utf8Path);
-    if (path.is_relative() && !stackpath.empty())
+    std::string strKey = strReferrerDir;
+    strKey += '\0';
+    strKey += strSpecifier;
+    auto itr = m_mapresolve.find(strKey);
+    if (itr != m_mapresolve.end())
+        return itr->second;
+
+    std::experimental::filesystem::path path(strSpecifier);
+    if (path.is_relative() && !strReferrerDir.empty())
     {
         // We have to make this relative to the previous file
-        auto trypath = stackpath.top().remove_filename() / path;
+        auto trypath = std::experimental::filesystem::path(strReferrerDir) / path;
         if (std::experimental::filesystem::exists(trypath))
         {
             path = trypath;
@@ -145,7 +187,7 @@ std::experimental::filesystem::path find_module(std::experimental::filesystem::p
         }
         else
         {
-            trypath = stackpath.top().remove_filename() / path / "index.js";
+            trypath = std::experimental::filesystem::path(strReferrerDir) / path / "index.js";
             if (std::experimental::filesystem::exists(trypath))
                 path = trypath;
         }
@@ -155,6 +197,51 @@ std::experimental::filesystem::path find_module(std::experimental::filesystem::p
         path = find_module(path);
     }
 
+    std::error_code ec;
+    auto pathCanonical = std::experimental::filesystem::canonical(path, ec);
+    if (ec || !std::experimental::filesystem::is_regular_file(pathCanonical, ec))
+        return std::string();   // not cached, the file may be created later
+
+    std::string strPath = pathCanonical.string();
+    m_mapresolve.emplace(std::move(strKey), strPath);
+    return strPath;
+}
+
+/*static*/ void JSContext::RequireCallback(const v8::FunctionCallbackInfo<v8::Value>& args)
+{
+    static thread_local std::stack<std::experimental::filesystem::path> stackpath;
+    v8::Isolate *isolate = args.GetIsolate();
+
+    if (args.Length() != 1) return;
+
+    JSContext *jscontext = (JSContext*)isolate->GetData(0);
+    stats_count_require();
+
+    v8::HandleScope scope(isolate);
+    v8::Local<v8::Value> arg = args[0];
+    v8::String::Utf8Value utf8Path(isolate, arg);
+    if (*utf8Path == nullptr)
+        return;
+
+    std::string strReferrerDir;
+    if (!stackpath.empty())
+        strReferrerDir = stackpath.top().parent_path().string();
+    std::string strPath = jscontext->resolveModule(std::string(*utf8Path, utf8Path.length()), strReferrerDir);
+    if (strPath.empty())
+    {
+        isolate->ThrowException(v8::String::NewFromUtf8(isolate, "File not found").ToLocalChecked());
+        return;
+    }
+
+    // Like node each module is only evaluated once, later requires share its exports
+    auto itrModule = jscontext->m_mapmodules.find(strPath);
+    if (itrModule != jscontext->m_mapmodules.end())
+    {
+        args.GetReturnValue().Set(itrModule->second.Get(isolate));
+        return;
+    }
+    std::experimental::filesystem::path path(strPath);
+
     std::ifstream file(path.c_str(), std::ios::binary | std::ios::ate);
     std::streamsize size = file.tellg();
     if (size == -1)
@@ -176,7 +263,7 @@ std::experimental::filesystem::path find_module(std::experimental::filesystem::p
     v8::Local<v8::ObjectTemplate> global = v8::Local<v8::ObjectTemplate>::New(isolate, jscontext->m_global);
     v8::Local<v8::Context> context = v8::Context::New(isolate, nullptr, global);
 
-    v8::ScriptOrigin origin(arg,      // specifier
+    v8::ScriptOrigin origin(v8::String::NewFromUtf8(isolate, strPath.c_str()).ToLocalChecked(),      // canonical path
         v8::Integer::New(isolate, 0),             // line offset
         v8::Integer::New(isolate, 0),             // column offset
         v8::False(isolate),                       // is cross origin
@@ -193,13 +280,19 @@ std::experimental::filesystem::path find_module(std::experimental::filesystem::p
                                 v8::NewStringType::kNormal, buffer.size())
             .ToLocalChecked();
 
-    v8::ScriptCompiler::Source source(source_text, origin);
+    v8::ScriptCompiler::CachedData *cachedData = codecache_load(buffer.data(), buffer.size());
+    v8::ScriptCompiler::Source source(source_text, origin, cachedData);
+    auto options = (cachedData != nullptr) ? v8::ScriptCompiler::kConsumeCodeCache : v8::ScriptCompiler::kNoCompileOptions;
 
     v8::Local<v8::Module> module;
-    if (!v8::ScriptCompiler::CompileModule(isolate, &source).ToLocal(&module)) {
+    if (!v8::ScriptCompiler::CompileModule(isolate, &source, options).ToLocal(&module)) {
         return;
     }
 
+    bool fWriteCodeCache = codecache_enabled() && (cachedData == nullptr || cachedData->rejected);
+    if (cachedData != nullptr && cachedData->rejected)
+        codecache_discard(buffer.data(), buffer.size());
+
     bool flagT;
     auto maybeInstantiated = module->InstantiateModule(context, [](v8::Local<v8::Context> /*context*/, // "main.mjs"
                                       v8::Local<v8::String> /*specifier*/, // "some thing"
@@ -217,13 +310,33 @@ std::experimental::filesystem::path find_module(std::experimental::filesystem::p
     if (!maybeSet.To(&flagT) || !flagT)
         return;
 
+    // A circular require() gets the exports as they are so far instead of evaluating the module again
+    auto &globalExports = jscontext->m_mapmodules[strPath];
+    globalExports.Reset(isolate, exports);
+
     v8::Local<v8::Value> result;
-    if (module->Evaluate(context).ToLocal(&result)) {
+    if (!module->Evaluate(context).ToLocal(&result))
+    {
+        jscontext->m_mapmodules.erase(strPath);
+        return;
+    }
+
+    {
         // Even though we got exports above, we have to get it again now that the module was evaluated,
         //  this is because the module could have changed the object
         auto maybeExports = valModule->Get(context, strExport);
         if (maybeExports.ToLocal(&exports))
+        {
+            jscontext->m_mapmodules[strPath].Reset(isolate, exports);
             args.GetReturnValue().Set(exports);
+        }
+
+        // Now that it has run the cache will include the functions that were lazily compiled
+        if (fWriteCodeCache)
+        {
+            std::unique_ptr<v8::ScriptCompiler::CachedData> spdata(v8::ScriptCompiler::CreateCodeCache(module->GetUnboundModuleScript()));
+            codecache_save(buffer.data(), buffer.size(), spdata.get());
+        }
     }
 }
 
@@ -236,6 +349,12 @@ static void VersionCallback(const v8::FunctionCallbackInfo<v8::Value>& args)
     args.GetReturnValue().Set(strVersion);
 }
 
+// Returns how many times the module has allocated on this thread, a Number is exact up to 2^53
+static void AllocCountCallback(const v8::FunctionCallbackInfo<v8::Value>& args)
+{
+    args.GetReturnValue().Set(v8::Number::New(args.GetIsolate(), (double)alloc_count_thread()));
+}
+
 void JSContext::javascript_hooks_initialize(v8::Local<v8::ObjectTemplate> &keydb_obj)
 {
     keydb_obj->Set(v8::String::NewFromUtf8(isolate, "log", v8::NewStringType::kNormal)
@@ -246,21 +365,99 @@ void JSContext::javascript_hooks_initialize(v8::Local<v8::ObjectTemplate> &keydb
         .ToLocalChecked(),
         v8::FunctionTemplate::New(isolate, KeyDBExecuteCallback));
 
+    keydb_obj->Set(v8::String::NewFromUtf8(isolate, "callBuffer", v8::NewStringType::kNormal)
+        .ToLocalChecked(),
+        v8::FunctionTemplate::New(isolate, KeyDBExecuteBufferCallback));
+
+    keydb_obj->Set(v8::String::NewFromUtf8(isolate, "callMany", v8::NewStringType::kNormal)
+        .ToLocalChecked(),
+        v8::FunctionTemplate::New(isolate, KeyDBExecuteManyCallback));
+
+    keydb_obj->Set(v8::String::NewFromUtf8(isolate, "key", v8::NewStringType::kNormal)
+        .ToLocalChecked(),
+        v8::FunctionTemplate::New(isolate, KeyCallback));
+
     keydb_obj->Set(v8::String::NewFromUtf8(isolate, "register", v8::NewStringType::kNormal)
         .ToLocalChecked(),
         v8::FunctionTemplate::New(isolate, RegisterCommandCallback));
 
+    keydb_obj->Set(v8::String::NewFromUtf8(isolate, "on", v8::NewStringType::kNormal)
+        .ToLocalChecked(),
+        v8::FunctionTemplate::New(isolate, OnKeyspaceEventCallback));
+
+    keydb_obj->Set(v8::String::NewFromUtf8(isolate, "setTimer", v8::NewStringType::kNormal)
+        .ToLocalChecked(),
+        v8::FunctionTemplate::New(isolate, SetTimerCallback));
+
+    keydb_obj->Set(v8::String::NewFromUtf8(isolate, "clearTimer", v8::NewStringType::kNormal)
+        .ToLocalChecked(),
+        v8::FunctionTemplate::New(isolate, ClearTimerCallback));
+
+    keydb_obj->Set(v8::String::NewFromUtf8(isolate, "runInBackground", v8::NewStringType::kNormal)
+        .ToLocalChecked(),
+        v8::FunctionTemplate::New(isolate, RunInBackgroundCallback));
+
+    keydb_obj->Set(v8::String::NewFromUtf8(isolate, "createType", v8::NewStringType::kNormal)
+        .ToLocalChecked(),
+        v8::FunctionTemplate::New(isolate, CreateTypeCallback));
+
+    keydb_obj->Set(v8::String::NewFromUtf8(isolate, "typeGet", v8::NewStringType::kNormal)
+        .ToLocalChecked(),
+        v8::FunctionTemplate::New(isolate, TypeGetCallback));
+
+    keydb_obj->Set(v8::String::NewFromUtf8(isolate, "typeSet", v8::NewStringType::kNormal)
+        .ToLocalChecked(),
+        v8::FunctionTemplate::New(isolate, TypeSetCallback));
+
+    keydb_obj->Set(v8::String::NewFromUtf8(isolate, "typeReplicate", v8::NewStringType::kNormal)
+        .ToLocalChecked(),
+        v8::FunctionTemplate::New(isolate, TypeReplicateCallback));
+
+    keydb_obj->Set(v8::String::NewFromUtf8(isolate, "cachedGet", v8::NewStringType::kNormal)
+        .ToLocalChecked(),
+        v8::FunctionTemplate::New(isolate, CachedGetCallback));
+
+    keydb_obj->Set(v8::String::NewFromUtf8(isolate, "scan", v8::NewStringType::kNormal)
+        .ToLocalChecked(),
+        v8::FunctionTemplate::New(isolate, ScanCallback));
+
+    keydb_obj->Set(v8::String::NewFromUtf8(isolate, "scanKey", v8::NewStringType::kNormal)
+        .ToLocalChecked(),
+        v8::FunctionTemplate::New(isolate, ScanKeyCallback));
+
+    keydb_obj->Set(v8::String::NewFromUtf8(isolate, "serialize", v8::NewStringType::kNormal)
+        .ToLocalChecked(),
+        v8::FunctionTemplate::New(isolate, SerializeCallback));
+
+    keydb_obj->Set(v8::String::NewFromUtf8(isolate, "deserialize", v8::NewStringType::kNormal)
+        .ToLocalChecked(),
+        v8::FunctionTemplate::New(isolate, DeserializeCallback));
+
     keydb_obj->Set(v8::String::NewFromUtf8(isolate, "version", v8::NewStringType::kNormal)
         .ToLocalChecked(),
         v8::FunctionTemplate::New(isolate, VersionCallback));
+
+    keydb_obj->Set(v8::String::NewFromUtf8(isolate, "allocCount", v8::NewStringType::kNormal)
+        .ToLocalChecked(),
+        v8::FunctionTemplate::New(isolate, AllocCountCallback));
 }
 
 void JSContext::initialize()
 {
     v8::Isolate::CreateParams create_params;
-    create_params.array_buffer_allocator = v8::ArrayBuffer::Allocator::NewDefaultAllocator();
+    create_params.array_buffer_allocator = &s_arraybufferallocator;
+    if (s_cbMaxOldGeneration != 0)
+        create_params.constraints.set_max_old_generation_size_in_bytes(s_cbMaxOldGeneration);
+    if (s_cbMaxYoungGeneration != 0)
+        create_params.constraints.set_max_young_generation_size_in_bytes(s_cbMaxYoungGeneration);
     isolate = v8::Isolate::New(create_params);
 
+    // Running out of heap would otherwise abort the whole server
+    isolate->AddNearHeapLimitCallback(NearHeapLimitCallback, this);
+    isolate->AutomaticallyRestoreInitialHeapLimit();
+    m_pisolatestats = stats_attach_isolate(isolate);
+    m_pwatchdog = watchdog_attach(isolate);
+
     v8::HandleScope handle_scope(isolate);
 
     // Create a template for the global object where we set the
@@ -287,6 +484,7 @@ void JSContext::initialize()
 
 
     isolate->SetData(0, this);
+    m_keytemplate = v8::Persistent<v8::FunctionTemplate, v8::CopyablePersistentTraits<v8::FunctionTemplate>>(isolate, CreateKeyTemplate(isolate));
     m_global = v8::Persistent<v8::ObjectTemplate, v8::CopyablePersistentTraits<v8::ObjectTemplate>>(isolate, global);
     m_context = v8::Persistent<v8::Context, v8::CopyablePersistentTraits<v8::Context>>(isolate, v8::Context::New(isolate, nullptr, global));
 }
@@ -324,6 +522,11 @@ v8::Local<v8::Value> JSContext::run(v8::Local<v8::Context> &context, v8::Local<v
 
     if (!resultMaybe.ToLocal(&result))
     {
+        if (FHeapLimitReached())
+            throw std::string("ERR script exceeded the JavaScript heap limit");
+        std::string strErr;
+        if (watchdog_consume_termination(m_pwatchdog, &strErr))
+            throw strErr;
         if (trycatch.HasCaught())
         {
             throw prettyPrintException(trycatch);
@@ -335,6 +538,35 @@ v8::Local<v8::Value> JSContext::run(v8::Local<v8::Context> &context, v8::Local<v
     return result;
 }
 
+v8::Local<v8::Script> JSContext::compile(v8::Local<v8::Context> &context, v8::TryCatch &trycatch, const char *rgch, size_t cch,
+    v8::ScriptCompiler::CachedData *cachedData, bool *pfCacheRejected)
+{
+    // Create a string containing the JavaScript source code.
+    v8::Local<v8::String> sourceText =
+        v8::String::NewFromUtf8(isolate, rgch,
+                                v8::NewStringType::kInternalized, cch)
+            .ToLocalChecked();
+
+    auto options = (cachedData != nullptr) ? v8::ScriptCompiler::kConsumeCodeCache : v8::ScriptCompiler::kNoCompileOptions;
+    v8::ScriptCompiler::Source source(sourceText, cachedData);
+
+    // Compile the source code.
+    v8::MaybeLocal<v8::Script> scriptMaybe = v8::ScriptCompiler::Compile(context, &source, options);
+    if (pfCacheRejected != nullptr)
+        *pfCacheRejected = (cachedData != nullptr && cachedData->rejected);
+
+    v8::Local<v8::Script> script;
+    if (!scriptMaybe.ToLocal(&script))
+    {
+        if (trycatch.HasCaught())
+        {
+            throw prettyPrintException(trycatch);
+        }
+        throw std::nullptr_t();
+    }
+    return script;
+}
+
 v8::Local<v8::Value> JSContext::run(const char *rgch, size_t cch, bool fNoCache)
 {
     v8::TryCatch trycatch(isolate);
@@ -344,35 +576,181 @@ v8::Local<v8::Value> JSContext::run(const char *rgch, size_t cch, bool fNoCache)
     v8::Context::Scope context_scope(context);
 
     v8::Local<v8::Script> script;
-    if (fNoCache || m_sphotscript == nullptr || !m_sphotscript->FGetScript(isolate, rgch, cch, &script))
+    bool fWriteCodeCache = false;
+    if (fNoCache)
+    {
+        // Scripts we don't keep hot (startup scripts) are run once per process, so use the on disk cache
+        v8::ScriptCompiler::CachedData *cachedData = codecache_load(rgch, cch);
+        bool fRejected = false;
+        script = compile(context, trycatch, rgch, cch, cachedData, &fRejected);
+
+        fWriteCodeCache = codecache_enabled() && (cachedData == nullptr || fRejected);
+        if (fRejected)
+            codecache_discard(rgch, cch);
+    }
+    else
+    {
+        // The SHA-256 is only needed to identify new scripts, lookups use a much cheaper hash
+        if (!m_scriptcache.FGetScript(isolate, rgch, cch, &script))
+        {
+            script = compile(context, trycatch, rgch, cch);
+            ScriptHash hash;
+            hash_script(rgch, cch, &hash);
+            m_scriptcache.insert(isolate, hash, rgch, cch, script);
+            // Like EVAL, the script can then be run by EVALSHAJS even after it is evicted
+            scriptcache_register_source(hash, rgch, cch);
+        }
+    }
+
+    v8::Local<v8::Value> result = run(context, script);
+    if (fWriteCodeCache)
     {
-        // Create a string containing the JavaScript source code.
-        v8::Local<v8::String> sourceText =
-            v8::String::NewFromUtf8(isolate, rgch,
-                                    v8::NewStringType::kInternalized, cch)
-                .ToLocalChecked();
+        // Created after running so the cache includes the functions that were lazily compiled
+        std::unique_ptr<v8::ScriptCompiler::CachedData> spdata(v8::ScriptCompiler::CreateCodeCache(script->GetUnboundScript()));
+        codecache_save(rgch, cch, spdata.get());
+    }
+    return result;
+}
 
-        v8::MaybeLocal<v8::Script> scriptMaybe;
-        v8::ScriptCompiler::Source source(sourceText);
+ScriptHash JSContext::loadScript(const char *rgch, size_t cch)
+{
+    v8::TryCatch trycatch(isolate);
+    v8::Local<v8::Context> context = v8::Local<v8::Context>::New(isolate, m_context);
+    v8::Context::Scope context_scope(context);
 
-        // Compile the source code.
-        scriptMaybe = v8::ScriptCompiler::Compile(context, &source);
+    ScriptHash hash;
+    hash_script(rgch, cch, &hash);
 
-        if (!scriptMaybe.ToLocal(&script))
-        {
-            if (trycatch.HasCaught())
-            {
-                throw prettyPrintException(trycatch);
-            }
-            throw std::nullptr_t();
-        }
-        if (!fNoCache)
-            m_sphotscript = std::make_unique<HotScript>(isolate, rgch, cch, script);
+    // Compiling first ensures we only register scripts that are valid
+    v8::Local<v8::Script> script = compile(context, trycatch, rgch, cch);
+    m_scriptcache.insert(isolate, hash, rgch, cch, script);
+    scriptcache_register_source(hash, rgch, cch);
+    return hash;
+}
+
+bool JSContext::FRunCachedScript(const ScriptHash &hash, v8::Local<v8::Value> *presult)
+{
+    v8::TryCatch trycatch(isolate);
+    v8::Local<v8::Context> context = v8::Local<v8::Context>::New(isolate, m_context);
+    v8::Context::Scope context_scope(context);
+
+    v8::Local<v8::Script> script;
+    if (!m_scriptcache.FGetScript(isolate, hash, &script))
+    {
+        // It may have been loaded by another thread's context, or evicted from ours
+        std::string strSource;
+        if (!FScriptCacheLookupSource(hash, &strSource))
+            return false;
+        script = compile(context, trycatch, strSource.data(), strSource.size());
+        m_scriptcache.insert(isolate, hash, strSource.data(), strSource.size(), script);
     }
-    return run(context, script);
+
+    *presult = run(context, script);
+    return true;
+}
+
+bool JSContext::FScriptExists(const ScriptHash &hash)
+{
+    return m_scriptcache.FContains(hash) || FScriptCacheLookupSource(hash, nullptr);
+}
+
+static void lowercase(std::string &str)
+{
+    std::transform(str.begin(), str.end(), str.begin(), [](unsigned char ch){ return (char)tolower(ch); });
+}
+
+RegisteredCommand *JSContext::registerCommand(const char *szName, v8::Local<v8::Function> fn)
+{
+    std::string strKey(szName);
+    lowercase(strKey);
+
+    auto &spcmd = m_mapcommand[strKey];
+    if (spcmd == nullptr)
+        spcmd = std::make_unique<RegisteredCommand>();
+    spcmd->m_strName = szName;
+    spcmd->m_pstats = stats_for_command(szName);
+    spcmd->m_fn = v8::Persistent<v8::Function, v8::CopyablePersistentTraits<v8::Function>>(isolate, fn);
+    return spcmd.get();
+}
+
+void JSContext::addTrigger(int types, std::string &&strPattern, bool fBatch, v8::Local<v8::Function> fn)
+{
+    auto sptrigger = std::make_unique<KeyspaceTrigger>();
+    sptrigger->m_types = types;
+    sptrigger->m_fMatchAll = glob_matches_all(strPattern.data(), strPattern.size());
+    sptrigger->m_strPattern = std::move(strPattern);
+    sptrigger->m_fBatch = fBatch;
+    sptrigger->m_fn = v8::Persistent<v8::Function, v8::CopyablePersistentTraits<v8::Function>>(isolate, fn);
+    m_vectriggers.push_back(std::move(sptrigger));
+    m_triggerTypes |= types;
+}
+
+void JSContext::setTypeHooks(size_t itype, v8::Local<v8::Object> hooks)
+{
+    if (m_vectypehooks.size() <= itype)
+        m_vectypehooks.resize(itype + 1);
+    m_vectypehooks[itype].Reset(isolate, hooks);
+}
+
+v8::Local<v8::Object> JSContext::typeHooks(size_t itype)
+{
+    if (itype >= m_vectypehooks.size())
+        return v8::Local<v8::Object>();
+    return m_vectypehooks[itype].Get(isolate);
+}
+
+RegisteredCommand *JSContext::lookupCommand(const char *rgch, size_t cch)
+{
+    // Called before the isolate is locked, so several threads may look up in a shared context at once
+    static thread_local std::string t_strLookup;
+
+    // Command names are case insensitive, so normalize before the lookup
+    t_strLookup.assign(rgch, cch);
+    lowercase(t_strLookup);
+
+    auto itr = m_mapcommand.find(t_strLookup);
+    if (itr == m_mapcommand.end())
+        return nullptr;
+    return itr->second.get();
+}
+
+// V8 calls this before giving up on a full heap.  We stop the running script and temporarily raise the
+//  limit so it can unwind, the limit is restored automatically once the garbage is collected
+size_t JSContext::NearHeapLimitCallback(void *data, size_t cbCurrentLimit, size_t)
+{
+    JSContext *jscontext = reinterpret_cast<JSContext*>(data);
+    jscontext->m_fHeapLimitReached = true;
+    jscontext->isolate->TerminateExecution();
+    return cbCurrentLimit + cbCurrentLimit / 2;
+}
+
+bool JSContext::FHeapLimitReached()
+{
+    if (!m_fHeapLimitReached)
+        return false;
+    m_fHeapLimitReached = false;
+    isolate->CancelTerminateExecution();
+    return true;
 }
 
 JSContext::~JSContext()
 {
+    {
+        // Handles have to be released while the isolate is still alive
+        v8::Locker locker(isolate);
+        m_mapmodules.clear();
+        m_scriptcache.clear();
+        m_mapcommand.clear();
+        m_vectriggers.clear();
+        m_vectypehooks.clear();
+        m_decodedcache.clear();
+        m_keytemplate.Reset();
+        m_global.Reset();
+        m_context.Reset();
+        if (m_pisolatestats != nullptr)
+            stats_detach_isolate(isolate, m_pisolatestats);
+    }
+    if (m_pwatchdog != nullptr)
+        watchdog_detach(m_pwatchdog);
     isolate->Dispose();
 }
@@ -1,14 +1,65 @@
 #pragma once
 
 #include <string>
+#include <memory>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include <mutex>
+#include <atomic>
 #include <v8.h>
+#include "scriptcache.h"
+#include "stats.h"
+#include "watchdog.h"
+#include "decodedcache.h"
+
+// Argument types accepted in a command signature, conversion is done natively before entering V8
+enum class ArgType
+{
+    String,
+    Int64,
+    Double,
+    Buffer,
+    Rest,   // Any remaining arguments, passed as strings
+};
+
+// A command registered via keydb.register().  We hold the function directly so dispatch
+//  does not need to go through the global object (which scripts are free to overwrite)
+struct RegisteredCommand
+{
+    v8::Persistent<v8::Function, v8::CopyablePersistentTraits<v8::Function>> m_fn;
+    std::string m_strName;
+    std::string m_strFlags;
+    int m_keyFirst = 0;
+    int m_keyLast = 0;
+    int m_keyStep = 0;
+    bool m_fTypedArgs = false;  // if false every argument is passed as a string
+    std::vector<ArgType> m_vecargtypes;
+    long long m_timeoutMs = 0;  // how long an async command may block the client, 0 for the module default
+    CommandStats *m_pstats = nullptr;
+    long long m_timeLimitMs = -1;   // how long the function may run, -1 for the module default
+};
+
+// A keydb.on() handler, events are filtered natively by type and key pattern before V8 is entered
+struct KeyspaceTrigger
+{
+    int m_types = 0;    // REDISMODULE_NOTIFY_* mask
+    std::string m_strPattern;
+    bool m_fMatchAll = false;
+    bool m_fBatch = false;  // deliver events together on the next event loop tick instead of as they happen
+    v8::Persistent<v8::Function, v8::CopyablePersistentTraits<v8::Function>> m_fn;
+
+    // Batched events as "event\0key", the set coalesces repeats of the same event on the same key
+    std::vector<std::string> m_vecpending;
+    std::unordered_set<std::string> m_setpending;
+};
 
-class HotScript;
 class JSContext
 {
     v8::Isolate *isolate = nullptr;
     v8::Persistent<v8::ObjectTemplate, v8::CopyablePersistentTraits<v8::ObjectTemplate>> m_global;
     v8::Persistent<v8::Context, v8::CopyablePersistentTraits<v8::Context>> m_context;
+    v8::Persistent<v8::FunctionTemplate, v8::CopyablePersistentTraits<v8::FunctionTemplate>> m_keytemplate;
 
 public:
     JSContext();
@@ -16,18 +67,69 @@ public:
 
     void initialize();
     v8::Local<v8::Value> run(const char *rgch, size_t cch, bool fNoCache = false);
+
+    // Script cache used by EVALJS, EVALSHAJS and MODJS.SCRIPT
+    ScriptHash loadScript(const char *rgch, size_t cch);
+    bool FRunCachedScript(const ScriptHash &hash, v8::Local<v8::Value> *presult);
+    bool FScriptExists(const ScriptHash &hash);
     v8::Local<v8::Context> getCurrentContext() { return v8::Local<v8::Context>::New(isolate, m_context); }
     v8::Isolate *getIsolate() { return isolate; }
+    WatchdogSlot *getWatchdog() { return m_pwatchdog; }
+    DecodedCache &decodedCache() { return m_decodedcache; }
+    v8::Local<v8::FunctionTemplate> getKeyTemplate() { return v8::Local<v8::FunctionTemplate>::New(isolate, m_keytemplate); }
+
+    // Commands are only registered while the context is being built, after that lookups need no lock
+    RegisteredCommand *registerCommand(const char *szName, v8::Local<v8::Function> fn);
+    RegisteredCommand *lookupCommand(const char *rgch, size_t cch);
+    const std::unordered_map<std::string, std::unique_ptr<RegisteredCommand>> &commands() const { return m_mapcommand; }
+
+    void addTrigger(int types, std::string &&strPattern, bool fBatch, v8::Local<v8::Function> fn);
+    std::vector<std::unique_ptr<KeyspaceTrigger>> &triggers() { return m_vectriggers; }
+    int triggerTypes() const { return m_triggerTypes; }
+    std::mutex m_mutexTriggers;     // guards the batched events, they may be queued from several threads
+    bool m_fTriggerFlushScheduled = false;
+    uint64_t m_idTriggerFlush = 0;  // the server timer that will deliver them
+
+    // Commands running in this context, a context replaced by MODJS.RELOAD isn't freed until this is 0
+    std::atomic<int> m_cinuse { 0 };
+    bool m_fRetired = false;    // guarded by the retired list's mutex
+
+    // Hooks passed to keydb.createType() by this context's scripts, indexed by type id
+    void setTypeHooks(size_t itype, v8::Local<v8::Object> hooks);
+    v8::Local<v8::Object> typeHooks(size_t itype);
+
+    // True if the last script was terminated for running out of heap, clears the flag and lets JS run again
+    bool FHeapLimitReached();
 
 protected:
     v8::Local<v8::Value> run(v8::Local<v8::Context> &context, v8::Local<v8::Script> &script);
+    v8::Local<v8::Script> compile(v8::Local<v8::Context> &context, v8::TryCatch &trycatch, const char *rgch, size_t cch,
+        v8::ScriptCompiler::CachedData *cachedData = nullptr, bool *pfCacheRejected = nullptr);
     std::string prettyPrintException(v8::TryCatch &trycatch);
     void javascript_hooks_initialize(v8::Local<v8::ObjectTemplate> &keydb_obj);
     
     static void RequireCallback(const v8::FunctionCallbackInfo<v8::Value>& args);
+    std::string resolveModule(const std::string &strSpecifier, const std::string &strReferrerDir);
+    static size_t NearHeapLimitCallback(void *data, size_t cbCurrentLimit, size_t cbInitialLimit);
 
-    std::unique_ptr<HotScript> m_sphotscript;
+    ScriptCache m_scriptcache;
+    std::unordered_map<std::string, std::unique_ptr<RegisteredCommand>> m_mapcommand;
+    std::unordered_map<std::string, v8::Global<v8::Value>> m_mapmodules;   // exports by canonical path
+    std::unordered_map<std::string, std::string> m_mapresolve;  // referrer directory and specifier to canonical path
+    bool m_fHeapLimitReached = false;
+    IsolateStats *m_pisolatestats = nullptr;
+    WatchdogSlot *m_pwatchdog = nullptr;
+    std::vector<std::unique_ptr<KeyspaceTrigger>> m_vectriggers;
+    int m_triggerTypes = 0;
+    std::vector<v8::Global<v8::Object>> m_vectypehooks;
+    DecodedCache m_decodedcache;
 };
 
 void javascript_initialize();
-void javascript_shutdown();
\ No newline at end of file
+void javascript_shutdown();
+
+// Limits applied to isolates created after this call, 0 leaves V8's default
+void javascript_set_heap_limits(size_t cbMaxOld, size_t cbMaxYoung);
+
+// Total ArrayBuffer memory across all isolates, 0 for no limit.  Call before any isolate is created
+void javascript_set_array_buffer_limit(size_t cbMax);
\ No newline at end of file
@@ -1,7 +1,25 @@
+#define REDISMODULE_EXPERIMENTAL_API
 #include "js.h"
+#include "codecache.h"
+#include "arena.h"
+#include "profiler.h"
+#include "glob.h"
+#include "serialize.h"
 #include "redismodule.h"
 #include <limits.h>
+#include <strings.h>
 #include <vector>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
+#include <set>
+#include <map>
+#include <algorithm>
+#include <atomic>
+#include <utility>
+#include <thread>
+#include <deque>
+#include <condition_variable>
 #include <v8.h>
 #include <math.h>
 #include <fstream>
@@ -9,9 +27,132 @@
 #include <dlfcn.h>
 #include <experimental/filesystem>
 
-RedisModuleCtx *g_ctx = nullptr;
-JSContext *g_jscontext = nullptr;
+thread_local RedisModuleCtx *g_ctx = nullptr;
+std::atomic<JSContext*> g_jscontext { nullptr };    // Created at load and swapped by MODJS.RELOAD, this is the context that registers commands with the server
+thread_local JSContext *t_jscontext = nullptr;
 bool g_fInStartup = true;
+thread_local bool t_fInReplicaStartup = false;
+thread_local bool t_fReplayingStartup = false;  // building a thread or worker copy of the main context's scripts
+thread_local size_t t_cskippedReplayWrites = 0;
+static thread_local bool t_fInSyncTrigger = false;  // running a keydb.on() handler inside the notification callback
+thread_local bool t_fBackgroundThread = false;  // set on threads that must take the server lock to call into it
+thread_local bool t_fWorkerThread = false;      // set on runInBackground() worker threads
+std::atomic<uint64_t> g_reloadEpoch { 0 };      // bumped by MODJS.RELOAD so per-thread contexts are rebuilt
+thread_local uint64_t t_reloadEpoch = 0;
+std::unordered_set<std::string> g_setcommands;  // lowercase names of the commands created with the server, fixed once loaded
+
+// Module options, set with --name[=value] arguments at load time
+bool g_fIsolatePerThread = false;
+size_t g_cbMaxOldSpace = 0;     // V8 heap limits from the module options, 0 for V8's default
+size_t g_cbMaxYoungSpace = 0;
+size_t g_cbMaxArrayBuffers = 1024ULL * 1024 * 1024;   // 0 for no limit
+long long g_msLatencyThreshold = 1;     // invocations at least this slow are reported to the latency monitor
+uint64_t g_usTimerBudget = 10000;       // time timer callbacks may take per event loop tick
+size_t g_cbackgroundThreads = 2;        // worker threads for runInBackground(), started on first use
+long long g_msPromiseTimeout = 60000;   // how long an async command may block its client unless it sets a timeout
+
+// bootstrap.js followed by the user's startup scripts, replayed when creating per-thread contexts
+std::vector<std::string> g_vecstartupscripts;
+
+JSContext *getJSContext();
+
+// Pins the calling thread's context for the length of a command, MODJS.RELOAD won't free a context in use
+class ContextInUse
+{
+    JSContext *m_jscontext;
+
+public:
+    ContextInUse();
+    ~ContextInUse();
+
+    ContextInUse(const ContextInUse&) = delete;
+    ContextInUse &operator=(const ContextInUse&) = delete;
+
+    JSContext *get() const { return m_jscontext; }
+};
+
+// Taken around anything that touches the keyspace, only background threads need to acquire the lock.
+//  Nests, since a call made under the lock can fire a trigger that makes calls of its own
+static thread_local int t_cServerLock = 0;
+class ServerLock
+{
+    RedisModuleCtx *m_ctx = nullptr;
+public:
+    ServerLock()
+    {
+        if (!t_fBackgroundThread)
+            return;
+        m_ctx = g_ctx;
+        if (t_cServerLock++ == 0)
+            RedisModule_ThreadSafeContextLock(m_ctx);
+    }
+
+    ~ServerLock()
+    {
+        if (m_ctx != nullptr && --t_cServerLock == 0)
+            RedisModule_ThreadSafeContextUnlock(m_ctx);
+    }
+};
+
+static const char c_szSyncTriggerWrite[] = "ERR keyspace triggers can't write unless they are registered with {batch: true}";
+
+// Returns true if the caller must not write, with an exception pending or a null result set.
+//  A synchronous keyspace trigger runs inside the server's notification callback, and a write from there
+//  re-enters the keyspace in the middle of another command, so it throws.  The startup scripts are replayed
+//  for each server thread's context, each background worker and again for those on every reload.  Their
+//  writes already happened when the main context ran them, so a copy skips them instead of repeating them.
+static bool FBlockWrite(const v8::FunctionCallbackInfo<v8::Value>& args)
+{
+    if (t_fInSyncTrigger)
+    {
+        v8::Isolate *isolate = args.GetIsolate();
+        isolate->ThrowException(v8::String::NewFromUtf8(isolate, c_szSyncTriggerWrite).ToLocalChecked());
+        return true;
+    }
+    if (!t_fReplayingStartup)
+        return false;
+    ++t_cskippedReplayWrites;
+    args.GetReturnValue().SetNull();
+    return true;
+}
+
+// Whether a command may change the dataset, from its COMMAND INFO flags.  Cached since flags are fixed once
+//  the server has started.  Call with the server lock held
+static std::mutex g_mutexCommandFlags;
+static std::unordered_map<std::string, bool> g_mapcommandwrite;
+
+static bool FCommandIsWrite(const char *szName, size_t cchName)
+{
+    std::string strName(szName, cchName);
+    std::transform(strName.begin(), strName.end(), strName.begin(), ::tolower);
+    {
+        std::unique_lock<std::mutex> lock(g_mutexCommandFlags);
+        auto itr = g_mapcommandwrite.find(strName);
+        if (itr != g_mapcommandwrite.end())
+            return itr->second;
+    }
+
+    // Unknown commands count as reads, they only produce an error
+    bool fWrite = false;
+    RedisModuleCallReply *reply = RedisModule_Call(g_ctx, "COMMAND", "cc", "INFO", strName.c_str());
+    if (reply != nullptr)
+    {
+        RedisModuleCallReply *info = (RedisModule_CallReplyType(reply) == REDISMODULE_REPLY_ARRAY) ? RedisModule_CallReplyArrayElement(reply, 0) : nullptr;
+        RedisModuleCallReply *flags = (info != nullptr && RedisModule_CallReplyType(info) == REDISMODULE_REPLY_ARRAY) ? RedisModule_CallReplyArrayElement(info, 2) : nullptr;
+        size_t cflags = (flags != nullptr && RedisModule_CallReplyType(flags) == REDISMODULE_REPLY_ARRAY) ? RedisModule_CallReplyLength(flags) : 0;
+        for (size_t iflag = 0; iflag < cflags && !fWrite; ++iflag)
+        {
+            size_t cch;
+            const char *rgch = RedisModule_CallReplyStringPtr(RedisModule_CallReplyArrayElement(flags, iflag), &cch);
+            fWrite = (rgch != nullptr) && ((cch == 5 && !memcmp(rgch, "write", 5)) || (cch == 13 && !memcmp(rgch, "may-replicate", 13)));
+        }
+        RedisModule_FreeCallReply(reply);
+    }
+
+    std::unique_lock<std::mutex> lock(g_mutexCommandFlags);
+    g_mapcommandwrite.emplace(std::move(strName), fWrite);
+    return fWrite;
+}
 
 class KeyDBContext
 {
@@ -29,21 +170,187 @@ public:
     }
 };
 
-static void processResult(RedisModuleCtx *ctx, v8::Isolate *isolate, v8::Local<v8::Context> &v8ctx, v8::Local<v8::Value> &result)
+v8::Local<v8::Uint8Array> NewUint8Array(v8::Isolate *isolate, const char *rgch, size_t cch)
+{
+    v8::Local<v8::ArrayBuffer> buffer = v8::ArrayBuffer::New(isolate, cch);
+    if (cch > 0)
+        memcpy(buffer->GetBackingStore()->Data(), rgch, cch);
+    return v8::Uint8Array::New(buffer, 0, cch);
+}
+
+// If val is an ArrayBuffer or a view on one (e.g. Uint8Array) return its raw bytes without copying
+bool FGetBufferData(v8::Local<v8::Value> val, const char **prgch, size_t *pcch)
+{
+    if (val->IsArrayBufferView())
+    {
+        v8::Local<v8::ArrayBufferView> view = v8::Local<v8::ArrayBufferView>::Cast(val);
+        *prgch = (const char*)view->Buffer()->GetBackingStore()->Data() + view->ByteOffset();
+        *pcch = view->ByteLength();
+        return true;
+    }
+    if (val->IsArrayBuffer())
+    {
+        v8::Local<v8::ArrayBuffer> buffer = v8::Local<v8::ArrayBuffer>::Cast(val);
+        *prgch = (const char*)buffer->GetBackingStore()->Data();
+        *pcch = buffer->ByteLength();
+        return true;
+    }
+    return false;
+}
+
+// Reused for every string we reply with so steady state replies don't allocate
+static thread_local std::string s_strReplyScratch;
+
+static bool FIsAscii(const char *rgch, size_t cch)
+{
+    size_t ich = 0;
+    for (; ich + sizeof(uint64_t) <= cch; ich += sizeof(uint64_t))
+    {
+        uint64_t val;
+        memcpy(&val, rgch + ich, sizeof(val));
+        if (val & 0x8080808080808080ULL)
+            return false;
+    }
+    for (; ich < cch; ++ich)
+    {
+        if (rgch[ich] & 0x80)
+            return false;
+    }
+    return true;
+}
+
+static void ReplyWithV8String(RedisModuleCtx *ctx, v8::Isolate *isolate, v8::Local<v8::String> str)
 {
-    if (result->IsArray())
+    std::string &strBuf = s_strReplyScratch;
+    if (str->IsOneByte())
     {
-        v8::Local<v8::Array> array = v8::Local<v8::Array>::Cast(result);
-        RedisModule_ReplyWithArray(g_ctx, array->Length());
-        for (size_t ielem = 0; ielem < array->Length(); ++ielem)
+        // An ASCII string is already valid UTF-8, so copy it out as is and skip the transcoding
+        int cch = str->Length();
+        strBuf.resize(cch);
+        str->WriteOneByte(isolate, (uint8_t*)&strBuf[0], 0, cch, v8::String::NO_NULL_TERMINATION);
+        if (FIsAscii(strBuf.data(), cch))
         {
-            auto maybe = array->Get(v8ctx, ielem);
-            v8::Local<v8::Value> val;
-            if (maybe.ToLocal(&val))
-                processResult(ctx, isolate, v8ctx, val);
-            else
-                RedisModule_ReplyWithNull(ctx);
+            RedisModule_ReplyWithStringBuffer(ctx, strBuf.data(), cch);
+            return;
+        }
+    }
+
+    int cb = str->Utf8Length(isolate);
+    strBuf.resize(cb);
+    str->WriteUtf8(isolate, &strBuf[0], cb, nullptr, v8::String::NO_NULL_TERMINATION);
+    RedisModule_ReplyWithStringBuffer(ctx, strBuf.data(), cb);
+}
+
+// Replies with a thrown value or Promise rejection as an error.  For Error objects we use the message so
+//  we don't get the "Error: " prefix
+static void ReplyWithJSError(RedisModuleCtx *ctx, v8::Isolate *isolate, v8::Local<v8::Context> context, v8::Local<v8::Value> reason)
+{
+    v8::Local<v8::Value> vmsg = reason;
+    if (reason->IsNativeError())
+    {
+        v8::Local<v8::Value> vmsgT;
+        if (v8::Local<v8::Object>::Cast(reason)->Get(context, v8::String::NewFromUtf8(isolate, "message").ToLocalChecked()).ToLocal(&vmsgT))
+            vmsg = vmsgT;
+    }
+    v8::String::Utf8Value utf8(isolate, vmsg);
+    if (*utf8 == nullptr)
+    {
+        RedisModule_ReplyWithError(ctx, "Unknown Error");
+        return;
+    }
+
+    // Error replies are a single line
+    std::string strErr(*utf8, utf8.length());
+    std::replace(strErr.begin(), strErr.end(), '\r', ' ');
+    std::replace(strErr.begin(), strErr.end(), '\n', ' ');
+    RedisModule_ReplyWithError(ctx, strErr.c_str());
+}
+
+// Nesting limit for replies, like the server's limit on Lua replies it stops a runaway structure from
+//  exhausting the native stack
+static const int cdepthReplyMax = 128;
+
+// The arrays, maps, sets and objects enclosing the value being replied with, used to catch cycles
+struct ReplyPath
+{
+    int cdepth = 0;
+    v8::Local<v8::Value> rgcontainer[cdepthReplyMax];
+};
+
+static void processValue(RedisModuleCtx *ctx, v8::Isolate *isolate, v8::Local<v8::Context> &v8ctx, v8::Local<v8::Value> &result, ReplyPath &path);
+
+// Replies with an error in place of the container if it is too deep or contains itself, the enclosing arrays
+//  have already been started so their lengths stay the same
+static bool FEnterContainer(RedisModuleCtx *ctx, ReplyPath &path, v8::Local<v8::Value> container)
+{
+    if (path.cdepth >= cdepthReplyMax)
+    {
+        RedisModule_ReplyWithError(ctx, "ERR reply is nested too deeply");
+        return false;
+    }
+    for (int icontainer = 0; icontainer < path.cdepth; ++icontainer)
+    {
+        if (path.rgcontainer[icontainer] == container)
+        {
+            RedisModule_ReplyWithError(ctx, "ERR reply contains a circular reference");
+            return false;
+        }
+    }
+    path.rgcontainer[path.cdepth++] = container;
+    return true;
+}
+
+// Replies with an array of alternating keys and values, e.g. from Map::AsArray()
+static void processArray(RedisModuleCtx *ctx, v8::Isolate *isolate, v8::Local<v8::Context> &v8ctx, v8::Local<v8::Array> array, ReplyPath &path)
+{
+    uint32_t celem = array->Length();
+    RedisModule_ReplyWithArray(ctx, celem);
+    for (uint32_t ielem = 0; ielem < celem; ++ielem)
+    {
+        v8::Local<v8::Value> val;
+        if (array->Get(v8ctx, ielem).ToLocal(&val))
+            processValue(ctx, isolate, v8ctx, val, path);
+        else
+            RedisModule_ReplyWithNull(ctx);
+    }
+}
+
+// Plain objects are returned as a flat array of their own property names and values
+static void processObject(RedisModuleCtx *ctx, v8::Isolate *isolate, v8::Local<v8::Context> &v8ctx, v8::Local<v8::Object> obj, ReplyPath &path)
+{
+    v8::Local<v8::Array> keys;
+    if (!obj->GetOwnPropertyNames(v8ctx).ToLocal(&keys))
+    {
+        RedisModule_ReplyWithNull(ctx);
+        return;
+    }
+
+    uint32_t ckeys = keys->Length();
+    RedisModule_ReplyWithArray(ctx, ckeys * 2);
+    for (uint32_t ikey = 0; ikey < ckeys; ++ikey)
+    {
+        v8::Local<v8::Value> key, val;
+        if (!keys->Get(v8ctx, ikey).ToLocal(&key))
+        {
+            RedisModule_ReplyWithNull(ctx);
+            RedisModule_ReplyWithNull(ctx);
+            continue;
         }
+        processValue(ctx, isolate, v8ctx, key, path);
+        if (obj->Get(v8ctx, key).ToLocal(&val))
+            processValue(ctx, isolate, v8ctx, val, path);
+        else
+            RedisModule_ReplyWithNull(ctx);
+    }
+}
+
+static void processValue(RedisModuleCtx *ctx, v8::Isolate *isolate, v8::Local<v8::Context> &v8ctx, v8::Local<v8::Value> &result, ReplyPath &path)
+{
+    const char *rgchBuf;
+    size_t cchBuf;
+    if (result->IsString())
+    {
+        ReplyWithV8String(ctx, isolate, v8::Local<v8::String>::Cast(result));
     }
     else if (result->IsInt32())
     {
@@ -57,10 +364,61 @@ static void processResult(RedisModuleCtx *ctx, v8::Isolate *isolate, v8::Local<v
         double dv = num->Value();
         RedisModule_ReplyWithDouble(ctx, dv);
     }
-    else if (result->IsString())
+    else if (result->IsNullOrUndefined())
+    {
+        RedisModule_ReplyWithNull(ctx);
+    }
+    else if (result->IsBoolean())
+    {
+        RedisModule_ReplyWithLongLong(ctx, result->IsTrue() ? 1 : 0);
+    }
+    else if (result->IsBigInt())
+    {
+        bool fLossless = false;
+        int64_t val = v8::Local<v8::BigInt>::Cast(result)->Int64Value(&fLossless);
+        if (fLossless)
+        {
+            RedisModule_ReplyWithLongLong(ctx, val);
+        }
+        else
+        {
+            // Too big for a long long, send the digits instead
+            v8::Local<v8::String> str;
+            if (result->ToString(v8ctx).ToLocal(&str))
+                ReplyWithV8String(ctx, isolate, str);
+            else
+                RedisModule_ReplyWithNull(ctx);
+        }
+    }
+    else if (result->IsArray())
+    {
+        if (!FEnterContainer(ctx, path, result))
+            return;
+        processArray(ctx, isolate, v8ctx, v8::Local<v8::Array>::Cast(result), path);
+        --path.cdepth;
+    }
+    else if (FGetBufferData(result, &rgchBuf, &cchBuf))
+    {
+        RedisModule_ReplyWithStringBuffer(ctx, rgchBuf, cchBuf);
+    }
+    else if (result->IsMap() || result->IsSet())
+    {
+        if (!FEnterContainer(ctx, path, result))
+            return;
+        v8::Local<v8::Array> array = result->IsMap() ? v8::Local<v8::Map>::Cast(result)->AsArray() : v8::Local<v8::Set>::Cast(result)->AsArray();
+        processArray(ctx, isolate, v8ctx, array, path);
+        --path.cdepth;
+    }
+    else if (result->IsNativeError())
+    {
+        ReplyWithJSError(ctx, isolate, v8ctx, result);
+    }
+    else if (result->IsObject() && !result->IsFunction() && !result->IsPromise())
     {
-        v8::String::Utf8Value utf8(isolate, result);
-        RedisModule_ReplyWithCString(ctx, *utf8);
+        if (!FEnterContainer(ctx, path, result))
+            return;
+        processObject(ctx, isolate, v8ctx, v8::Local<v8::Object>::Cast(result), path);
+        --path.cdepth;
     }
     else
     {
@@ -68,7 +426,14 @@ static void processResult(RedisModuleCtx *ctx, v8::Isolate *isolate, v8::Local<v
     }
 }
 
-static void ProcessCallReply(v8::Local<v8::Value> &dst, v8::Isolate* isolate, RedisModuleCallReply *reply)
+static void processResult(RedisModuleCtx *ctx, v8::Isolate *isolate, v8::Local<v8::Context> &v8ctx, v8::Local<v8::Value> &result)
+{
+    ReplyPath path;
+    processValue(ctx, isolate, v8ctx, result, path);
+}
+
+// If fBuffer is set bulk strings are returned as a Uint8Array instead of a string
+static void ProcessCallReply(v8::Local<v8::Value> &dst, v8::Isolate* isolate, RedisModuleCallReply *reply, bool fBuffer)
 {
     const char *rgchReply;
     size_t cchReply;
@@ -77,7 +442,10 @@ static void ProcessCallReply(v8::Local<v8::Value> &dst, v8::Isolate* isolate, Re
     {
         case REDISMODULE_REPLY_STRING:
             rgchReply = RedisModule_CallReplyStringPtr(reply, &cchReply);
-            dst = v8::String::NewFromUtf8(isolate, rgchReply, v8::NewStringType::kNormal, cchReply).ToLocalChecked();
+            if (fBuffer)
+                dst = NewUint8Array(isolate, rgchReply, cchReply);
+            else
+                dst = v8::String::NewFromUtf8(isolate, rgchReply, v8::NewStringType::kNormal, cchReply).ToLocalChecked();
             break;
         
         case REDISMODULE_REPLY_INTEGER:
@@ -96,7 +464,7 @@ static void ProcessCallReply(v8::Local<v8::Value> &dst, v8::Isolate* isolate, Re
             {
                 RedisModuleCallReply *replyArray = RedisModule_CallReplyArrayElement(reply, ielem);
                 v8::Local<v8::Value> val;
-                ProcessCallReply(val, isolate, replyArray);
+                ProcessCallReply(val, isolate, replyArray, fBuffer);
                 v8::Maybe<bool> result = array->Set(isolate->GetCurrentContext(), ielem, val);
                 bool fResult;
                 if (!result.To(&fResult) || !fResult)
@@ -114,27 +482,64 @@ static void ProcessCallReply(v8::Local<v8::Value> &dst, v8::Isolate* isolate, Re
     }
 }
 
-void KeyDBExecuteCallback(const v8::FunctionCallbackInfo<v8::Value>& args)
+// Writes the NUL terminated UTF-8 encoding of val into the scratch arena, the result is valid until the
+//  enclosing ArenaScope ends
+static const char *ValueToUtf8(v8::Isolate *isolate, v8::Local<v8::Value> val, size_t *pcch)
+{
+    v8::Local<v8::String> str;
+    if (!val->ToString(isolate->GetCurrentContext()).ToLocal(&str))
+    {
+        *pcch = 0;
+        return "";
+    }
+    int cch = str->Utf8Length(isolate);
+    char *rgch = scratch_arena().allocString(cch + 1);
+    str->WriteUtf8(isolate, rgch, cch, nullptr, v8::String::NO_NULL_TERMINATION);
+    rgch[cch] = '\0';
+    *pcch = cch;
+    return rgch;
+}
+
+// Binary data is passed through as is, everything else is converted to a UTF-8 string
+static RedisModuleString *CreateStringFromValue(v8::Isolate *isolate, v8::Local<v8::Value> val)
+{
+    const char *rgch;
+    size_t cch;
+    if (FGetBufferData(val, &rgch, &cch))
+        return RedisModule_CreateString(g_ctx, rgch, cch);
+
+    ArenaScope arenascope;
+    rgch = ValueToUtf8(isolate, val, &cch);
+    return RedisModule_CreateString(g_ctx, rgch, cch);
+}
+
+static void ExecuteCall(const v8::FunctionCallbackInfo<v8::Value>& args, bool fBuffer)
 {
     if (args.Length() < 1) return;
     v8::Isolate* isolate = args.GetIsolate();
     v8::HandleScope scope(isolate);
-    v8::Local<v8::Value> vfnName = args[0];
-    v8::String::Utf8Value fnName(isolate, vfnName);
+    ArenaScope arenascope;
+    size_t cchName;
+    const char *szName = ValueToUtf8(isolate, args[0], &cchName);
 
-    std::vector<RedisModuleString*> vecstrs;
+    SmallVector<RedisModuleString*, 8> vecstrs;
     for (int iarg = 1; iarg < args.Length(); ++iarg)
+        vecstrs.push_back(CreateStringFromValue(isolate, args[iarg]));
+
+    ServerLock lock;
+    if ((t_fReplayingStartup || t_fInSyncTrigger) && FCommandIsWrite(szName, cchName))
     {
-        v8::String::Utf8Value argument(isolate, args[iarg]);
-        vecstrs.push_back(RedisModule_CreateString(g_ctx, *argument, argument.length()));
+        for (auto str : vecstrs)
+            RedisModule_FreeString(g_ctx, str);
+        FBlockWrite(args);
+        return;
     }
-
-    RedisModuleCallReply *reply = RedisModule_Call(g_ctx, *fnName, "v", vecstrs.data(), vecstrs.size());
+    RedisModuleCallReply *reply = RedisModule_Call(g_ctx, szName, "v", vecstrs.data(), vecstrs.size());
 
     if (reply != nullptr)
     {
         v8::Local<v8::Value> result;
-        ProcessCallReply(result, isolate, reply);
+        ProcessCallReply(result, isolate, reply, fBuffer);
         args.GetReturnValue().Set(result);
 
         RedisModule_FreeCallReply(reply);
@@ -148,223 +553,3512 @@ void KeyDBExecuteCallback(const v8::FunctionCallbackInfo<v8::Value>& args)
         RedisModule_FreeString(g_ctx, str);
 }
 
-void LogCallback(const v8::FunctionCallbackInfo<v8::Value>& args) 
+void KeyDBExecuteCallback(const v8::FunctionCallbackInfo<v8::Value>& args)
+{
+    ExecuteCall(args, false /* fBuffer */);
+}
+
+void KeyDBExecuteBufferCallback(const v8::FunctionCallbackInfo<v8::Value>& args)
+{
+    ExecuteCall(args, true /* fBuffer */);
+}
+
+static v8::Local<v8::Value> NewError(v8::Isolate *isolate, const char *rgch, size_t cch)
+{
+    return v8::Exception::Error(v8::String::NewFromUtf8(isolate, rgch, v8::NewStringType::kNormal, cch).ToLocalChecked());
+}
+
+// callMany([[cmd, arg, ...], ...]) runs a batch of commands in one transition into native code.  Errors
+//  are returned in place as Error objects rather than thrown so one failure doesn't lose the other replies
+void KeyDBExecuteManyCallback(const v8::FunctionCallbackInfo<v8::Value>& args)
 {
     v8::Isolate* isolate = args.GetIsolate();
     v8::HandleScope scope(isolate);
-
-    if (args.Length() != 2)
+    if (args.Length() != 1 || !args[0]->IsArray())
     {
-        isolate->ThrowException(v8::String::NewFromUtf8(isolate, "Log expects two parameters").ToLocalChecked());
+        isolate->ThrowException(v8::String::NewFromUtf8(isolate, "callMany() expects an array of commands").ToLocalChecked());
         return;
     }
-    
-    
-    v8::String::Utf8Value level(isolate, args[0]);
-    v8::String::Utf8Value message(isolate, args[1]);
-    RedisModule_Log(g_ctx, *level, "%s", *message);
-}
-
-int js_command(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
-{
-    KeyDBContext ctxsav(ctx);
 
-    v8::Locker locker(g_jscontext->getIsolate());
-    v8::HandleScope scope(g_jscontext->getIsolate());
-    if (argc < 1)
-        return REDISMODULE_ERR;
+    v8::Local<v8::Context> context = isolate->GetCurrentContext();
+    v8::Local<v8::Array> batch = v8::Local<v8::Array>::Cast(args[0]);
+    uint32_t ccmds = batch->Length();
+    v8::Local<v8::Array> results = v8::Array::New(isolate, ccmds);
 
-    v8::Local<v8::Context> context = g_jscontext->getCurrentContext();
-    v8::Context::Scope context_scope(context);
-    
-    try
+    for (uint32_t icmd = 0; icmd < ccmds; ++icmd)
     {
-        size_t cchName;
-        const char *rgchName = RedisModule_StringPtrLen(argv[0], &cchName);
+        v8::HandleScope scopeCmd(isolate);
+        ArenaScope arenascope;
+        v8::Local<v8::Value> vcmd;
+        if (!batch->Get(context, icmd).ToLocal(&vcmd))
+            return;
 
-        v8::Handle<v8::Object> global = context->Global();
-        v8::Isolate *isolate = g_jscontext->getIsolate();
-        auto strFn = v8::String::NewFromUtf8(isolate, rgchName, v8::NewStringType::kNormal, cchName).ToLocalChecked();
-        auto mvfnCall = global->Get(context, v8::Local<v8::Value>::Cast(strFn));
-        v8::Handle<v8::Value> vfnCall;
-        if (!mvfnCall.ToLocal(&vfnCall))
-            return REDISMODULE_ERR;
-        
-        if (!vfnCall->IsFunction())
-            return REDISMODULE_ERR;
-        
-        v8::Handle<v8::Function> fnCall = v8::Handle<v8::Function>::Cast(vfnCall);
-        std::vector<v8::Local<v8::Value>> vecargs;
-        vecargs.reserve(argc);
-        
-        for (int iarg = 1; iarg < argc; ++iarg)
+        v8::Local<v8::Value> result;
+        if (!vcmd->IsArray() || v8::Local<v8::Array>::Cast(vcmd)->Length() < 1)
         {
-            size_t cch;
-            const char *rgch = RedisModule_StringPtrLen(argv[iarg], &cch);
-            auto str = v8::String::NewFromUtf8(isolate, rgch, v8::NewStringType::kNormal, cch).ToLocalChecked();
-
-            vecargs.push_back(str);
+            static const char szErr[] = "Invalid Command";
+            result = NewError(isolate, szErr, sizeof(szErr) - 1);
         }
+        else
+        {
+            v8::Local<v8::Array> cmd = v8::Local<v8::Array>::Cast(vcmd);
+            uint32_t cargs = cmd->Length();
+            v8::Local<v8::Value> varg;
+            if (!cmd->Get(context, 0).ToLocal(&varg))
+                return;
+            size_t cchName;
+            const char *szName = ValueToUtf8(isolate, varg, &cchName);
 
-        auto maybeResult = fnCall->Call(context, global, (int)vecargs.size(), vecargs.data());
+            ServerLock lock;
+            SmallVector<RedisModuleString*, 8> vecstrs;
+            bool fArgsValid = true;
+            for (uint32_t iarg = 1; iarg < cargs && fArgsValid; ++iarg)
+            {
+                fArgsValid = cmd->Get(context, iarg).ToLocal(&varg);
+                if (fArgsValid)
+                    vecstrs.push_back(CreateStringFromValue(isolate, varg));
+            }
 
-        v8::Local<v8::Value> result;
-        if (!maybeResult.ToLocal(&result))
-        {
-            RedisModule_ReplyWithNull(ctx);
-            return REDISMODULE_OK;
+            // A blocked write gets an Error or null in its slot, see FBlockWrite
+            bool fSkip = fArgsValid && (t_fReplayingStartup || t_fInSyncTrigger) && FCommandIsWrite(szName, cchName);
+            RedisModuleCallReply *reply = nullptr;
+            if (fArgsValid && !fSkip)
+                reply = RedisModule_Call(g_ctx, szName, "v", vecstrs.data(), vecstrs.size());
+            for (auto str : vecstrs)
+                RedisModule_FreeString(g_ctx, str);
+            if (!fArgsValid)
+                return; // an exception is pending from Get()
+
+            if (fSkip && t_fInSyncTrigger)
+            {
+                result = NewError(isolate, c_szSyncTriggerWrite, sizeof(c_szSyncTriggerWrite) - 1);
+            }
+            else if (fSkip)
+            {
+                ++t_cskippedReplayWrites;
+                result = v8::Null(isolate);
+            }
+            else if (reply == nullptr)
+            {
+                static const char szErr[] = "Invalid Command";
+                result = NewError(isolate, szErr, sizeof(szErr) - 1);
+            }
+            else
+            {
+                if (RedisModule_CallReplyType(reply) == REDISMODULE_REPLY_ERROR)
+                {
+                    size_t cchErr;
+                    const char *rgchErr = RedisModule_CallReplyStringPtr(reply, &cchErr);
+                    result = NewError(isolate, rgchErr, cchErr);
+                }
+                else
+                {
+                    ProcessCallReply(result, isolate, reply, false /* fBuffer */);
+                }
+                RedisModule_FreeCallReply(reply);
+            }
         }
 
-        processResult(ctx, g_jscontext->getIsolate(), context, result);
+        bool fResult;
+        if (!results->Set(context, icmd, result).To(&fResult) || !fResult)
+            return;
     }
-    catch (std::string strerr)
+
+    args.GetReturnValue().Set(results);
+}
+
+/*
+ * Low level key API (keydb.key(name)).  These operate on the key directly with RedisModule_OpenKey
+ *  and so skip the command lookup, argument parsing, and reply building that keydb.call() requires
+ */
+static void ThrowError(v8::Isolate *isolate, const char *szErr)
+{
+    isolate->ThrowException(v8::String::NewFromUtf8(isolate, szErr).ToLocalChecked());
+}
+
+// Opens the key named by a keydb.key() object for the duration of a single operation
+class KeyHandle
+{
+    ServerLock m_lock;  // first so it is held for as long as the key is open
+    RedisModuleString *m_strName = nullptr;
+    RedisModuleKey *m_key = nullptr;
+    bool m_fWrite = false;
+
+public:
+    KeyHandle(const v8::FunctionCallbackInfo<v8::Value>& args, int mode)
+        : KeyHandle(args.GetIsolate(), args.Holder()->GetInternalField(0), mode)
+    {}
+
+    KeyHandle(v8::Isolate *isolate, v8::Local<v8::Value> name, int mode)
     {
-        RedisModule_ReplyWithError(ctx, strerr.c_str());
-        return REDISMODULE_ERR;
+        m_strName = CreateStringFromValue(isolate, name);
+        m_key = (RedisModuleKey*)RedisModule_OpenKey(g_ctx, m_strName, mode);
+        m_fWrite = (mode & REDISMODULE_WRITE) != 0;
     }
-    catch (std::nullptr_t)
+
+    ~KeyHandle()
     {
-        RedisModule_ReplyWithError(ctx, "Unknown Error");
-        return REDISMODULE_ERR;
+        if (m_key != nullptr)
+            RedisModule_CloseKey(m_key);
+        if (m_fWrite && decodedcache_active())
+        {
+            // Writes through the key API don't raise keyspace events
+            size_t cch;
+            const char *rgch = RedisModule_StringPtrLen(m_strName, &cch);
+            decodedcache_invalidate(RedisModule_GetSelectedDb(g_ctx), rgch, cch);
+        }
+        RedisModule_FreeString(g_ctx, m_strName);
     }
-    return REDISMODULE_OK;
-}
 
-void RegisterCommandCallback(const v8::FunctionCallbackInfo<v8::Value>& args)
-{
-    if (args.Length() < 1) return;
-    v8::Isolate* isolate = args.GetIsolate();
-    v8::HandleScope scope(isolate);
+    RedisModuleKey *key() { return m_key; }
+    RedisModuleString *name() { return m_strName; }
+    int type() { return (m_key != nullptr) ? RedisModule_KeyType(m_key) : REDISMODULE_KEYTYPE_EMPTY; }
 
-    if (!g_fInStartup)
+    // Returns false and throws if the key exists but is not of the given type
+    bool FCheckType(v8::Isolate *isolate, int typeExpected)
     {
-        isolate->ThrowException(v8::String::NewFromUtf8(isolate, "New commands may only be registered during startup").ToLocalChecked());
-        return;
+        int typeT = type();
+        if (typeT == REDISMODULE_KEYTYPE_EMPTY || typeT == typeExpected)
+            return true;
+        ThrowError(isolate, "WRONGTYPE Operation against a key holding the wrong kind of value");
+        return false;
+    }
+};
+
+static void KeyGetImpl(const v8::FunctionCallbackInfo<v8::Value>& args, bool fBuffer)
+{
+    v8::Isolate *isolate = args.GetIsolate();
+    KeyHandle key(args, REDISMODULE_READ);
+    if (!key.FCheckType(isolate, REDISMODULE_KEYTYPE_STRING))
+        return;
+    if (key.type() == REDISMODULE_KEYTYPE_EMPTY)
+    {
+        args.GetReturnValue().SetNull();
+        return;
+    }
+
+    size_t cch;
+    const char *rgch = RedisModule_StringDMA(key.key(), &cch, REDISMODULE_READ);
+    if (fBuffer)
+        args.GetReturnValue().Set(NewUint8Array(isolate, rgch, cch));
+    else
+        args.GetReturnValue().Set(v8::String::NewFromUtf8(isolate, rgch, v8::NewStringType::kNormal, cch).ToLocalChecked());
+}
+
+static void KeyGetCallback(const v8::FunctionCallbackInfo<v8::Value>& args)
+{
+    KeyGetImpl(args, false /* fBuffer */);
+}
+
+static void KeyGetBufferCallback(const v8::FunctionCallbackInfo<v8::Value>& args)
+{
+    KeyGetImpl(args, true /* fBuffer */);
+}
+
+static void KeySetCallback(const v8::FunctionCallbackInfo<v8::Value>& args)
+{
+    v8::Isolate *isolate = args.GetIsolate();
+    if (args.Length() != 1)
+    {
+        ThrowError(isolate, "set() expects one parameter");
+        return;
+    }
+
+    if (FBlockWrite(args))
+        return;
+    KeyHandle key(args, REDISMODULE_READ | REDISMODULE_WRITE);
+    RedisModuleString *str = CreateStringFromValue(isolate, args[0]);
+    int res = RedisModule_StringSet(key.key(), str);
+    RedisModule_FreeString(g_ctx, str);
+    args.GetReturnValue().Set(res == REDISMODULE_OK);
+}
+
+// expire(ms) sets a relative expire time in milliseconds
+static void KeyExpireCallback(const v8::FunctionCallbackInfo<v8::Value>& args)
+{
+    v8::Isolate *isolate = args.GetIsolate();
+    if (args.Length() != 1 || !args[0]->IsNumber())
+    {
+        ThrowError(isolate, "expire() expects a time in milliseconds");
+        return;
+    }
+
+    if (FBlockWrite(args))
+        return;
+    KeyHandle key(args, REDISMODULE_READ | REDISMODULE_WRITE);
+    if (key.type() == REDISMODULE_KEYTYPE_EMPTY)
+    {
+        args.GetReturnValue().Set(false);
+        return;
+    }
+    mstime_t ms = (mstime_t)v8::Local<v8::Number>::Cast(args[0])->Value();
+    args.GetReturnValue().Set(RedisModule_SetExpire(key.key(), ms) == REDISMODULE_OK);
+}
+
+// ttl() returns the remaining time in milliseconds, -1 if there is no expire, and -2 if the key does not exist
+static void KeyTtlCallback(const v8::FunctionCallbackInfo<v8::Value>& args)
+{
+    KeyHandle key(args, REDISMODULE_READ);
+    if (key.type() == REDISMODULE_KEYTYPE_EMPTY)
+    {
+        args.GetReturnValue().Set(-2);
+        return;
+    }
+    mstime_t ms = RedisModule_GetExpire(key.key());
+    args.GetReturnValue().Set((double)((ms == REDISMODULE_NO_EXPIRE) ? -1 : ms));
+}
+
+static void KeyDelCallback(const v8::FunctionCallbackInfo<v8::Value>& args)
+{
+    if (FBlockWrite(args))
+        return;
+    KeyHandle key(args, REDISMODULE_READ | REDISMODULE_WRITE);
+    if (key.type() == REDISMODULE_KEYTYPE_EMPTY)
+    {
+        args.GetReturnValue().Set(false);
+        return;
+    }
+    args.GetReturnValue().Set(RedisModule_DeleteKey(key.key()) == REDISMODULE_OK);
+}
+
+static const struct
+{
+    const char *szName;
+    int keytype;
+} c_rgkeytypes[] = {
+    { "string", REDISMODULE_KEYTYPE_STRING },
+    { "list", REDISMODULE_KEYTYPE_LIST },
+    { "hash", REDISMODULE_KEYTYPE_HASH },
+    { "set", REDISMODULE_KEYTYPE_SET },
+    { "zset", REDISMODULE_KEYTYPE_ZSET },
+    { "module", REDISMODULE_KEYTYPE_MODULE },
+    { "stream", REDISMODULE_KEYTYPE_STREAM },
+};
+
+static const char *KeyTypeName(int keytype)
+{
+    for (auto &keytypename : c_rgkeytypes)
+    {
+        if (keytypename.keytype == keytype)
+            return keytypename.szName;
+    }
+    return "none";
+}
+
+// Returns -1 if the name isn't a key type
+static int KeyTypeFromName(const char *szName)
+{
+    for (auto &keytypename : c_rgkeytypes)
+    {
+        if (!strcasecmp(keytypename.szName, szName))
+            return keytypename.keytype;
+    }
+    return -1;
+}
+
+static void KeyTypeCallback(const v8::FunctionCallbackInfo<v8::Value>& args)
+{
+    v8::Isolate *isolate = args.GetIsolate();
+    KeyHandle key(args, REDISMODULE_READ);
+    args.GetReturnValue().Set(v8::String::NewFromUtf8(isolate, KeyTypeName(key.type())).ToLocalChecked());
+}
+
+static void KeyLengthCallback(const v8::FunctionCallbackInfo<v8::Value>& args)
+{
+    KeyHandle key(args, REDISMODULE_READ);
+    size_t cch = (key.key() != nullptr) ? RedisModule_ValueLength(key.key()) : 0;
+    args.GetReturnValue().Set((double)cch);
+}
+
+static void KeyHGetCallback(const v8::FunctionCallbackInfo<v8::Value>& args)
+{
+    v8::Isolate *isolate = args.GetIsolate();
+    if (args.Length() != 1)
+    {
+        ThrowError(isolate, "hget() expects one parameter");
+        return;
+    }
+
+    KeyHandle key(args, REDISMODULE_READ);
+    if (!key.FCheckType(isolate, REDISMODULE_KEYTYPE_HASH))
+        return;
+    args.GetReturnValue().SetNull();
+    if (key.type() == REDISMODULE_KEYTYPE_EMPTY)
+        return;
+
+    RedisModuleString *field = CreateStringFromValue(isolate, args[0]);
+    RedisModuleString *val = nullptr;
+    RedisModule_HashGet(key.key(), REDISMODULE_HASH_NONE, field, &val, NULL);
+    if (val != nullptr)
+    {
+        size_t cch;
+        const char *rgch = RedisModule_StringPtrLen(val, &cch);
+        args.GetReturnValue().Set(v8::String::NewFromUtf8(isolate, rgch, v8::NewStringType::kNormal, cch).ToLocalChecked());
+        RedisModule_FreeString(g_ctx, val);
+    }
+    RedisModule_FreeString(g_ctx, field);
+}
+
+// Shared by hset() and hdel(), if vval is empty the field is deleted
+static void KeyHashSetImpl(const v8::FunctionCallbackInfo<v8::Value>& args, v8::Local<v8::Value> vfield, v8::Local<v8::Value> vval)
+{
+    v8::Isolate *isolate = args.GetIsolate();
+    if (FBlockWrite(args))
+        return;
+    KeyHandle key(args, REDISMODULE_READ | REDISMODULE_WRITE);
+    if (!key.FCheckType(isolate, REDISMODULE_KEYTYPE_HASH))
+        return;
+
+    RedisModuleString *field = CreateStringFromValue(isolate, vfield);
+    RedisModuleString *val = vval.IsEmpty() ? REDISMODULE_HASH_DELETE : CreateStringFromValue(isolate, vval);
+    int cupdated = RedisModule_HashSet(key.key(), REDISMODULE_HASH_NONE, field, val, NULL);
+    if (val != REDISMODULE_HASH_DELETE)
+        RedisModule_FreeString(g_ctx, val);
+    RedisModule_FreeString(g_ctx, field);
+    args.GetReturnValue().Set(cupdated);
+}
+
+static void KeyHSetCallback(const v8::FunctionCallbackInfo<v8::Value>& args)
+{
+    if (args.Length() != 2)
+    {
+        ThrowError(args.GetIsolate(), "hset() expects two parameters");
+        return;
+    }
+    KeyHashSetImpl(args, args[0], args[1]);
+}
+
+static void KeyHDelCallback(const v8::FunctionCallbackInfo<v8::Value>& args)
+{
+    if (args.Length() != 1)
+    {
+        ThrowError(args.GetIsolate(), "hdel() expects one parameter");
+        return;
+    }
+    KeyHashSetImpl(args, args[0], v8::Local<v8::Value>());
+}
+
+static void KeyListPushImpl(const v8::FunctionCallbackInfo<v8::Value>& args, int where)
+{
+    v8::Isolate *isolate = args.GetIsolate();
+    if (args.Length() != 1)
+    {
+        ThrowError(isolate, "push expects one parameter");
+        return;
+    }
+
+    if (FBlockWrite(args))
+        return;
+    KeyHandle key(args, REDISMODULE_READ | REDISMODULE_WRITE);
+    if (!key.FCheckType(isolate, REDISMODULE_KEYTYPE_LIST))
+        return;
+
+    RedisModuleString *ele = CreateStringFromValue(isolate, args[0]);
+    RedisModule_ListPush(key.key(), where, ele);
+    RedisModule_FreeString(g_ctx, ele);
+    args.GetReturnValue().Set((double)RedisModule_ValueLength(key.key()));
+}
+
+static void KeyListPopImpl(const v8::FunctionCallbackInfo<v8::Value>& args, int where)
+{
+    v8::Isolate *isolate = args.GetIsolate();
+    if (FBlockWrite(args))
+        return;
+    KeyHandle key(args, REDISMODULE_READ | REDISMODULE_WRITE);
+    if (!key.FCheckType(isolate, REDISMODULE_KEYTYPE_LIST))
+        return;
+    args.GetReturnValue().SetNull();
+    if (key.type() == REDISMODULE_KEYTYPE_EMPTY)
+        return;
+
+    RedisModuleString *ele = RedisModule_ListPop(key.key(), where);
+    if (ele != nullptr)
+    {
+        size_t cch;
+        const char *rgch = RedisModule_StringPtrLen(ele, &cch);
+        args.GetReturnValue().Set(v8::String::NewFromUtf8(isolate, rgch, v8::NewStringType::kNormal, cch).ToLocalChecked());
+        RedisModule_FreeString(g_ctx, ele);
+    }
+}
+
+static void KeyLPushCallback(const v8::FunctionCallbackInfo<v8::Value>& args) { KeyListPushImpl(args, REDISMODULE_LIST_HEAD); }
+static void KeyRPushCallback(const v8::FunctionCallbackInfo<v8::Value>& args) { KeyListPushImpl(args, REDISMODULE_LIST_TAIL); }
+static void KeyLPopCallback(const v8::FunctionCallbackInfo<v8::Value>& args) { KeyListPopImpl(args, REDISMODULE_LIST_HEAD); }
+static void KeyRPopCallback(const v8::FunctionCallbackInfo<v8::Value>& args) { KeyListPopImpl(args, REDISMODULE_LIST_TAIL); }
+
+v8::Local<v8::FunctionTemplate> CreateKeyTemplate(v8::Isolate *isolate)
+{
+    static const struct
+    {
+        const char *szName;
+        v8::FunctionCallback fn;
+    } rgmethods[] = {
+        { "get", KeyGetCallback },
+        { "getBuffer", KeyGetBufferCallback },
+        { "set", KeySetCallback },
+        { "expire", KeyExpireCallback },
+        { "ttl", KeyTtlCallback },
+        { "del", KeyDelCallback },
+        { "type", KeyTypeCallback },
+        { "length", KeyLengthCallback },
+        { "hget", KeyHGetCallback },
+        { "hset", KeyHSetCallback },
+        { "hdel", KeyHDelCallback },
+        { "lpush", KeyLPushCallback },
+        { "rpush", KeyRPushCallback },
+        { "lpop", KeyLPopCallback },
+        { "rpop", KeyRPopCallback },
+    };
+
+    v8::Local<v8::FunctionTemplate> tpl = v8::FunctionTemplate::New(isolate);
+    tpl->SetClassName(v8::String::NewFromUtf8(isolate, "Key").ToLocalChecked());
+    tpl->InstanceTemplate()->SetInternalFieldCount(1);  // the key name
+
+    // The signature ensures the methods can only be invoked on Key objects
+    v8::Local<v8::Signature> signature = v8::Signature::New(isolate, tpl);
+    v8::Local<v8::ObjectTemplate> proto = tpl->PrototypeTemplate();
+    for (auto &method : rgmethods)
+    {
+        proto->Set(v8::String::NewFromUtf8(isolate, method.szName).ToLocalChecked(),
+            v8::FunctionTemplate::New(isolate, method.fn, v8::Local<v8::Value>(), signature));
+    }
+    return tpl;
+}
+
+void KeyCallback(const v8::FunctionCallbackInfo<v8::Value>& args)
+{
+    v8::Isolate *isolate = args.GetIsolate();
+    if (args.Length() != 1)
+    {
+        ThrowError(isolate, "key() expects one parameter");
+        return;
+    }
+
+    JSContext *jscontext = (JSContext*)isolate->GetData(0);
+    v8::Local<v8::Context> context = isolate->GetCurrentContext();
+    v8::Local<v8::Function> ctor;
+    v8::Local<v8::Object> obj;
+    if (!jscontext->getKeyTemplate()->GetFunction(context).ToLocal(&ctor) || !ctor->NewInstance(context).ToLocal(&obj))
+        return;
+    obj->SetInternalField(0, args[0]);
+    args.GetReturnValue().Set(obj);
+}
+
+/*
+ * keydb.scan() and keydb.scanKey().  Each RedisModule_Scan call finds a handful of keys which are copied into
+ *  the scratch arena and passed to the callback one by one once the call returns, the server doesn't allow
+ *  changes to the keyspace from inside its scan callback.  Cursors are kept natively so a walk can be
+ *  resumed by later invocations.
+ */
+static const size_t ccursorsMax = 1024;
+static std::mutex g_mutexCursors;
+struct ScanCursor
+{
+    RedisModuleScanCursor *cursor;
+    int db;     // a cursor only makes sense in the db it started in
+};
+static std::map<uint64_t, ScanCursor> g_mapcursors;     // ordered by id, so oldest first
+static uint64_t g_idCursorNext = 1;
+
+struct ScanItem
+{
+    const char *rgch;
+    size_t cch;
+};
+
+struct ScanBatch
+{
+    const char *rgchMatch = nullptr;
+    size_t cchMatch = 0;
+    bool fMatchAll = true;
+    int keytype = REDISMODULE_KEYTYPE_EMPTY;    // EMPTY matches any type
+    size_t cvisited = 0;
+    SmallVector<ScanItem, 16> vecitems;     // key names, or fields and values for scanKey
+};
+
+static const char *CopyToArena(RedisModuleString *str, size_t *pcch)
+{
+    const char *rgch = RedisModule_StringPtrLen(str, pcch);
+    char *rgchCopy = scratch_arena().allocString(*pcch);
+    memcpy(rgchCopy, rgch, *pcch);
+    return rgchCopy;
+}
+
+static void scan_collect(RedisModuleCtx *, RedisModuleString *keyname, RedisModuleKey *key, void *privdata)
+{
+    ScanBatch *pbatch = (ScanBatch*)privdata;
+    ++pbatch->cvisited;
+    size_t cch;
+    const char *rgch = RedisModule_StringPtrLen(keyname, &cch);
+    if (!pbatch->fMatchAll && !glob_match(pbatch->rgchMatch, pbatch->cchMatch, rgch, cch))
+        return;
+    if (pbatch->keytype != REDISMODULE_KEYTYPE_EMPTY && (key == nullptr || RedisModule_KeyType(key) != pbatch->keytype))
+        return;
+    rgch = CopyToArena(keyname, &cch);
+    pbatch->vecitems.push_back(ScanItem{rgch, cch});
+}
+
+static void scan_key_collect(RedisModuleKey *, RedisModuleString *field, RedisModuleString *value, void *privdata)
+{
+    ScanBatch *pbatch = (ScanBatch*)privdata;
+    ++pbatch->cvisited;
+    size_t cchField;
+    const char *rgchField = RedisModule_StringPtrLen(field, &cchField);
+    if (!pbatch->fMatchAll && !glob_match(pbatch->rgchMatch, pbatch->cchMatch, rgchField, cchField))
+        return;
+    size_t cchValue = 0;
+    const char *rgchValue = nullptr;    // sets have no value
+    if (value != nullptr)
+        rgchValue = CopyToArena(value, &cchValue);
+    rgchField = CopyToArena(field, &cchField);
+    pbatch->vecitems.push_back(ScanItem{rgchField, cchField});
+    pbatch->vecitems.push_back(ScanItem{rgchValue, cchValue});
+}
+
+static bool FGetOption(v8::Isolate *isolate, v8::Local<v8::Value> voptions, const char *szName, v8::Local<v8::Value> *pval)
+{
+    *pval = v8::Undefined(isolate);
+    if (!voptions->IsObject())
+        return true;
+    return v8::Local<v8::Object>::Cast(voptions)->Get(isolate->GetCurrentContext(), v8::String::NewFromUtf8(isolate, szName).ToLocalChecked()).ToLocal(pval);
+}
+
+// Reads the match option into the batch, the pattern is allocated in the current ArenaScope
+static bool FParseMatchOption(v8::Isolate *isolate, v8::Local<v8::Value> voptions, ScanBatch *pbatch)
+{
+    v8::Local<v8::Value> vmatch;
+    if (!FGetOption(isolate, voptions, "match", &vmatch))
+        return false;
+    if (vmatch->IsUndefined())
+        return true;
+    pbatch->rgchMatch = ValueToUtf8(isolate, vmatch, &pbatch->cchMatch);
+    pbatch->fMatchAll = glob_matches_all(pbatch->rgchMatch, pbatch->cchMatch);
+    return true;
+}
+
+// scan(cursor, fn, {count, match, type, handle}) calls fn(key[, handle]) for about count keys and returns
+//  the cursor to continue from, 0 once every key has been visited
+void ScanCallback(const v8::FunctionCallbackInfo<v8::Value>& args)
+{
+    v8::Isolate *isolate = args.GetIsolate();
+    v8::HandleScope scope(isolate);
+    v8::Local<v8::Context> context = isolate->GetCurrentContext();
+    if (args.Length() < 2 || !args[1]->IsFunction())
+    {
+        ThrowError(isolate, "scan() expects a cursor and a function");
+        return;
+    }
+    v8::Local<v8::Function> fn = v8::Local<v8::Function>::Cast(args[1]);
+    v8::Local<v8::Value> voptions = (args.Length() > 2) ? args[2] : v8::Undefined(isolate).As<v8::Value>();
+
+    ArenaScope arenascope;
+    ScanBatch options;
+    v8::Local<v8::Value> vcount, vtype, vhandle;
+    if (!FParseMatchOption(isolate, voptions, &options)
+        || !FGetOption(isolate, voptions, "count", &vcount)
+        || !FGetOption(isolate, voptions, "type", &vtype)
+        || !FGetOption(isolate, voptions, "handle", &vhandle))
+        return;
+    size_t ccount = vcount->IsUndefined() ? 10 : (size_t)std::max(1.0, vcount->NumberValue(context).FromMaybe(10));
+    if (!vtype->IsUndefined())
+    {
+        v8::String::Utf8Value utf8Type(isolate, vtype);
+        options.keytype = (*utf8Type != nullptr) ? KeyTypeFromName(*utf8Type) : -1;
+        if (options.keytype <= REDISMODULE_KEYTYPE_EMPTY)
+        {
+            ThrowError(isolate, "scan() type must be string, list, hash, set, zset, module or stream");
+            return;
+        }
+    }
+    bool fHandle = vhandle->BooleanValue(isolate);
+
+    // The cursor is taken out of the map while in use so a nested scan can't share it
+    uint64_t id = (uint64_t)args[0]->NumberValue(context).FromMaybe(0);
+    int db = RedisModule_GetSelectedDb(g_ctx);
+    RedisModuleScanCursor *cursor = nullptr;
+    if (id == 0)
+    {
+        cursor = RedisModule_ScanCursorCreate();
+    }
+    else
+    {
+        std::unique_lock<std::mutex> lock(g_mutexCursors);
+        auto itr = g_mapcursors.find(id);
+        if (itr != g_mapcursors.end())
+        {
+            if (itr->second.db != db)
+            {
+                lock.unlock();
+                ThrowError(isolate, "ERR cursor belongs to a different db");
+                return;
+            }
+            cursor = itr->second.cursor;
+            g_mapcursors.erase(itr);
+        }
+    }
+    if (cursor == nullptr)
+    {
+        ThrowError(isolate, "ERR invalid or expired cursor");
+        return;
+    }
+
+    JSContext *jscontext = (JSContext*)isolate->GetData(0);
+    bool fMore = true;
+    bool fFailed = false;
+    size_t cvisited = 0;
+    while (fMore && !fFailed && cvisited < ccount)
+    {
+        ArenaScope arenascopeBatch;
+        ScanBatch batch;
+        batch.rgchMatch = options.rgchMatch;
+        batch.cchMatch = options.cchMatch;
+        batch.fMatchAll = options.fMatchAll;
+        batch.keytype = options.keytype;
+        {
+            ServerLock lock;
+            fMore = RedisModule_Scan(g_ctx, cursor, scan_collect, &batch) != 0;
+        }
+        cvisited += batch.cvisited;
+
+        for (auto &item : batch.vecitems)
+        {
+            v8::HandleScope scopeKey(isolate);
+            v8::Local<v8::Value> argv[2];
+            argv[0] = v8::String::NewFromUtf8(isolate, item.rgch, v8::NewStringType::kNormal, (int)item.cch).ToLocalChecked();
+            int argc = 1;
+            if (fHandle)
+            {
+                v8::Local<v8::Function> ctor;
+                v8::Local<v8::Object> obj;
+                if (!jscontext->getKeyTemplate()->GetFunction(context).ToLocal(&ctor) || !ctor->NewInstance(context).ToLocal(&obj))
+                {
+                    fFailed = true;
+                    break;
+                }
+                obj->SetInternalField(0, argv[0]);
+                argv[argc++] = obj;
+            }
+            if (fn->Call(context, context->Global(), argc, argv).IsEmpty())
+            {
+                fFailed = true;     // the exception propagates to our caller
+                break;
+            }
+        }
+    }
+
+    // A fresh scan that threw never handed out its id, so nothing could resume it
+    if (!fMore || (fFailed && id == 0))
+    {
+        RedisModule_ScanCursorDestroy(cursor);
+        if (!fFailed)
+            args.GetReturnValue().Set(v8::Number::New(isolate, 0));
+        return;
+    }
+
+    // After an exception a resumed cursor is kept, the keys already delivered won't be seen again
+    std::vector<RedisModuleScanCursor*> vecexpired;
+    {
+        std::unique_lock<std::mutex> lock(g_mutexCursors);
+        if (id == 0)
+            id = g_idCursorNext++;
+        g_mapcursors.emplace(id, ScanCursor{cursor, db});
+        while (g_mapcursors.size() > ccursorsMax)
+        {
+            vecexpired.push_back(g_mapcursors.begin()->second.cursor);
+            g_mapcursors.erase(g_mapcursors.begin());
+        }
+    }
+    for (RedisModuleScanCursor *cursorExpired : vecexpired)
+        RedisModule_ScanCursorDestroy(cursorExpired);
+    if (!fFailed)
+        args.GetReturnValue().Set(v8::Number::New(isolate, (double)id));
+}
+
+// scanKey(key, fn, {match}) calls fn(field, value) for every member of a hash, set or zset.  Sets pass
+//  only the member and zsets pass the score as a Number
+void ScanKeyCallback(const v8::FunctionCallbackInfo<v8::Value>& args)
+{
+    v8::Isolate *isolate = args.GetIsolate();
+    v8::HandleScope scope(isolate);
+    v8::Local<v8::Context> context = isolate->GetCurrentContext();
+    if (args.Length() < 2 || !args[1]->IsFunction())
+    {
+        ThrowError(isolate, "scanKey() expects a key and a function");
+        return;
+    }
+    v8::Local<v8::Function> fn = v8::Local<v8::Function>::Cast(args[1]);
+    v8::Local<v8::Value> voptions = (args.Length() > 2) ? args[2] : v8::Undefined(isolate).As<v8::Value>();
+
+    ArenaScope arenascope;
+    ScanBatch options;
+    if (!FParseMatchOption(isolate, voptions, &options))
+        return;
+
+    RedisModuleScanCursor *cursor = RedisModule_ScanCursorCreate();
+    bool fMore = true;
+    while (fMore)
+    {
+        ArenaScope arenascopeBatch;
+        ScanBatch batch;
+        batch.rgchMatch = options.rgchMatch;
+        batch.cchMatch = options.cchMatch;
+        batch.fMatchAll = options.fMatchAll;
+        int keytype;
+        {
+            // Reopened for each batch so the callback is free to write to the key
+            KeyHandle key(isolate, args[0], REDISMODULE_READ);
+            keytype = key.type();
+            if (keytype == REDISMODULE_KEYTYPE_EMPTY)
+                break;
+            if (keytype != REDISMODULE_KEYTYPE_HASH && keytype != REDISMODULE_KEYTYPE_SET && keytype != REDISMODULE_KEYTYPE_ZSET)
+            {
+                ThrowError(isolate, "WRONGTYPE Operation against a key holding the wrong kind of value");
+                break;
+            }
+            fMore = RedisModule_ScanKey(key.key(), cursor, scan_key_collect, &batch) != 0;
+        }
+
+        bool fFailed = false;
+        for (size_t iitem = 0; iitem + 1 < batch.vecitems.size(); iitem += 2)
+        {
+            v8::HandleScope scopeItem(isolate);
+            const auto &field = batch.vecitems[iitem];
+            const auto &value = batch.vecitems[iitem + 1];
+            v8::Local<v8::Value> argv[2];
+            argv[0] = v8::String::NewFromUtf8(isolate, field.rgch, v8::NewStringType::kNormal, (int)field.cch).ToLocalChecked();
+            int argc = 1;
+            if (keytype == REDISMODULE_KEYTYPE_ZSET)
+                argv[argc++] = v8::Number::New(isolate, strtod(std::string(value.rgch, value.cch).c_str(), nullptr));
+            else if (value.rgch != nullptr)
+                argv[argc++] = v8::String::NewFromUtf8(isolate, value.rgch, v8::NewStringType::kNormal, (int)value.cch).ToLocalChecked();
+            if (fn->Call(context, context->Global(), argc, argv).IsEmpty())
+            {
+                fFailed = true;
+                break;
+            }
+        }
+        if (fFailed)
+            break;
+    }
+    RedisModule_ScanCursorDestroy(cursor);
+}
+
+void LogCallback(const v8::FunctionCallbackInfo<v8::Value>& args) 
+{
+    v8::Isolate* isolate = args.GetIsolate();
+    v8::HandleScope scope(isolate);
+
+    if (args.Length() != 2)
+    {
+        isolate->ThrowException(v8::String::NewFromUtf8(isolate, "Log expects two parameters").ToLocalChecked());
+        return;
+    }
+    
+    
+    v8::String::Utf8Value level(isolate, args[0]);
+    v8::String::Utf8Value message(isolate, args[1]);
+    RedisModule_Log(g_ctx, *level, "%s", *message);
+}
+
+union ParsedArg
+{
+    long long ll;
+    double d;
+};
+
+static ArgType argTypeAt(const RegisteredCommand *pcmd, size_t iarg)
+{
+    if (!pcmd->m_fTypedArgs)
+        return ArgType::String;
+    if (iarg < pcmd->m_vecargtypes.size() && pcmd->m_vecargtypes[iarg] != ArgType::Rest)
+        return pcmd->m_vecargtypes[iarg];
+    return ArgType::String;
+}
+
+// Validate the arguments against the command's signature.  Returns false and replies with an
+//  error if they don't match, this happens before we enter V8 so bad input is cheap to reject
+static bool FParseArgs(RedisModuleCtx *ctx, const RegisteredCommand *pcmd, RedisModuleString **argv, int argc, SmallVector<ParsedArg, 8> &vecparsed)
+{
+    if (!pcmd->m_fTypedArgs)
+        return true;
+
+    size_t cargs = (size_t)(argc - 1);
+    bool fRest = !pcmd->m_vecargtypes.empty() && pcmd->m_vecargtypes.back() == ArgType::Rest;
+    size_t cargsFixed = pcmd->m_vecargtypes.size() - (fRest ? 1 : 0);
+    if (cargs < cargsFixed || (!fRest && cargs > cargsFixed))
+    {
+        RedisModule_WrongArity(ctx);
+        return false;
+    }
+
+    vecparsed.resize(cargs);
+    for (size_t iarg = 0; iarg < cargsFixed; ++iarg)
+    {
+        switch (pcmd->m_vecargtypes[iarg])
+        {
+        case ArgType::Int64:
+            if (RedisModule_StringToLongLong(argv[iarg+1], &vecparsed[iarg].ll) == REDISMODULE_ERR)
+            {
+                RedisModule_ReplyWithError(ctx, "ERR value is not an integer or out of range");
+                return false;
+            }
+            break;
+
+        case ArgType::Double:
+            if (RedisModule_StringToDouble(argv[iarg+1], &vecparsed[iarg].d) == REDISMODULE_ERR)
+            {
+                RedisModule_ReplyWithError(ctx, "ERR value is not a valid float");
+                return false;
+            }
+            break;
+
+        default:
+            break;
+        }
+    }
+    return true;
+}
+
+static v8::Local<v8::Value> ArgToValue(v8::Isolate *isolate, ArgType type, RedisModuleString *arg, const ParsedArg &parsed)
+{
+    size_t cch;
+    const char *rgch;
+    switch (type)
+    {
+    case ArgType::Int64:
+        // Values outside the safe integer range would lose precision as a Number
+        if (parsed.ll > (1LL << 53) || parsed.ll < -(1LL << 53))
+            return v8::BigInt::New(isolate, parsed.ll);
+        return v8::Number::New(isolate, (double)parsed.ll);
+
+    case ArgType::Double:
+        return v8::Number::New(isolate, parsed.d);
+
+    case ArgType::Buffer:
+        rgch = RedisModule_StringPtrLen(arg, &cch);
+        return NewUint8Array(isolate, rgch, cch);
+
+    default:
+        rgch = RedisModule_StringPtrLen(arg, &cch);
+        return v8::String::NewFromUtf8(isolate, rgch, v8::NewStringType::kNormal, cch).ToLocalChecked();
+    }
+}
+
+/*
+ * Async commands.  If a registered function returns a pending Promise the client is blocked and
+ *  unblocked with the settled value once the Promise resolves or rejects.
+ */
+// Times one invocation of a command or script for INFO, slow ones are also reported to LATENCY
+class ScriptTimer
+{
+    CommandStats *m_pstats;
+    const char *m_szEvent;
+    uint64_t m_usStart;
+    bool m_fError = false;
+
+public:
+    ScriptTimer(CommandStats *pstats, const char *szEvent)
+        : m_pstats(pstats), m_szEvent(szEvent), m_usStart(stats_now_us())
+    {}
+
+    ~ScriptTimer()
+    {
+        uint64_t us = stats_now_us() - m_usStart;
+        m_pstats->ccalls.fetch_add(1, std::memory_order_relaxed);
+        if (m_fError)
+            m_pstats->cerrors.fetch_add(1, std::memory_order_relaxed);
+        m_pstats->histogram.record(us);
+
+        long long ms = (long long)(us / 1000);
+        if (g_msLatencyThreshold > 0 && ms >= g_msLatencyThreshold)
+            RedisModule_LatencyAddSample(m_szEvent, ms);
+    }
+
+    void error() { m_fError = true; }
+};
+
+struct PendingPromise
+{
+    JSContext *jscontext;
+    CommandStats *pstats;
+    RedisModuleBlockedClient *bc;
+    v8::Global<v8::Value> value;
+    bool fRejected = false;
+    bool fTimedOut = false;
+};
+
+// Blocked clients whose Promise hasn't settled, including ones that already timed out.  The Promise may settle
+//  on a different thread than a timeout fires, whoever removes the entry owns it
+static std::mutex g_mutexPending;
+static std::unordered_map<RedisModuleBlockedClient*, PendingPromise*> g_mappending;
+
+static void PromiseSettled(const v8::FunctionCallbackInfo<v8::Value>& args, bool fRejected)
+{
+    PendingPromise *pending = (PendingPromise*)v8::Local<v8::External>::Cast(args.Data())->Value();
+    {
+        std::unique_lock<std::mutex> lock(g_mutexPending);
+        if (g_mappending.erase(pending->bc) == 0)
+            return;     // released with its context
+        if (pending->fTimedOut)
+        {
+            // The client already got its timeout reply, the handle is only freed once it is unblocked
+            lock.unlock();
+            RedisModule_UnblockClient(pending->bc, nullptr);
+            delete pending;
+            return;
+        }
+    }
+
+    pending->value.Reset(args.GetIsolate(), args[0]);
+    pending->fRejected = fRejected;
+    RedisModule_UnblockClient(pending->bc, pending);
+}
+
+static void PromiseFulfilledCallback(const v8::FunctionCallbackInfo<v8::Value>& args)
+{
+    PromiseSettled(args, false /* fRejected */);
+}
+
+static void PromiseRejectedCallback(const v8::FunctionCallbackInfo<v8::Value>& args)
+{
+    PromiseSettled(args, true /* fRejected */);
+}
+
+static int promise_reply(RedisModuleCtx *ctx, RedisModuleString **, int)
+{
+    KeyDBContext ctxsav(ctx);
+    PendingPromise *pending = (PendingPromise*)RedisModule_GetBlockedClientPrivateData(ctx);
+
+    v8::Isolate *isolate = pending->jscontext->getIsolate();
+    v8::Locker locker(isolate);
+    v8::HandleScope scope(isolate);
+    v8::Local<v8::Context> context = pending->jscontext->getCurrentContext();
+    v8::Context::Scope context_scope(context);
+
+    v8::Local<v8::Value> value = pending->value.Get(isolate);
+    if (pending->fRejected)
+    {
+        pending->pstats->cerrors.fetch_add(1, std::memory_order_relaxed);
+        ReplyWithJSError(ctx, isolate, context, value);
+    }
+    else
+        processResult(ctx, isolate, context, value);
+    return REDISMODULE_OK;
+}
+
+static int promise_timeout(RedisModuleCtx *ctx, RedisModuleString **, int)
+{
+    RedisModuleBlockedClient *bc = RedisModule_GetBlockedClientHandle(ctx);
+    {
+        std::unique_lock<std::mutex> lock(g_mutexPending);
+        auto itr = g_mappending.find(bc);
+        if (itr != g_mappending.end())
+            itr->second->fTimedOut = true;  // unblocked when the Promise settles or its context is freed
+    }
+    return RedisModule_ReplyWithError(ctx, "ERR javascript promise timed out");
+}
+
+static void promise_free(RedisModuleCtx *, void *privdata)
+{
+    PendingPromise *pending = (PendingPromise*)privdata;
+    if (pending == nullptr)
+        return; // timed out, the client was already replied to
+
+    v8::Locker locker(pending->jscontext->getIsolate());
+    delete pending;
+}
+
+// Replies for a Promise returned by a command, blocking the client if it has not settled yet
+static void processPromise(RedisModuleCtx *ctx, JSContext *jscontext, RegisteredCommand *pcmd, v8::Local<v8::Context> &context, v8::Local<v8::Promise> promise)
+{
+    v8::Isolate *isolate = jscontext->getIsolate();
+    isolate->PerformMicrotaskCheckpoint();
+
+    switch (promise->State())
+    {
+    case v8::Promise::kFulfilled:
+        {
+        v8::Local<v8::Value> value = promise->Result();
+        processResult(ctx, isolate, context, value);
+        return;
+        }
+
+    case v8::Promise::kRejected:
+        pcmd->m_pstats->cerrors.fetch_add(1, std::memory_order_relaxed);
+        ReplyWithJSError(ctx, isolate, context, promise->Result());
+        return;
+
+    case v8::Promise::kPending:
+        break;
+    }
+
+    if (RedisModule_GetContextFlags(ctx) & (REDISMODULE_CTX_FLAGS_LUA | REDISMODULE_CTX_FLAGS_MULTI))
+    {
+        RedisModule_ReplyWithError(ctx, "ERR async javascript commands can't be used in a transaction or script");
+        return;
+    }
+
+    PendingPromise *pending = new PendingPromise();
+    pending->jscontext = jscontext;
+    pending->pstats = pcmd->m_pstats;
+    long long timeoutMs = (pcmd->m_timeoutMs > 0) ? pcmd->m_timeoutMs : g_msPromiseTimeout;
+    pending->bc = RedisModule_BlockClient(ctx, promise_reply, promise_timeout, promise_free, timeoutMs);
+    {
+        std::unique_lock<std::mutex> lock(g_mutexPending);
+        g_mappending.emplace(pending->bc, pending);
+    }
+
+    v8::Local<v8::External> data = v8::External::New(isolate, pending);
+    v8::Local<v8::Function> fnFulfilled, fnRejected;
+    if (!v8::Function::New(context, PromiseFulfilledCallback, data).ToLocal(&fnFulfilled)
+        || !v8::Function::New(context, PromiseRejectedCallback, data).ToLocal(&fnRejected)
+        || promise->Then(context, fnFulfilled, fnRejected).IsEmpty())
+    {
+        {
+            std::unique_lock<std::mutex> lock(g_mutexPending);
+            g_mappending.erase(pending->bc);
+        }
+        pending->value.Reset(isolate, v8::String::NewFromUtf8(isolate, "failed to wait on promise").ToLocalChecked());
+        pending->fRejected = true;
+        RedisModule_UnblockClient(pending->bc, pending);
+    }
+}
+
+int js_command(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+{
+    KeyDBContext ctxsav(ctx);
+
+    if (argc < 1)
+        return REDISMODULE_ERR;
+
+    size_t cchName;
+    const char *rgchName = RedisModule_StringPtrLen(argv[0], &cchName);
+
+    ContextInUse contextinuse;
+    JSContext *jscontext = contextinuse.get();
+    RegisteredCommand *pcmd = jscontext->lookupCommand(rgchName, cchName);
+    if (pcmd == nullptr)
+    {
+        RedisModule_ReplyWithError(ctx, "ERR unknown javascript command");
+        return REDISMODULE_ERR;
+    }
+
+    ScriptTimer timer(pcmd->m_pstats, "modjs-command");
+
+    // Everything we marshal for this call comes from the scratch arena
+    ArenaScope arenascope;
+    SmallVector<ParsedArg, 8> vecparsed;
+    if (!FParseArgs(ctx, pcmd, argv, argc, vecparsed))
+    {
+        timer.error();
+        return REDISMODULE_ERR;
+    }
+
+    v8::Locker locker(jscontext->getIsolate());
+    v8::HandleScope scope(jscontext->getIsolate());
+    ProfilerCommandScope profilerscope(jscontext->getIsolate(), pcmd->m_pstats->strName.c_str());
+    WatchdogScope watchdogscope(jscontext->getWatchdog(), pcmd->m_timeLimitMs >= 0 ? pcmd->m_timeLimitMs : watchdog_default_ms());
+
+    v8::Local<v8::Context> context = jscontext->getCurrentContext();
+    v8::Context::Scope context_scope(context);
+    
+    try
+    {
+        v8::Isolate *isolate = jscontext->getIsolate();
+        v8::Local<v8::Object> global = context->Global();
+        v8::Local<v8::Function> fnCall = v8::Local<v8::Function>::New(isolate, pcmd->m_fn);
+        SmallVector<v8::Local<v8::Value>, 8> vecargs;
+        vecargs.reserve(argc);
+        
+        for (int iarg = 1; iarg < argc; ++iarg)
+        {
+            ArgType type = argTypeAt(pcmd, iarg - 1);
+            const ParsedArg &parsed = pcmd->m_fTypedArgs ? vecparsed[iarg - 1] : ParsedArg();
+            vecargs.push_back(ArgToValue(isolate, type, argv[iarg], parsed));
+        }
+
+        v8::TryCatch trycatch(isolate);
+        auto maybeResult = fnCall->Call(context, global, (int)vecargs.size(), vecargs.data());
+
+        v8::Local<v8::Value> result;
+        if (!maybeResult.ToLocal(&result))
+        {
+            timer.error();
+            std::string strErr;
+            if (jscontext->FHeapLimitReached())
+                RedisModule_ReplyWithError(ctx, "ERR script exceeded the JavaScript heap limit");
+            else if (watchdog_consume_termination(jscontext->getWatchdog(), &strErr))
+                RedisModule_ReplyWithError(ctx, strErr.c_str());
+            else if (trycatch.HasCaught())
+                ReplyWithJSError(ctx, isolate, context, trycatch.Exception());
+            else
+                RedisModule_ReplyWithNull(ctx);
+            return REDISMODULE_OK;
+        }
+
+        if (result->IsPromise())
+            processPromise(ctx, jscontext, pcmd, context, v8::Local<v8::Promise>::Cast(result));
+        else
+            processResult(ctx, isolate, context, result);
+    }
+    catch (std::string strerr)
+    {
+        timer.error();
+        RedisModule_ReplyWithError(ctx, strerr.c_str());
+        return REDISMODULE_ERR;
+    }
+    catch (std::nullptr_t)
+    {
+        timer.error();
+        RedisModule_ReplyWithError(ctx, "Unknown Error");
+        return REDISMODULE_ERR;
+    }
+    return REDISMODULE_OK;
+}
+
+static bool FParseArgType(const char *sz, ArgType *ptype)
+{
+    if (!strcasecmp(sz, "string"))
+        *ptype = ArgType::String;
+    else if (!strcasecmp(sz, "int64"))
+        *ptype = ArgType::Int64;
+    else if (!strcasecmp(sz, "double"))
+        *ptype = ArgType::Double;
+    else if (!strcasecmp(sz, "buffer"))
+        *ptype = ArgType::Buffer;
+    else if (!strcasecmp(sz, "rest"))
+        *ptype = ArgType::Rest;
+    else
+        return false;
+    return true;
+}
+
+// Parse the "args" signature out of the register() options
+static bool FParseSignature(v8::Isolate *isolate, v8::Local<v8::Value> vsig, std::vector<ArgType> &vecargtypes)
+{
+    if (!vsig->IsArray())
+    {
+        isolate->ThrowException(v8::String::NewFromUtf8(isolate, "args must be an array of argument types").ToLocalChecked());
+        return false;
+    }
+
+    v8::Local<v8::Context> context = isolate->GetCurrentContext();
+    v8::Local<v8::Array> array = v8::Local<v8::Array>::Cast(vsig);
+    for (uint32_t ielem = 0; ielem < array->Length(); ++ielem)
+    {
+        v8::Local<v8::Value> velem;
+        if (!array->Get(context, ielem).ToLocal(&velem))
+            return false;
+
+        v8::String::Utf8Value utf8Type(isolate, velem);
+        ArgType type;
+        if (*utf8Type == nullptr || !FParseArgType(*utf8Type, &type))
+        {
+            std::string strErr = "unknown argument type: ";
+            strErr += (*utf8Type != nullptr) ? *utf8Type : "(null)";
+            isolate->ThrowException(v8::String::NewFromUtf8(isolate, strErr.c_str()).ToLocalChecked());
+            return false;
+        }
+        if (type == ArgType::Rest && ielem != array->Length() - 1)
+        {
+            isolate->ThrowException(v8::String::NewFromUtf8(isolate, "rest must be the last argument type").ToLocalChecked());
+            return false;
+        }
+        vecargtypes.push_back(type);
+    }
+    return true;
+}
+
+void RegisterCommandCallback(const v8::FunctionCallbackInfo<v8::Value>& args)
+{
+    if (args.Length() < 1) return;
+    v8::Isolate* isolate = args.GetIsolate();
+    v8::HandleScope scope(isolate);
+
+    // Per-thread contexts replay the startup scripts, the server already knows about their commands
+    JSContext *jscontext = (JSContext*)isolate->GetData(0);
+    bool fReplica = (jscontext != g_jscontext.load(std::memory_order_acquire));
+
+    if (!(fReplica ? t_fInReplicaStartup : g_fInStartup))
+    {
+        isolate->ThrowException(v8::String::NewFromUtf8(isolate, "New commands may only be registered during startup").ToLocalChecked());
+        return;
+    }
+
+    v8::Local<v8::Value> vfn = args[0];
+    if (!vfn->IsFunction())
+        return;
+
+    v8::Local<v8::Function> fn = v8::Local<v8::Function>::Cast(vfn);
+    v8::Local<v8::Value> vfnName = fn->GetName();
+    v8::String::Utf8Value fnName(isolate, vfnName);
+
+    std::string flags = "write deny-oom random";
+    if (args.Length() >= 2)
+    {
+        // They passed in their own flags
+        v8::Local<v8::Value> vFlags = args[1];
+        if (vFlags->IsString())
+        {
+            auto utfFlags = v8::String::Utf8Value(isolate, vFlags);
+            flags = *utfFlags;
+        }
+    }
+
+    int keyFirst = 0;
+    int keyLast = 0;
+    int keyStep = 0;
+    if (args.Length() > 2)
+    {
+        if (args.Length() != 5 && args.Length() != 6)
+        {
+            isolate->ThrowException(v8::String::NewFromUtf8(isolate, "incorrect number of arguments to register()").ToLocalChecked());
+            return;
+        }
+
+        if (!args[2]->IsInt32() || !args[3]->IsInt32() || !args[4]->IsInt32())
+        {
+            isolate->ThrowException(v8::String::NewFromUtf8(isolate, "expected integer argument").ToLocalChecked());
+            return;
+        }
+
+        keyFirst = v8::Local<v8::Int32>::Cast(args[2])->Value();
+        keyLast = v8::Local<v8::Int32>::Cast(args[3])->Value();
+        keyStep = v8::Local<v8::Int32>::Cast(args[4])->Value();
+    }
+
+    // Optional settings such as the argument signature
+    v8::Local<v8::Object> options;
+    if (args.Length() > 5 && args[5]->IsObject())
+        options = v8::Local<v8::Object>::Cast(args[5]);
+
+    bool fTypedArgs = false;
+    std::vector<ArgType> vecargtypes;
+    long long timeoutMs = 0;
+    long long timeLimitMs = -1;
+    if (!options.IsEmpty())
+    {
+        v8::Local<v8::Context> context = isolate->GetCurrentContext();
+        v8::Local<v8::Value> vsig;
+        if (!options->Get(context, v8::String::NewFromUtf8(isolate, "args").ToLocalChecked()).ToLocal(&vsig))
+            return;
+        if (!vsig->IsUndefined())
+        {
+            if (!FParseSignature(isolate, vsig, vecargtypes))
+                return;
+            fTypedArgs = true;
+        }
+
+        v8::Local<v8::Value> vtimeout;
+        if (!options->Get(context, v8::String::NewFromUtf8(isolate, "timeout").ToLocalChecked()).ToLocal(&vtimeout))
+            return;
+        if (!vtimeout->IsUndefined())
+        {
+            if (!vtimeout->IsNumber() || v8::Local<v8::Number>::Cast(vtimeout)->Value() < 0)
+            {
+                isolate->ThrowException(v8::String::NewFromUtf8(isolate, "timeout must be a positive number of milliseconds").ToLocalChecked());
+                return;
+            }
+            timeoutMs = (long long)v8::Local<v8::Number>::Cast(vtimeout)->Value();
+        }
+
+        v8::Local<v8::Value> vtimelimit;
+        if (!options->Get(context, v8::String::NewFromUtf8(isolate, "timeLimit").ToLocalChecked()).ToLocal(&vtimelimit))
+            return;
+        if (!vtimelimit->IsUndefined())
+        {
+            if (!vtimelimit->IsNumber() || v8::Local<v8::Number>::Cast(vtimelimit)->Value() < 0)
+            {
+                isolate->ThrowException(v8::String::NewFromUtf8(isolate, "timeLimit must be a positive number of milliseconds").ToLocalChecked());
+                return;
+            }
+            timeLimitMs = (long long)v8::Local<v8::Number>::Cast(vtimelimit)->Value();
+        }
+    }
+
+    if (!fReplica && RedisModule_CreateCommand(g_ctx, *fnName, js_command, flags.c_str(), keyFirst, keyLast, keyStep) == REDISMODULE_ERR) {
+        isolate->ThrowException(v8::String::NewFromUtf8(isolate, "failed to register command").ToLocalChecked());
+        return;
+    }
+    if (!fReplica)
+    {
+        std::string strName(*fnName);
+        std::transform(strName.begin(), strName.end(), strName.begin(), ::tolower);
+        g_setcommands.insert(strName);
+    }
+
+    RegisteredCommand *pcmd = jscontext->registerCommand(*fnName, fn);
+    pcmd->m_strFlags = flags;
+    pcmd->m_keyFirst = keyFirst;
+    pcmd->m_keyLast = keyLast;
+    pcmd->m_keyStep = keyStep;
+    pcmd->m_fTypedArgs = fTypedArgs;
+    pcmd->m_vecargtypes = std::move(vecargtypes);
+    pcmd->m_timeoutMs = timeoutMs;
+    pcmd->m_timeLimitMs = timeLimitMs;
+
+    if (!fReplica)
+        RedisModule_Log(g_ctx, "verbose", "Function %s registered", *fnName);
+}
+
+int evaljs_command(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+{
+    KeyDBContext ctxsav(ctx);
+
+    if (argc != 2)
+    {
+        RedisModule_WrongArity(ctx);
+        return REDISMODULE_ERR;
+    }
+
+    ContextInUse contextinuse;
+    JSContext *jscontext = contextinuse.get();
+    v8::Locker locker(jscontext->getIsolate());
+    static CommandStats *s_pstats = stats_for_command("evaljs");
+    ScriptTimer timer(s_pstats, "modjs-eval");
+    ProfilerCommandScope profilerscope(jscontext->getIsolate(), s_pstats->strName.c_str());
+    WatchdogScope watchdogscope(jscontext->getWatchdog(), watchdog_default_ms());
+
+    size_t cch = 0;
+    const char *rgch = RedisModule_StringPtrLen(argv[1], &cch);
+    try
+    {
+        v8::HandleScope scope(jscontext->getIsolate());
+        v8::Local<v8::Value> result = jscontext->run(rgch, cch);
+        auto context = jscontext->getCurrentContext();
+        processResult(ctx, jscontext->getIsolate(), context, result);
+    }
+    catch (std::string strerr)
+    {
+        timer.error();
+        RedisModule_ReplyWithError(ctx, strerr.c_str());
+        return REDISMODULE_ERR;
+    }
+    catch (std::nullptr_t)
+    {
+        timer.error();
+        RedisModule_ReplyWithError(ctx, "Unknown Error");
+        return REDISMODULE_ERR;
+    }
+    return REDISMODULE_OK;
+}
+
+int evalshajs_command(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+{
+    KeyDBContext ctxsav(ctx);
+
+    if (argc != 2)
+    {
+        RedisModule_WrongArity(ctx);
+        return REDISMODULE_ERR;
+    }
+
+    size_t cchSha = 0;
+    const char *rgchSha = RedisModule_StringPtrLen(argv[1], &cchSha);
+    ScriptHash hash;
+    if (!FParseScriptHash(rgchSha, cchSha, &hash))
+    {
+        RedisModule_ReplyWithError(ctx, "NOSCRIPT No matching script. Please use EVALJS or MODJS.SCRIPT LOAD.");
+        return REDISMODULE_ERR;
+    }
+
+    ContextInUse contextinuse;
+    JSContext *jscontext = contextinuse.get();
+    v8::Locker locker(jscontext->getIsolate());
+    static CommandStats *s_pstats = stats_for_command("evaljs");
+    ScriptTimer timer(s_pstats, "modjs-eval");
+    ProfilerCommandScope profilerscope(jscontext->getIsolate(), s_pstats->strName.c_str());
+    WatchdogScope watchdogscope(jscontext->getWatchdog(), watchdog_default_ms());
+    try
+    {
+        v8::HandleScope scope(jscontext->getIsolate());
+        v8::Local<v8::Value> result;
+        if (!jscontext->FRunCachedScript(hash, &result))
+        {
+            RedisModule_ReplyWithError(ctx, "NOSCRIPT No matching script. Please use EVALJS or MODJS.SCRIPT LOAD.");
+            return REDISMODULE_ERR;
+        }
+        auto context = jscontext->getCurrentContext();
+        processResult(ctx, jscontext->getIsolate(), context, result);
+    }
+    catch (std::string strerr)
+    {
+        timer.error();
+        RedisModule_ReplyWithError(ctx, strerr.c_str());
+        return REDISMODULE_ERR;
+    }
+    catch (std::nullptr_t)
+    {
+        timer.error();
+        RedisModule_ReplyWithError(ctx, "Unknown Error");
+        return REDISMODULE_ERR;
+    }
+    return REDISMODULE_OK;
+}
+
+// MODJS.SCRIPT LOAD <script> | EXISTS <sha> [<sha> ...] | FLUSH
+int script_command(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+{
+    KeyDBContext ctxsav(ctx);
+
+    if (argc < 2)
+    {
+        RedisModule_WrongArity(ctx);
+        return REDISMODULE_ERR;
+    }
+
+    const char *szSubcommand = RedisModule_StringPtrLen(argv[1], nullptr);
+    if (!strcasecmp(szSubcommand, "load"))
+    {
+        if (argc != 3)
+        {
+            RedisModule_WrongArity(ctx);
+            return REDISMODULE_ERR;
+        }
+
+        size_t cch = 0;
+        const char *rgch = RedisModule_StringPtrLen(argv[2], &cch);
+        ContextInUse contextinuse;
+        JSContext *jscontext = contextinuse.get();
+        v8::Locker locker(jscontext->getIsolate());
+        try
+        {
+            v8::HandleScope scope(jscontext->getIsolate());
+            std::string strSha = script_hash_to_hex(jscontext->loadScript(rgch, cch));
+            RedisModule_ReplyWithStringBuffer(ctx, strSha.data(), strSha.size());
+        }
+        catch (std::string strerr)
+        {
+            RedisModule_ReplyWithError(ctx, strerr.c_str());
+            return REDISMODULE_ERR;
+        }
+        catch (std::nullptr_t)
+        {
+            RedisModule_ReplyWithError(ctx, "Unknown Error");
+            return REDISMODULE_ERR;
+        }
+    }
+    else if (!strcasecmp(szSubcommand, "exists"))
+    {
+        if (argc < 3)
+        {
+            RedisModule_WrongArity(ctx);
+            return REDISMODULE_ERR;
+        }
+
+        // The lookup may clear the context's cache after a flush, which releases V8 handles
+        ContextInUse contextinuse;
+        JSContext *jscontext = contextinuse.get();
+        v8::Locker locker(jscontext->getIsolate());
+        RedisModule_ReplyWithArray(ctx, argc - 2);
+        for (int iarg = 2; iarg < argc; ++iarg)
+        {
+            size_t cchSha = 0;
+            const char *rgchSha = RedisModule_StringPtrLen(argv[iarg], &cchSha);
+            ScriptHash hash;
+            bool fExists = FParseScriptHash(rgchSha, cchSha, &hash) && jscontext->FScriptExists(hash);
+            RedisModule_ReplyWithLongLong(ctx, fExists ? 1 : 0);
+        }
+    }
+    else if (!strcasecmp(szSubcommand, "flush"))
+    {
+        if (argc != 2)
+        {
+            RedisModule_WrongArity(ctx);
+            return REDISMODULE_ERR;
+        }
+        scriptcache_flush();
+        RedisModule_ReplyWithSimpleString(ctx, "OK");
+    }
+    else
+    {
+        RedisModule_ReplyWithError(ctx, "ERR unknown subcommand, try LOAD, EXISTS, or FLUSH");
+        return REDISMODULE_ERR;
+    }
+    return REDISMODULE_OK;
+}
+
+int run_startup_script(RedisModuleCtx *ctx, JSContext *jscontext, const char *szPath)
+{
+    KeyDBContext ctxsav(ctx);
+
+    std::ifstream file(szPath, std::ios::binary | std::ios::ate);
+    std::streamsize size = file.tellg();
+    if (size == -1)
+    {
+        RedisModule_Log(ctx, "warning", "startup script does not exist");
+        return REDISMODULE_ERR; // Failed to read file
+    }
+
+    file.seekg(0, std::ios::beg);
+
+    std::vector<char> buffer(size);
+    if (!file.read(buffer.data(), size))
+    {
+        RedisModule_Log(ctx, "warning", "failed to read startup script");
+        return REDISMODULE_ERR; // Failed to read file
+    }
+
+    v8::Locker locker(jscontext->getIsolate());
+    v8::HandleScope scope(jscontext->getIsolate());
+    try
+    {
+        jscontext->run(buffer.data(), buffer.size(), true /* don't cache */);
+    }
+    catch (std::string str)
+    {
+        RedisModule_Log(ctx, "warning", "%s", str.c_str());
+        return REDISMODULE_ERR;
+    }
+    return REDISMODULE_OK;
+}
+
+// Builds a context for the calling thread from the same scripts the main context was loaded with.  Returns
+//  nullptr if a script fails, a partially loaded context would be missing commands the main one has
+static JSContext *create_thread_context(RedisModuleCtx *ctx)
+{
+    JSContext *jscontext = new JSContext();
+    jscontext->initialize();
+
+    t_fInReplicaStartup = true;
+    t_fReplayingStartup = true;
+    t_cskippedReplayWrites = 0;
+    bool fFailed = false;
+    for (auto &strPath : g_vecstartupscripts)
+    {
+        if (run_startup_script(ctx, jscontext, strPath.c_str()) == REDISMODULE_ERR)
+        {
+            RedisModule_Log(ctx, "warning", "failed to run %s in a thread context", strPath.c_str());
+            fFailed = true;
+            break;
+        }
+    }
+    t_fReplayingStartup = false;
+    t_fInReplicaStartup = false;
+    if (fFailed)
+    {
+        delete jscontext;
+        return nullptr;
+    }
+    if (t_cskippedReplayWrites > 0)
+        RedisModule_Log(ctx, "verbose", "skipped %zu writes made by the startup scripts in a thread context, they only run in the main context", t_cskippedReplayWrites);
+    return jscontext;
+}
+
+// Thread contexts built by MODJS.RELOAD along with the new main context, so server threads pick one up
+//  after the swap instead of running the startup scripts on their event loop
+static std::mutex g_mutexPrebuilt;
+static std::vector<JSContext*> g_vecprebuilt;
+static uint64_t g_epochPrebuilt = 0;
+static std::atomic<size_t> g_cthreadContexts { 0 };     // threads that have their own context
+
+static JSContext *take_prebuilt_context(uint64_t epoch)
+{
+    std::unique_lock<std::mutex> lock(g_mutexPrebuilt);
+    if (g_epochPrebuilt != epoch || g_vecprebuilt.empty())
+        return nullptr;
+    JSContext *jscontext = g_vecprebuilt.back();
+    g_vecprebuilt.pop_back();
+    return jscontext;
+}
+
+// Returns the context to use on the calling thread.  With --isolate-per-thread each server thread gets
+//  its own isolate so JS execution is not serialized on a single v8::Locker
+static void retire_context(JSContext *jscontext);
+static void arm_retired_sweep(RedisModuleCtx *ctx);
+static thread_local bool t_fUseMainContext = false;     // building this thread's context failed, until the next reload
+
+JSContext *getJSContext()
+{
+    if (!g_fIsolatePerThread)
+        return g_jscontext.load();
+    uint64_t epoch = g_reloadEpoch.load();
+    if ((t_jscontext == nullptr && !t_fUseMainContext) || t_reloadEpoch != epoch)
+    {
+        // MODJS.RELOAD replaced the scripts since this thread's context was built
+        if (t_jscontext != nullptr)
+        {
+            retire_context(t_jscontext);
+            arm_retired_sweep(g_ctx);   // server threads run commands with the server lock held
+        }
+        else if (!t_fUseMainContext)
+            g_cthreadContexts.fetch_add(1, std::memory_order_relaxed);
+        t_jscontext = take_prebuilt_context(epoch);
+        if (t_jscontext == nullptr)
+            t_jscontext = create_thread_context(g_ctx);
+        t_fUseMainContext = (t_jscontext == nullptr);
+        if (t_fUseMainContext)
+            RedisModule_Log(g_ctx, "warning", "this thread runs JavaScript in the main context until the next MODJS.RELOAD");
+        t_reloadEpoch = epoch;
+    }
+    return t_fUseMainContext ? g_jscontext.load() : t_jscontext;
+}
+
+// Threads between reading a context pointer and pinning it.  Retired contexts are only freed when this is 0
+//  and then their own count is, so every access here is sequentially consistent
+static std::atomic<int> g_cpinning { 0 };
+
+ContextInUse::ContextInUse()
+{
+    g_cpinning.fetch_add(1);
+    m_jscontext = getJSContext();
+    m_jscontext->m_cinuse.fetch_add(1);
+    g_cpinning.fetch_sub(1);
+}
+
+ContextInUse::~ContextInUse()
+{
+    m_jscontext->m_cinuse.fetch_sub(1);
+}
+
+// Options are passed as --name or --name=value, returns false if the option is not recognized
+static bool FProcessModuleOption(RedisModuleCtx *ctx, const char *szOption)
+{
+    if (!strcmp(szOption, "--isolate-per-thread"))
+    {
+        g_fIsolatePerThread = true;
+        return true;
+    }
+
+    if (!strncmp(szOption, "--profile-dir=", 14))
+    {
+        profiler_set_directory(szOption + 14);
+        return true;
+    }
+
+    if (!strncmp(szOption, "--code-cache=", 13))
+    {
+        codecache_set_directory(szOption + 13);
+        return true;
+    }
+
+    if (!strncmp(szOption, "--max-old-space-size=", 21))
+    {
+        g_cbMaxOldSpace = (size_t)strtoull(szOption + 21, nullptr, 10) * 1024 * 1024;
+        return true;
+    }
+
+    if (!strncmp(szOption, "--max-young-space-size=", 23))
+    {
+        g_cbMaxYoungSpace = (size_t)strtoull(szOption + 23, nullptr, 10) * 1024 * 1024;
+        return true;
+    }
+
+    if (!strncmp(szOption, "--max-array-buffer-size=", 24))
+    {
+        g_cbMaxArrayBuffers = (size_t)strtoull(szOption + 24, nullptr, 10) * 1024 * 1024;
+        return true;
+    }
+
+    if (!strncmp(szOption, "--time-limit-ms=", 16))
+    {
+        watchdog_set_default_ms(strtoll(szOption + 16, nullptr, 10));
+        return true;
+    }
+
+    if (!strncmp(szOption, "--background-threads=", 21))
+    {
+        g_cbackgroundThreads = (size_t)strtoull(szOption + 21, nullptr, 10);
+        return true;
+    }
+
+    if (!strncmp(szOption, "--decoded-cache-size=", 21))
+    {
+        decodedcache_set_max_bytes((size_t)strtoull(szOption + 21, nullptr, 10) * 1024 * 1024);
+        return true;
+    }
+
+    if (!strncmp(szOption, "--promise-timeout-ms=", 21))
+    {
+        g_msPromiseTimeout = strtoll(szOption + 21, nullptr, 10);
+        return true;
+    }
+
+    if (!strncmp(szOption, "--timer-budget-ms=", 18))
+    {
+        g_usTimerBudget = strtoull(szOption + 18, nullptr, 10) * 1000;
+        return true;
+    }
+
+    if (!strncmp(szOption, "--latency-threshold-ms=", 23))
+    {
+        g_msLatencyThreshold = strtoll(szOption + 23, nullptr, 10);
+        return true;
+    }
+
+    if (!strncmp(szOption, "--script-cache-size=", 20))
+    {
+        scriptcache_set_max_entries((size_t)strtoull(szOption + 20, nullptr, 10));
+        return true;
+    }
+
+    RedisModule_Log(ctx, "warning", "unrecognized option: %s", szOption);
+    return false;
+}
+
+// Keyspace triggers registered with keydb.on().  Events caused by trigger code don't fire triggers, this
+//  keeps a trigger that writes to keys it watches from looping forever
+static thread_local bool t_fInTrigger = false;
+static int g_typesSubscribed = 0;
+static std::atomic<int> g_typesTrigger { 0 };  // types the current scripts watch, checked without entering a context
+
+class TriggerScope
+{
+public:
+    TriggerScope() { t_fInTrigger = true; }
+    ~TriggerScope() { t_fInTrigger = false; }
+};
+
+// Handlers without {batch: true} run inside the notification callback and are read only, see FBlockWrite
+class SyncTriggerScope
+{
+public:
+    SyncTriggerScope() { t_fInSyncTrigger = true; }
+    ~SyncTriggerScope() { t_fInSyncTrigger = false; }
+};
+
+static const struct
+{
+    const char *szName;
+    int type;
+} c_rgeventtypes[] = {
+    { "generic", REDISMODULE_NOTIFY_GENERIC },
+    { "string", REDISMODULE_NOTIFY_STRING },
+    { "list", REDISMODULE_NOTIFY_LIST },
+    { "set", REDISMODULE_NOTIFY_SET },
+    { "hash", REDISMODULE_NOTIFY_HASH },
+    { "zset", REDISMODULE_NOTIFY_ZSET },
+    { "expired", REDISMODULE_NOTIFY_EXPIRED },
+    { "evicted", REDISMODULE_NOTIFY_EVICTED },
+    { "stream", REDISMODULE_NOTIFY_STREAM },
+    { "all", REDISMODULE_NOTIFY_ALL },
+};
+
+static bool FParseEventType(const char *rgch, size_t cch, int *ptypes)
+{
+    for (auto &eventtype : c_rgeventtypes)
+    {
+        if (strlen(eventtype.szName) == cch && !strncasecmp(eventtype.szName, rgch, cch))
+        {
+            *ptypes |= eventtype.type;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Event types are given as a string such as "string hash" or an array such as ["string", "hash"]
+static bool FParseEventTypes(v8::Isolate *isolate, v8::Local<v8::Value> vtypes, int *ptypes)
+{
+    v8::Local<v8::Context> context = isolate->GetCurrentContext();
+    std::vector<std::string> vecnames;
+    if (vtypes->IsArray())
+    {
+        v8::Local<v8::Array> array = v8::Local<v8::Array>::Cast(vtypes);
+        uint32_t celem = array->Length();
+        for (uint32_t ielem = 0; ielem < celem; ++ielem)
+        {
+            v8::Local<v8::Value> velem;
+            if (!array->Get(context, ielem).ToLocal(&velem))
+                return false;
+            v8::String::Utf8Value utf8(isolate, velem);
+            vecnames.emplace_back(*utf8 != nullptr ? *utf8 : "");
+        }
+    }
+    else
+    {
+        v8::String::Utf8Value utf8(isolate, vtypes);
+        const char *sz = (*utf8 != nullptr) ? *utf8 : "";
+        while (*sz != '\0')
+        {
+            size_t cch = strcspn(sz, " ,");
+            if (cch > 0)
+                vecnames.emplace_back(sz, cch);
+            sz += cch;
+            sz += strspn(sz, " ,");
+        }
+    }
+
+    *ptypes = 0;
+    for (auto &strName : vecnames)
+    {
+        if (!FParseEventType(strName.data(), strName.size(), ptypes))
+        {
+            ThrowError(isolate, ("unknown event type: " + strName).c_str());
+            return false;
+        }
+    }
+    if (*ptypes == 0)
+    {
+        ThrowError(isolate, "no event types given");
+        return false;
+    }
+    return true;
+}
+
+// on(eventTypes, keyPattern, fn, options)
+void OnKeyspaceEventCallback(const v8::FunctionCallbackInfo<v8::Value>& args)
+{
+    v8::Isolate* isolate = args.GetIsolate();
+    v8::HandleScope scope(isolate);
+
+    JSContext *jscontext = (JSContext*)isolate->GetData(0);
+    bool fReplica = (jscontext != g_jscontext.load(std::memory_order_acquire));
+    if (!(fReplica ? t_fInReplicaStartup : g_fInStartup))
+    {
+        ThrowError(isolate, "Keyspace triggers may only be registered during startup");
+        return;
+    }
+
+    if (args.Length() < 3 || !args[2]->IsFunction())
+    {
+        ThrowError(isolate, "on() expects event types, a key pattern and a function");
+        return;
+    }
+
+    int types = 0;
+    if (!FParseEventTypes(isolate, args[0], &types))
+        return;
+    v8::String::Utf8Value utf8Pattern(isolate, args[1]);
+    if (*utf8Pattern == nullptr)
+        return;
+
+    bool fBatch = false;
+    if (args.Length() > 3 && args[3]->IsObject())
+    {
+        v8::Local<v8::Value> vbatch;
+        if (!v8::Local<v8::Object>::Cast(args[3])->Get(isolate->GetCurrentContext(), v8::String::NewFromUtf8(isolate, "batch").ToLocalChecked()).ToLocal(&vbatch))
+            return;
+        fBatch = vbatch->BooleanValue(isolate);
+    }
+
+    jscontext->addTrigger(types, std::string(*utf8Pattern, utf8Pattern.length()), fBatch, v8::Local<v8::Function>::Cast(args[2]));
+}
+
+// Describes why JS failed when there is no client to send the exception to
+static std::string CallbackErrorString(JSContext *jscontext, v8::TryCatch &trycatch)
+{
+    std::string strErr;
+    if (jscontext->FHeapLimitReached())
+        strErr = "script exceeded the JavaScript heap limit";
+    else if (!watchdog_consume_termination(jscontext->getWatchdog(), &strErr))
+    {
+        v8::String::Utf8Value utf8(jscontext->getIsolate(), trycatch.Exception());
+        strErr = (*utf8 != nullptr) ? *utf8 : "Unknown Error";
+    }
+    return strErr;
+}
+
+// Logs an exception from a callback the server invoked (a trigger or timer), there is no client to reply to
+static void LogCallbackError(RedisModuleCtx *ctx, JSContext *jscontext, v8::TryCatch &trycatch, const char *szWhat)
+{
+    RedisModule_Log(ctx, "warning", "%s failed: %s", szWhat, CallbackErrorString(jscontext, trycatch).c_str());
+}
+
+// Delivers batched events, each trigger gets an array of [key, event] pairs.  A context with a flush
+//  scheduled isn't freed, and the count keeps it alive once the flag is cleared below
+static void trigger_flush(RedisModuleCtx *ctx, void *data)
+{
+    JSContext *jscontext = (JSContext*)data;
+    jscontext->m_cinuse.fetch_add(1);
+    KeyDBContext ctxsav(ctx);
+    TriggerScope triggerscope;
+
+    v8::Isolate *isolate = jscontext->getIsolate();
+    v8::Locker locker(isolate);
+    v8::HandleScope scope(isolate);
+    v8::Local<v8::Context> context = jscontext->getCurrentContext();
+    v8::Context::Scope context_scope(context);
+    WatchdogScope watchdogscope(jscontext->getWatchdog(), watchdog_default_ms());
+
+    for (auto &sptrigger : jscontext->triggers())
+    {
+        if (!sptrigger->m_fBatch)
+            continue;
+
+        std::vector<std::string> vecevents;
+        {
+            std::unique_lock<std::mutex> lock(jscontext->m_mutexTriggers);
+            vecevents.swap(sptrigger->m_vecpending);
+            sptrigger->m_setpending.clear();
+            jscontext->m_fTriggerFlushScheduled = false;
+        }
+        if (vecevents.empty())
+            continue;
+
+        v8::HandleScope scopeTrigger(isolate);
+        v8::Local<v8::Array> events = v8::Array::New(isolate, (int)vecevents.size());
+        for (size_t ievent = 0; ievent < vecevents.size(); ++ievent)
+        {
+            const std::string &strEvent = vecevents[ievent];
+            size_t cchEvent = strlen(strEvent.c_str());
+            v8::Local<v8::Value> rgpair[2] = {
+                v8::String::NewFromUtf8(isolate, strEvent.data() + cchEvent + 1, v8::NewStringType::kNormal, (int)(strEvent.size() - cchEvent - 1)).ToLocalChecked(),
+                v8::String::NewFromUtf8(isolate, strEvent.data(), v8::NewStringType::kNormal, (int)cchEvent).ToLocalChecked(),
+            };
+            if (events->Set(context, (uint32_t)ievent, v8::Array::New(isolate, rgpair, 2)).IsNothing())
+                break;
+        }
+
+        v8::TryCatch trycatch(isolate);
+        v8::Local<v8::Value> argv[1] = { events };
+        if (sptrigger->m_fn.Get(isolate)->Call(context, context->Global(), 1, argv).IsEmpty())
+            LogCallbackError(ctx, jscontext, trycatch, "keyspace trigger");
+    }
+    jscontext->m_cinuse.fetch_sub(1);
+}
+
+// Drops the events a retired context hasn't delivered yet.  If the timer already fired the flush runs and
+//  the context is kept until it has
+static void cancel_trigger_flush(JSContext *jscontext)
+{
+    std::unique_lock<std::mutex> lock(jscontext->m_mutexTriggers);
+    if (!jscontext->m_fTriggerFlushScheduled)
+        return;
+    if (RedisModule_StopTimer(g_ctx, jscontext->m_idTriggerFlush, nullptr) == REDISMODULE_OK)
+    {
+        jscontext->m_fTriggerFlushScheduled = false;
+        for (auto &sptrigger : jscontext->triggers())
+        {
+            sptrigger->m_vecpending.clear();
+            sptrigger->m_setpending.clear();
+        }
+    }
+}
+
+static bool FTriggerFlushScheduled(JSContext *jscontext)
+{
+    std::unique_lock<std::mutex> lock(jscontext->m_mutexTriggers);
+    return jscontext->m_fTriggerFlushScheduled;
+}
+
+static int keyspace_notification(RedisModuleCtx *ctx, int type, const char *event, RedisModuleString *key)
+{
+    size_t cchKey;
+    const char *rgchKey = RedisModule_StringPtrLen(key, &cchKey);
+    if (decodedcache_active())
+        decodedcache_invalidate(RedisModule_GetSelectedDb(ctx), rgchKey, cchKey);
+
+    // Every context runs the same scripts, so check before getJSContext() builds one for this thread
+    if (t_fInTrigger || !(g_typesTrigger.load(std::memory_order_relaxed) & type))
+        return REDISMODULE_OK;
+    ContextInUse contextinuse;
+    JSContext *jscontext = contextinuse.get();
+    if (!(jscontext->triggerTypes() & type))
+        return REDISMODULE_OK;
+
+    ArenaScope arenascope;
+    SmallVector<KeyspaceTrigger*, 8> vecsync;
+    for (auto &sptrigger : jscontext->triggers())
+    {
+        KeyspaceTrigger *ptrigger = sptrigger.get();
+        if (!(ptrigger->m_types & type))
+            continue;
+        if (!ptrigger->m_fMatchAll && !glob_match(ptrigger->m_strPattern.data(), ptrigger->m_strPattern.size(), rgchKey, cchKey))
+            continue;
+
+        if (!ptrigger->m_fBatch)
+        {
+            vecsync.push_back(ptrigger);
+            continue;
+        }
+
+        std::string strEvent(event);
+        strEvent.push_back('\0');
+        strEvent.append(rgchKey, cchKey);
+        std::unique_lock<std::mutex> lock(jscontext->m_mutexTriggers);
+        if (ptrigger->m_setpending.insert(strEvent).second)
+            ptrigger->m_vecpending.push_back(std::move(strEvent));
+        if (!jscontext->m_fTriggerFlushScheduled)
+        {
+            jscontext->m_fTriggerFlushScheduled = true;
+            jscontext->m_idTriggerFlush = RedisModule_CreateTimer(ctx, 0, trigger_flush, jscontext);
+        }
+    }
+    if (vecsync.empty())
+        return REDISMODULE_OK;
+
+    KeyDBContext ctxsav(ctx);
+    TriggerScope triggerscope;
+    SyncTriggerScope synctriggerscope;
+    v8::Isolate *isolate = jscontext->getIsolate();
+    v8::Locker locker(isolate);
+    v8::HandleScope scope(isolate);
+    v8::Local<v8::Context> context = jscontext->getCurrentContext();
+    v8::Context::Scope context_scope(context);
+    WatchdogScope watchdogscope(jscontext->getWatchdog(), watchdog_default_ms());
+
+    v8::Local<v8::Value> argv[2] = {
+        v8::String::NewFromUtf8(isolate, rgchKey, v8::NewStringType::kNormal, (int)cchKey).ToLocalChecked(),
+        v8::String::NewFromUtf8(isolate, event).ToLocalChecked(),
+    };
+    for (KeyspaceTrigger *ptrigger : vecsync)
+    {
+        // One trigger failing doesn't stop the others seeing the event
+        v8::TryCatch trycatch(isolate);
+        if (ptrigger->m_fn.Get(isolate)->Call(context, context->Global(), 2, argv).IsEmpty())
+            LogCallbackError(ctx, jscontext, trycatch, "keyspace trigger");
+    }
+    return REDISMODULE_OK;
+}
+
+// Subscribes to any of the event types that we aren't already subscribed to
+static void subscribe_keyspace_types(RedisModuleCtx *ctx, int types)
+{
+    int typesNew = types & ~g_typesSubscribed;
+    if (typesNew == 0)
+        return;
+    if (RedisModule_SubscribeToKeyspaceEvents(ctx, typesNew, keyspace_notification) == REDISMODULE_ERR)
+    {
+        RedisModule_Log(ctx, "warning", "failed to subscribe to keyspace events");
+        return;
+    }
+    g_typesSubscribed |= typesNew;
+}
+
+// Subscribes to the event types the current scripts' triggers watch
+static void update_keyspace_subscriptions(RedisModuleCtx *ctx)
+{
+    int types = g_jscontext.load(std::memory_order_acquire)->triggerTypes();
+    g_typesTrigger.store(types, std::memory_order_relaxed);
+    subscribe_keyspace_types(ctx, types);
+}
+
+/*
+ * keydb.cachedGet().  Keeps the decoded form of string keys so hot reads skip the decoder.  Entries are
+ *  invalidated by keyspace events, and wholesale by the server events for changes that have none.
+ */
+static std::once_flag g_onceCacheSubscribe;
+
+static void cache_server_event(RedisModuleCtx *, RedisModuleEvent, uint64_t, void *)
+{
+    decodedcache_invalidate_all();
+}
+
+static void cache_command_filter(RedisModuleCommandFilterCtx *filter)
+{
+    // SWAPDB moves every key without an event for any of them
+    size_t cch;
+    const char *rgch = RedisModule_StringPtrLen(RedisModule_CommandFilterArgGet(filter, 0), &cch);
+    if (cch == 6 && !strncasecmp(rgch, "swapdb", 6))
+        decodedcache_invalidate_all();
+}
+
+static void subscribe_cache_events(RedisModuleCtx *ctx)
+{
+    subscribe_keyspace_types(ctx, REDISMODULE_NOTIFY_ALL);
+    if (RedisModule_SubscribeToServerEvent(ctx, RedisModuleEvent_FlushDB, cache_server_event) == REDISMODULE_ERR
+        || RedisModule_SubscribeToServerEvent(ctx, RedisModuleEvent_Loading, cache_server_event) == REDISMODULE_ERR
+        || RedisModule_RegisterCommandFilter(ctx, cache_command_filter, 0) == nullptr)
+        RedisModule_Log(ctx, "warning", "failed to subscribe to the events needed by cachedGet()");
+}
+
+// cachedGet(key, decoder, fBuffer) returns decoder(value) for a string key, or null if it doesn't exist
+void CachedGetCallback(const v8::FunctionCallbackInfo<v8::Value>& args)
+{
+    v8::Isolate* isolate = args.GetIsolate();
+    v8::HandleScope scope(isolate);
+    v8::Local<v8::Context> context = isolate->GetCurrentContext();
+
+    if (args.Length() < 2 || !args[1]->IsFunction())
+    {
+        ThrowError(isolate, "cachedGet() expects a key and a decoder function");
+        return;
+    }
+    std::call_once(g_onceCacheSubscribe, []{ subscribe_cache_events(g_ctx); });
+
+    JSContext *jscontext = (JSContext*)isolate->GetData(0);
+    DecodedCache &cache = jscontext->decodedCache();
+    ArenaScope arenascope;
+    const char *rgchKey;
+    size_t cchKey;
+    if (!FGetBufferData(args[0], &rgchKey, &cchKey))
+        rgchKey = ValueToUtf8(isolate, args[0], &cchKey);
+    int db = RedisModule_GetSelectedDb(g_ctx);
+
+    // A logically expired key is only deleted when something touches it, so the cache checks the time itself
+    v8::Local<v8::Value> value = cache.lookup(isolate, db, rgchKey, cchKey, RedisModule_Milliseconds());
+    if (!value.IsEmpty())
+    {
+        args.GetReturnValue().Set(value);
+        return;
+    }
+
+    uint64_t seq = decodedcache_seq();
+    v8::Local<v8::Value> raw;
+    size_t cchValue;
+    long long msExpire = 0;
+    {
+        KeyHandle key(isolate, args[0], REDISMODULE_READ);
+        if (!key.FCheckType(isolate, REDISMODULE_KEYTYPE_STRING))
+            return;
+        if (key.type() == REDISMODULE_KEYTYPE_EMPTY)
+        {
+            args.GetReturnValue().SetNull();
+            return;
+        }
+        mstime_t msTtl = RedisModule_GetExpire(key.key());
+        if (msTtl != REDISMODULE_NO_EXPIRE)
+            msExpire = RedisModule_Milliseconds() + msTtl;
+        const char *rgchValue = RedisModule_StringDMA(key.key(), &cchValue, REDISMODULE_READ);
+        if (args.Length() > 2 && args[2]->BooleanValue(isolate))
+            raw = NewUint8Array(isolate, rgchValue, cchValue);
+        else
+            raw = v8::String::NewFromUtf8(isolate, rgchValue, v8::NewStringType::kNormal, cchValue).ToLocalChecked();
+    }
+
+    // The key is closed first, the decoder is free to make calls of its own
+    if (!v8::Local<v8::Function>::Cast(args[1])->Call(context, context->Global(), 1, &raw).ToLocal(&value))
+        return;
+    cache.insert(isolate, db, rgchKey, cchKey, value, cchValue, msExpire, seq);
+    args.GetReturnValue().Set(value);
+}
+
+/*
+ * setTimeout() and setInterval().  Script timers are kept in our own queue ordered by due time and a single
+ *  server timer is armed for the earliest one, so each firing is one event loop tick in which we run due
+ *  callbacks until the tick's budget is spent.  Whatever is left over runs on the next tick.
+ */
+struct JSTimer
+{
+    uint64_t id;
+    JSContext *jscontext;
+    v8::Global<v8::Function> fn;
+    uint64_t msDelay;
+    uint64_t msDue = 0;
+    bool fRepeat;
+    bool fRunning = false;
+    bool fCleared = false;  // cleared by its own callback, freed once the callback returns
+};
+
+static std::mutex g_mutexTimers;
+static std::set<std::pair<uint64_t, uint64_t>> g_settimersDue;     // (msDue, id)
+static std::unordered_map<uint64_t, JSTimer*> g_maptimers;
+static std::vector<JSTimer*> g_vectimersDeferred;   // created by a reload, armed when its context is swapped in
+static uint64_t g_idTimerNext = 1;
+static RedisModuleTimerID g_tidDispatch = 0;
+static bool g_fTimerArmed = false;
+static uint64_t g_msDispatchDue = 0;
+static bool g_fDispatching = false;
+
+static uint64_t timer_now_ms()
+{
+    return stats_now_us() / 1000;
+}
+
+// Timers hold handles into their isolate so they are freed with it locked
+static void free_timer(JSTimer *ptimer)
+{
+    v8::Locker locker(ptimer->jscontext->getIsolate());
+    delete ptimer;
+}
+
+static void timer_dispatch(RedisModuleCtx *ctx, void *);
+
+// Makes sure the server timer fires for the earliest due script timer, call with g_mutexTimers held
+static void arm_dispatch_locked(RedisModuleCtx *ctx)
+{
+    if (g_fDispatching)
+        return; // re-armed when the current tick finishes
+    if (g_settimersDue.empty())
+    {
+        if (g_fTimerArmed)
+            RedisModule_StopTimer(ctx, g_tidDispatch, nullptr);
+        g_fTimerArmed = false;
+        return;
+    }
+
+    uint64_t msDue = g_settimersDue.begin()->first;
+    if (g_fTimerArmed)
+    {
+        if (g_msDispatchDue <= msDue)
+            return;
+        RedisModule_StopTimer(ctx, g_tidDispatch, nullptr);
+    }
+    uint64_t msNow = timer_now_ms();
+    g_tidDispatch = RedisModule_CreateTimer(ctx, (mstime_t)(msDue > msNow ? msDue - msNow : 0), timer_dispatch, nullptr);
+    g_msDispatchDue = msDue;
+    g_fTimerArmed = true;
+}
+
+static void run_timer(RedisModuleCtx *ctx, JSTimer *ptimer)
+{
+    JSContext *jscontext = ptimer->jscontext;
+    v8::Isolate *isolate = jscontext->getIsolate();
+    static CommandStats *s_pstats = stats_for_command("timers");
+    ScriptTimer timer(s_pstats, "modjs-timer");
+
+    v8::Locker locker(isolate);
+    v8::HandleScope scope(isolate);
+    v8::Local<v8::Context> context = jscontext->getCurrentContext();
+    v8::Context::Scope context_scope(context);
+    ProfilerCommandScope profilerscope(isolate, s_pstats->strName.c_str());
+    WatchdogScope watchdogscope(jscontext->getWatchdog(), watchdog_default_ms());
+
+    v8::TryCatch trycatch(isolate);
+    if (ptimer->fn.Get(isolate)->Call(context, context->Global(), 0, nullptr).IsEmpty())
+    {
+        timer.error();
+        LogCallbackError(ctx, jscontext, trycatch, "timer callback");
+    }
+}
+
+static void timer_dispatch(RedisModuleCtx *ctx, void *)
+{
+    KeyDBContext ctxsav(ctx);
+    uint64_t usStart = stats_now_us();
+    std::unique_lock<std::mutex> lock(g_mutexTimers);
+    g_fTimerArmed = false;
+    g_fDispatching = true;
+
+    while (!g_settimersDue.empty() && g_settimersDue.begin()->first <= timer_now_ms())
+    {
+        if (stats_now_us() - usStart >= g_usTimerBudget)
+            break;  // the rest run next tick so clients aren't starved
+
+        uint64_t id = g_settimersDue.begin()->second;
+        g_settimersDue.erase(g_settimersDue.begin());
+        JSTimer *ptimer = g_maptimers[id];
+        ptimer->fRunning = true;
+
+        // The callback may set or clear timers itself
+        lock.unlock();
+        run_timer(ctx, ptimer);
+        lock.lock();
+
+        ptimer->fRunning = false;
+        if (ptimer->fRepeat && !ptimer->fCleared)
+        {
+            ptimer->msDue = timer_now_ms() + ptimer->msDelay;
+            g_settimersDue.emplace(ptimer->msDue, ptimer->id);
+            continue;
+        }
+        g_maptimers.erase(ptimer->id);
+        lock.unlock();
+        free_timer(ptimer);
+        lock.lock();
+    }
+
+    g_fDispatching = false;
+    arm_dispatch_locked(ctx);
+}
+
+// setTimer(fn, delay, repeat) returns the timer's id
+void SetTimerCallback(const v8::FunctionCallbackInfo<v8::Value>& args)
+{
+    v8::Isolate* isolate = args.GetIsolate();
+    v8::HandleScope scope(isolate);
+
+    if (args.Length() < 3 || !args[0]->IsFunction())
+    {
+        ThrowError(isolate, "setTimer() expects a function, a delay and whether to repeat");
+        return;
+    }
+    JSContext *jscontext = (JSContext*)isolate->GetData(0);
+    if (t_fReplayingStartup)
+    {
+        // Startup timers already run in the main context, a thread's copy of the scripts doesn't add more
+        args.GetReturnValue().Set(v8::Number::New(isolate, 0));
+        return;
+    }
+    if (t_fWorkerThread)
+    {
+        ThrowError(isolate, "Timers can't be set from a background function");
+        return;
+    }
+
+    double dblDelay = args[1]->NumberValue(isolate->GetCurrentContext()).FromMaybe(0);
+    bool fRepeat = args[2]->BooleanValue(isolate);
+    if (!(dblDelay >= 0))
+        dblDelay = 0;   // NaN and negative delays run as soon as possible
+    if (fRepeat && dblDelay < 1)
+        dblDelay = 1;
+
+    JSTimer *ptimer = new JSTimer();
+    ptimer->jscontext = jscontext;
+    ptimer->fn.Reset(isolate, v8::Local<v8::Function>::Cast(args[0]));
+    ptimer->msDelay = (uint64_t)dblDelay;
+    ptimer->fRepeat = fRepeat;
+
+    std::unique_lock<std::mutex> lock(g_mutexTimers);
+    ptimer->id = g_idTimerNext++;
+    g_maptimers.emplace(ptimer->id, ptimer);
+    if (t_fBackgroundThread)
+    {
+        // A reload is building this context, its timers mustn't fire until it replaces the current one
+        g_vectimersDeferred.push_back(ptimer);
+    }
+    else
+    {
+        ptimer->msDue = timer_now_ms() + ptimer->msDelay;
+        g_settimersDue.emplace(ptimer->msDue, ptimer->id);
+        arm_dispatch_locked(g_ctx);
+    }
+    args.GetReturnValue().Set(v8::Number::New(isolate, (double)ptimer->id));
+}
+
+// clearTimer(id), ids that are unknown or already fired are ignored like they are in the browser
+void ClearTimerCallback(const v8::FunctionCallbackInfo<v8::Value>& args)
+{
+    v8::Isolate* isolate = args.GetIsolate();
+    if (args.Length() < 1 || !args[0]->IsNumber())
+        return;
+    uint64_t id = (uint64_t)args[0]->NumberValue(isolate->GetCurrentContext()).FromMaybe(0);
+    JSContext *jscontext = (JSContext*)isolate->GetData(0);
+
+    JSTimer *ptimer = nullptr;
+    {
+        std::unique_lock<std::mutex> lock(g_mutexTimers);
+        auto itr = g_maptimers.find(id);
+        if (itr == g_maptimers.end() || itr->second->jscontext != jscontext)
+            return;
+        if (itr->second->fRunning)
+        {
+            itr->second->fCleared = true;
+            return;
+        }
+        ptimer = itr->second;
+        g_maptimers.erase(itr);
+        g_settimersDue.erase(std::make_pair(ptimer->msDue, ptimer->id));
+        g_vectimersDeferred.erase(std::remove(g_vectimersDeferred.begin(), g_vectimersDeferred.end(), ptimer), g_vectimersDeferred.end());
+        // The server timer is left armed, if nothing is due when it fires it just re-arms for the next one
+    }
+    delete ptimer;  // we already hold this isolate's lock
+}
+
+// Drops every timer belonging to a context that is being retired or discarded
+static void clear_context_timers(JSContext *jscontext)
+{
+    std::vector<JSTimer*> vecfree;
+    {
+        std::unique_lock<std::mutex> lock(g_mutexTimers);
+        auto itr = g_maptimers.begin();
+        while (itr != g_maptimers.end())
+        {
+            JSTimer *ptimer = itr->second;
+            if (ptimer->jscontext != jscontext)
+            {
+                ++itr;
+                continue;
+            }
+            if (ptimer->fRunning)
+            {
+                ptimer->fCleared = true;
+                ++itr;
+                continue;
+            }
+            g_settimersDue.erase(std::make_pair(ptimer->msDue, ptimer->id));
+            vecfree.push_back(ptimer);
+            itr = g_maptimers.erase(itr);
+        }
+        g_vectimersDeferred.erase(std::remove_if(g_vectimersDeferred.begin(), g_vectimersDeferred.end(), [jscontext](JSTimer *ptimer) {
+            return ptimer->jscontext == jscontext;
+        }), g_vectimersDeferred.end());
+    }
+    for (JSTimer *ptimer : vecfree)
+        free_timer(ptimer);
+}
+
+// Starts the timers a reload's scripts created, their delays count from the swap
+static void arm_deferred_timers(RedisModuleCtx *ctx, JSContext *jscontext)
+{
+    std::unique_lock<std::mutex> lock(g_mutexTimers);
+    uint64_t msNow = timer_now_ms();
+    auto itr = g_vectimersDeferred.begin();
+    while (itr != g_vectimersDeferred.end())
+    {
+        JSTimer *ptimer = *itr;
+        if (ptimer->jscontext != jscontext)
+        {
+            ++itr;
+            continue;
+        }
+        ptimer->msDue = msNow + ptimer->msDelay;
+        g_settimersDue.emplace(ptimer->msDue, ptimer->id);
+        itr = g_vectimersDeferred.erase(itr);
+    }
+    arm_dispatch_locked(ctx);
+}
+
+static size_t timer_count()
+{
+    std::unique_lock<std::mutex> lock(g_mutexTimers);
+    return g_maptimers.size();
+}
+
+/*
+ * keydb.runInBackground().  A pool of worker threads each with their own isolate running the startup scripts
+ *  executes CPU heavy functions off the event loop.  Arguments and results cross isolates with the structured
+ *  clone format.  The Promise is settled with the server lock held, so code after an await on it sees the
+ *  keyspace atomically just like a command does.
+ */
+struct BackgroundJob
+{
+    JSContext *jscontext;   // where runInBackground() was called, owns the resolver
+    v8::Global<v8::Promise::Resolver> resolver;
+    std::string strFn;
+    SerializedValue data;
+    SerializedValue result;
+    std::string strErr;
+};
+
+static std::mutex g_mutexJobs;
+static std::condition_variable g_cvJobs;
+static std::deque<BackgroundJob*> g_dequejobs;
+static std::unordered_map<JSContext*, size_t> g_mapjobcounts;  // jobs in flight per calling context
+static std::once_flag g_onceWorkers;
+static std::atomic<uint64_t> g_cjobsCompleted { 0 };
+
+static bool FContextHasBackgroundJobs(JSContext *jscontext)
+{
+    std::unique_lock<std::mutex> lock(g_mutexJobs);
+    return g_mapjobcounts.count(jscontext) != 0;
+}
+
+// Runs the job's function in this worker's isolate, leaving either a result or an error in the job
+static void run_background_job(JSContext *jscontext, BackgroundJob *job)
+{
+    v8::Isolate *isolate = jscontext->getIsolate();
+    v8::Locker locker(isolate);
+    v8::HandleScope scope(isolate);
+    v8::Local<v8::Context> context = jscontext->getCurrentContext();
+    v8::Context::Scope context_scope(context);
+    WatchdogScope watchdogscope(jscontext->getWatchdog(), watchdog_default_ms());
+    v8::TryCatch trycatch(isolate);
+
+    v8::Local<v8::Value> vfn;
+    if (!context->Global()->Get(context, v8::String::NewFromUtf8(isolate, job->strFn.c_str()).ToLocalChecked()).ToLocal(&vfn) || !vfn->IsFunction())
+    {
+        job->strErr = "runInBackground: " + job->strFn + " is not a function defined by the startup scripts";
+        return;
+    }
+
+    v8::Local<v8::Value> data;
+    v8::Local<v8::Value> result;
+    if (deserialize_value(isolate, context, job->data.data(), job->data.size()).ToLocal(&data)
+        && v8::Local<v8::Function>::Cast(vfn)->Call(context, context->Global(), 1, &data).ToLocal(&result))
+    {
+        if (result->IsPromise())
+        {
+            // Nothing else will run in this isolate until the next job, so the Promise has to settle now
+            isolate->PerformMicrotaskCheckpoint();
+            v8::Local<v8::Promise> promise = v8::Local<v8::Promise>::Cast(result);
+            if (promise->State() == v8::Promise::kPending)
+            {
+                job->strErr = "runInBackground: " + job->strFn + " returned a Promise that did not settle";
+                return;
+            }
+            if (promise->State() == v8::Promise::kRejected)
+                isolate->ThrowException(promise->Result());
+            result = promise->Result();
+        }
+        if (!trycatch.HasCaught() && serialize_value(isolate, context, result, &job->result))
+            return;
+    }
+
+    job->strErr = CallbackErrorString(jscontext, trycatch);
+}
+
+// Hands the result back to the calling isolate, call with the server lock held
+static void settle_background_job(RedisModuleCtx *ctx, BackgroundJob *job)
+{
+    KeyDBContext ctxsav(ctx);
+    v8::Isolate *isolate = job->jscontext->getIsolate();
+    v8::Locker locker(isolate);
+    v8::HandleScope scope(isolate);
+    v8::Local<v8::Context> context = job->jscontext->getCurrentContext();
+    v8::Context::Scope context_scope(context);
+    WatchdogScope watchdogscope(job->jscontext->getWatchdog(), watchdog_default_ms());
+    v8::TryCatch trycatch(isolate);
+
+    v8::Local<v8::Promise::Resolver> resolver = job->resolver.Get(isolate);
+    v8::Local<v8::Value> result;
+    bool fSettled;
+    if (job->strErr.empty() && deserialize_value(isolate, context, job->result.data(), job->result.size()).ToLocal(&result))
+        fSettled = resolver->Resolve(context, result).FromMaybe(false);
+    else if (!job->strErr.empty())
+        fSettled = resolver->Reject(context, v8::Exception::Error(v8::String::NewFromUtf8(isolate, job->strErr.c_str()).ToLocalChecked())).FromMaybe(false);
+    else
+    {
+        v8::Local<v8::Value> exception = trycatch.Exception();
+        trycatch.Reset();
+        fSettled = resolver->Reject(context, exception).FromMaybe(false);
+    }
+    if (fSettled)
+        isolate->PerformMicrotaskCheckpoint();
+    if (trycatch.HasCaught())
+        LogCallbackError(ctx, job->jscontext, trycatch, "runInBackground continuation");
+
+    job->resolver.Reset();
+}
+
+static void background_worker_main()
+{
+    RedisModuleCtx *ctx = RedisModule_GetThreadSafeContext(nullptr);
+    KeyDBContext ctxsav(ctx);
+    t_fWorkerThread = true;
+    t_fBackgroundThread = true;     // calls made by the functions take the server lock themselves
+
+    JSContext *jscontext = nullptr;
+    uint64_t epoch = 0;
+    for (;;)
+    {
+        BackgroundJob *job;
+        {
+            std::unique_lock<std::mutex> lock(g_mutexJobs);
+            g_cvJobs.wait(lock, []{ return !g_dequejobs.empty(); });
+            job = g_dequejobs.front();
+            g_dequejobs.pop_front();
+        }
+
+        // Rebuilt after MODJS.RELOAD so workers see the same functions as the main context
+        if (jscontext == nullptr || epoch != g_reloadEpoch.load(std::memory_order_acquire))
+        {
+            if (jscontext != nullptr)
+                retire_context(jscontext);  // it may still own custom type values
+            epoch = g_reloadEpoch.load(std::memory_order_acquire);
+            jscontext = create_thread_context(ctx);
+        }
+
+        // A worker can't borrow the main context, so without its own the job fails and the next one retries
+        if (jscontext != nullptr)
+            run_background_job(jscontext, job);
+        else
+            job->strErr = "runInBackground: the worker failed to run the startup scripts, see the server log for details";
+
+        // Continuations are ordinary code in the calling context, running under the lock we already hold
+        RedisModule_ThreadSafeContextLock(ctx);
+        t_fWorkerThread = false;
+        t_fBackgroundThread = false;
+        arm_retired_sweep(ctx);     // for the context this worker retired after a reload
+        settle_background_job(ctx, job);
+        t_fBackgroundThread = true;
+        t_fWorkerThread = true;
+        RedisModule_ThreadSafeContextUnlock(ctx);
+
+        {
+            std::unique_lock<std::mutex> lock(g_mutexJobs);
+            auto itr = g_mapjobcounts.find(job->jscontext);
+            if (--itr->second == 0)
+                g_mapjobcounts.erase(itr);
+        }
+        g_cjobsCompleted.fetch_add(1, std::memory_order_relaxed);
+        delete job;
+    }
+}
+
+// runInBackground(fnName, data) returns a Promise for the function's result
+void RunInBackgroundCallback(const v8::FunctionCallbackInfo<v8::Value>& args)
+{
+    v8::Isolate* isolate = args.GetIsolate();
+    v8::HandleScope scope(isolate);
+    v8::Local<v8::Context> context = isolate->GetCurrentContext();
+
+    if (t_fWorkerThread)
+    {
+        ThrowError(isolate, "runInBackground() can't be called from a background function");
+        return;
+    }
+    if (g_cbackgroundThreads == 0)
+    {
+        ThrowError(isolate, "runInBackground() is disabled, see --background-threads");
+        return;
+    }
+    if (args.Length() < 1)
+    {
+        ThrowError(isolate, "runInBackground() expects the name of a function");
+        return;
     }
 
     v8::Local<v8::Value> vfn = args[0];
+    if (vfn->IsFunction())
+        vfn = v8::Local<v8::Function>::Cast(vfn)->GetName();
+    v8::String::Utf8Value utf8Fn(isolate, vfn);
+    if (*utf8Fn == nullptr || utf8Fn.length() == 0)
+    {
+        ThrowError(isolate, "runInBackground() expects the name of a function");
+        return;
+    }
+
+    std::unique_ptr<BackgroundJob> job(new BackgroundJob());
+    job->jscontext = (JSContext*)isolate->GetData(0);
+    job->strFn.assign(*utf8Fn, utf8Fn.length());
+    v8::Local<v8::Value> data = (args.Length() > 1) ? args[1] : v8::Undefined(isolate).As<v8::Value>();
+    if (!serialize_value(isolate, context, data, &job->data))
+        return;
+
+    v8::Local<v8::Promise::Resolver> resolver;
+    if (!v8::Promise::Resolver::New(context).ToLocal(&resolver))
+        return;
+    job->resolver.Reset(isolate, resolver);
+
+    std::call_once(g_onceWorkers, []{
+        for (size_t ithread = 0; ithread < g_cbackgroundThreads; ++ithread)
+            std::thread(background_worker_main).detach();
+    });
+    {
+        std::unique_lock<std::mutex> lock(g_mutexJobs);
+        ++g_mapjobcounts[job->jscontext];
+        g_dequejobs.push_back(job.release());
+    }
+    g_cvJobs.notify_one();
+    args.GetReturnValue().Set(resolver->GetPromise());
+}
+
+static size_t background_queue_length()
+{
+    std::unique_lock<std::mutex> lock(g_mutexJobs);
+    return g_dequejobs.size();
+}
+
+/*
+ * keydb.createType().  Keys of these types hold a live JS value referenced from a native handle, so commands
+ *  change it in place instead of parsing and re-serializing it every time.  Values are persisted in the
+ *  structured clone format after the type's optional rdbSave hook, and rebuilt by its rdbLoad hook.
+ *  Serializing happens when a value is set or replicated, RDB saves and AOF rewrites run in a forked child
+ *  where V8 can't be used so they write the bytes kept from then.
+ */
+struct JSDataType
+{
+    std::string strName;
+    RedisModuleType *mt;
+};
+static const size_t ctypesMax = 16;
+static std::vector<JSDataType> g_vectypes;  // only added to while loading, indexed by type id
+
+struct JSTypeValue
+{
+    size_t itype;
+    JSContext *jscontext = nullptr;     // the isolate the value lives in
+    v8::Global<v8::Value> value;
+    SerializedValue svSaved;            // what is persisted, as of the last set() or replicate()
+    size_t cbHookUsage = 0;             // from the memUsage hook, as of the same
+};
+
+// Values per owning context, a context is kept alive until its values have moved to another or been freed
+static std::mutex g_mutexTypeValues;
+static std::unordered_map<JSContext*, size_t> g_mapvaluecounts;
+
+static void set_value_owner(JSTypeValue *pvalue, JSContext *jscontext)
+{
+    std::unique_lock<std::mutex> lock(g_mutexTypeValues);
+    if (pvalue->jscontext != nullptr)
+    {
+        auto itr = g_mapvaluecounts.find(pvalue->jscontext);
+        if (--itr->second == 0)
+            g_mapvaluecounts.erase(itr);
+    }
+    pvalue->jscontext = jscontext;
+    if (jscontext != nullptr)
+        ++g_mapvaluecounts[jscontext];
+}
+
+static bool FContextHasTypeValues(JSContext *jscontext)
+{
+    std::unique_lock<std::mutex> lock(g_mutexTypeValues);
+    return g_mapvaluecounts.count(jscontext) != 0;
+}
+
+// Calls the type's hook if the context's scripts defined it, *presult is left empty if they didn't.
+//  Returns false with an exception pending if the hook threw
+static bool FCallTypeHook(JSContext *jscontext, size_t itype, const char *szHook, int argc, v8::Local<v8::Value> *argv, v8::Local<v8::Value> *presult)
+{
+    v8::Isolate *isolate = jscontext->getIsolate();
+    v8::Local<v8::Context> context = jscontext->getCurrentContext();
+    *presult = v8::Local<v8::Value>();
+    v8::Local<v8::Object> hooks = jscontext->typeHooks(itype);
+    if (hooks.IsEmpty())
+        return true;
+
+    v8::Local<v8::Value> vfn;
+    if (!hooks->Get(context, v8::String::NewFromUtf8(isolate, szHook).ToLocalChecked()).ToLocal(&vfn))
+        return false;
     if (!vfn->IsFunction())
+        return true;
+    return v8::Local<v8::Function>::Cast(vfn)->Call(context, hooks, argc, argv).ToLocal(presult);
+}
+
+// Asks the type's memUsage hook for the value's size, call with the owning isolate locked.  MEMORY USAGE
+//  reports what this returned when the value was last saved, so the server never waits on an isolate
+static size_t type_hook_usage(JSContext *jscontext, size_t itype, v8::Local<v8::Value> value)
+{
+    v8::Isolate *isolate = jscontext->getIsolate();
+    v8::TryCatch trycatch(isolate);
+    v8::Local<v8::Value> usage;
+    if (!FCallTypeHook(jscontext, itype, "memUsage", 1, &value, &usage) || usage.IsEmpty())
+        return 0;
+    return (size_t)std::max(0.0, usage->NumberValue(jscontext->getCurrentContext()).FromMaybe(0));
+}
+
+// The bytes persisted for a value, call with the owning isolate locked
+static bool FSerializeTypeValue(JSTypeValue *pvalue, SerializedValue *psv, std::string *pstrErr)
+{
+    JSContext *jscontext = pvalue->jscontext;
+    v8::Isolate *isolate = jscontext->getIsolate();
+    v8::HandleScope scope(isolate);
+    v8::Local<v8::Context> context = jscontext->getCurrentContext();
+    v8::Context::Scope context_scope(context);
+    WatchdogScope watchdogscope(jscontext->getWatchdog(), watchdog_default_ms());
+    v8::TryCatch trycatch(isolate);
+
+    v8::Local<v8::Value> value = pvalue->value.Get(isolate);
+    v8::Local<v8::Value> saved;
+    if (FCallTypeHook(jscontext, pvalue->itype, "rdbSave", 1, &value, &saved)
+        && serialize_value(isolate, context, saved.IsEmpty() ? value : saved, psv))
+    {
+        pvalue->cbHookUsage = type_hook_usage(jscontext, pvalue->itype, value);
+        return true;
+    }
+    *pstrErr = CallbackErrorString(jscontext, trycatch);
+    return false;
+}
+
+// Rebuilds a value from persisted bytes in the given context, the value takes the bytes if it succeeds
+static JSTypeValue *load_type_value(JSContext *jscontext, size_t itype, SerializedValue &sv, std::string *pstrErr)
+{
+    v8::Isolate *isolate = jscontext->getIsolate();
+    v8::Locker locker(isolate);
+    v8::HandleScope scope(isolate);
+    v8::Local<v8::Context> context = jscontext->getCurrentContext();
+    v8::Context::Scope context_scope(context);
+    WatchdogScope watchdogscope(jscontext->getWatchdog(), watchdog_default_ms());
+    v8::TryCatch trycatch(isolate);
+
+    v8::Local<v8::Value> data, value;
+    if (!deserialize_value(isolate, context, sv.data(), sv.size()).ToLocal(&data)
+        || !FCallTypeHook(jscontext, itype, "rdbLoad", 1, &data, &value))
+    {
+        *pstrErr = CallbackErrorString(jscontext, trycatch);
+        return nullptr;
+    }
+
+    JSTypeValue *pvalue = new JSTypeValue();
+    pvalue->itype = itype;
+    pvalue->value.Reset(isolate, value.IsEmpty() ? data : value);
+    pvalue->svSaved = std::move(sv);
+    pvalue->cbHookUsage = type_hook_usage(jscontext, itype, pvalue->value.Get(isolate));
+    set_value_owner(pvalue, jscontext);
+    return pvalue;
+}
+
+// Moves a value into the calling isolate, used for values made by a replaced or another thread's context
+static bool FAdoptTypeValue(JSTypeValue *pvalue, JSContext *jscontext)
+{
+    v8::Isolate *isolate = jscontext->getIsolate();
+    SerializedValue sv;
+    {
+        JSContext *jscontextOwner = pvalue->jscontext;
+        v8::Isolate *isolateOwner = jscontextOwner->getIsolate();
+        v8::Locker locker(isolateOwner);
+        v8::Isolate::Scope isolate_scope(isolateOwner);
+        v8::HandleScope scope(isolateOwner);
+        v8::Local<v8::Context> contextOwner = jscontextOwner->getCurrentContext();
+        v8::Context::Scope context_scope(contextOwner);
+        v8::TryCatch trycatch(isolateOwner);
+        if (!serialize_value(isolateOwner, contextOwner, pvalue->value.Get(isolateOwner), &sv))
+        {
+            ThrowError(isolate, ("failed to move value to this isolate: " + CallbackErrorString(jscontextOwner, trycatch)).c_str());
+            return false;
+        }
+        pvalue->value.Reset();
+    }
+
+    v8::Local<v8::Value> value;
+    if (!deserialize_value(isolate, isolate->GetCurrentContext(), sv.data(), sv.size()).ToLocal(&value))
+        return false;
+    pvalue->value.Reset(isolate, value);
+    set_value_owner(pvalue, jscontext);
+    return true;
+}
+
+static void *type_rdb_load(size_t itype, RedisModuleIO *rdb, int encver)
+{
+    if (encver != 0)
+    {
+        RedisModule_LogIOError(rdb, "warning", "%s: unsupported encoding version %d", g_vectypes[itype].strName.c_str(), encver);
+        return nullptr;
+    }
+
+    size_t cch;
+    char *rgch = RedisModule_LoadStringBuffer(rdb, &cch);
+    if (rgch == nullptr)
+        return nullptr;
+    SerializedValue sv;
+    sv.reset((uint8_t*)rgch, cch);
+    std::string strErr;
+    JSTypeValue *pvalue = load_type_value(g_jscontext.load(std::memory_order_acquire), itype, sv, &strErr);
+    if (pvalue == nullptr)
+        RedisModule_LogIOError(rdb, "warning", "%s: failed to load value: %s", g_vectypes[itype].strName.c_str(), strErr.c_str());
+    return pvalue;
+}
+
+// rdb_load isn't told which type it is loading, so each type gets its own entry point
+template<size_t itype>
+static void *type_rdb_load_thunk(RedisModuleIO *rdb, int encver)
+{
+    return type_rdb_load(itype, rdb, encver);
+}
+
+template<size_t... rgitype>
+static std::vector<RedisModuleTypeLoadFunc> MakeLoadThunks(std::index_sequence<rgitype...>)
+{
+    return { type_rdb_load_thunk<rgitype>... };
+}
+static const std::vector<RedisModuleTypeLoadFunc> c_vecloadthunks = MakeLoadThunks(std::make_index_sequence<ctypesMax>());
+
+static void type_rdb_save(RedisModuleIO *rdb, void *value)
+{
+    JSTypeValue *pvalue = (JSTypeValue*)value;
+    RedisModule_SaveStringBuffer(rdb, (const char*)pvalue->svSaved.data(), pvalue->svSaved.size());
+}
+
+static void type_aof_rewrite(RedisModuleIO *aof, RedisModuleString *key, void *value)
+{
+    JSTypeValue *pvalue = (JSTypeValue*)value;
+    RedisModule_EmitAOF(aof, "MODJS.TYPERESTORE", "scb", key, g_vectypes[pvalue->itype].strName.c_str(),
+        (const char*)pvalue->svSaved.data(), pvalue->svSaved.size());
+}
+
+static size_t type_mem_usage(const void *value)
+{
+    const JSTypeValue *pvalue = (const JSTypeValue*)value;
+    return sizeof(JSTypeValue) + pvalue->svSaved.size() + pvalue->cbHookUsage;
+}
+
+// Also called by lazyfree threads.  Taking the owner's lock can't deadlock since only threads that run with
+//  the server lock held own values (see FTypeFromArg), so the owner never waits on us
+static void type_free(void *value)
+{
+    JSTypeValue *pvalue = (JSTypeValue*)value;
+    {
+        v8::Locker locker(pvalue->jscontext->getIsolate());
+        pvalue->value.Reset();
+    }
+    set_value_owner(pvalue, nullptr);
+    delete pvalue;
+}
+
+// createType(name, hooks) returns the type's id
+void CreateTypeCallback(const v8::FunctionCallbackInfo<v8::Value>& args)
+{
+    v8::Isolate* isolate = args.GetIsolate();
+    v8::HandleScope scope(isolate);
+
+    if (args.Length() < 2 || !args[1]->IsObject())
+    {
+        ThrowError(isolate, "createType() expects a name and an object of hooks");
+        return;
+    }
+    v8::String::Utf8Value utf8Name(isolate, args[0]);
+    if (*utf8Name == nullptr)
+        return;
+    std::string strName(*utf8Name, utf8Name.length());
+    JSContext *jscontext = (JSContext*)isolate->GetData(0);
+
+    size_t itype = 0;
+    while (itype < g_vectypes.size() && strcasecmp(g_vectypes[itype].strName.c_str(), strName.c_str()))
+        ++itype;
+
+    if (jscontext == g_jscontext.load(std::memory_order_acquire) && g_fInStartup)
+    {
+        if (itype < g_vectypes.size())
+        {
+            ThrowError(isolate, ("type " + strName + " already exists").c_str());
+            return;
+        }
+        if (g_vectypes.size() >= ctypesMax)
+        {
+            ThrowError(isolate, ("at most " + std::to_string(ctypesMax) + " types may be created").c_str());
+            return;
+        }
+
+        RedisModuleTypeMethods tm = {};
+        tm.version = REDISMODULE_TYPE_METHOD_VERSION;
+        tm.rdb_load = c_vecloadthunks[itype];
+        tm.rdb_save = type_rdb_save;
+        tm.aof_rewrite = type_aof_rewrite;
+        tm.mem_usage = type_mem_usage;
+        tm.free = type_free;
+        RedisModuleType *mt = RedisModule_CreateDataType(g_ctx, strName.c_str(), 0 /* encver */, &tm);
+        if (mt == nullptr)
+        {
+            ThrowError(isolate, ("failed to create type " + strName + ", names must be 9 characters from A-Z, a-z, 0-9, - and _").c_str());
+            return;
+        }
+        g_vectypes.push_back(JSDataType{strName, mt});
+    }
+    else if (!t_fInReplicaStartup)
+    {
+        ThrowError(isolate, "Types may only be created during startup");
+        return;
+    }
+    else if (itype == g_vectypes.size())
+    {
+        // The server only accepts new types while the module loads
+        ThrowError(isolate, ("type " + strName + " was not created when the module loaded, restart the server to add it").c_str());
         return;
+    }
 
-    v8::Local<v8::Function> fn = v8::Local<v8::Function>::Cast(vfn);
-    v8::Local<v8::Value> vfnName = fn->GetName();
-    v8::String::Utf8Value fnName(isolate, vfnName);
+    jscontext->setTypeHooks(itype, v8::Local<v8::Object>::Cast(args[1]));
+    args.GetReturnValue().Set(v8::Number::New(isolate, (double)itype));
+}
 
-    std::string flags = "write deny-oom random";
-    if (args.Length() >= 2)
+static bool FTypeFromArg(v8::Isolate *isolate, v8::Local<v8::Value> vtype, size_t *pitype)
+{
+    // Background threads hold their isolate while they wait for the server lock.  A value they owned would
+    //  make the server wait on that isolate with the lock held (MEMORY USAGE, DEL, another thread's get())
+    if (t_fBackgroundThread)
     {
-        // They passed in their own flags
-        v8::Local<v8::Value> vFlags = args[1];
-        if (vFlags->IsString())
+        ThrowError(isolate, "ERR custom types can't be used from background functions or while MODJS.RELOAD runs the startup scripts");
+        return false;
+    }
+    double dbl = vtype->NumberValue(isolate->GetCurrentContext()).FromMaybe(-1);
+    if (!(dbl >= 0 && dbl < (double)g_vectypes.size()))
+    {
+        ThrowError(isolate, "invalid type");
+        return false;
+    }
+    *pitype = (size_t)dbl;
+    return true;
+}
+
+// typeGet(type, key) returns the live value, or undefined if the key doesn't exist
+void TypeGetCallback(const v8::FunctionCallbackInfo<v8::Value>& args)
+{
+    v8::Isolate* isolate = args.GetIsolate();
+    size_t itype;
+    if (args.Length() < 2 || !FTypeFromArg(isolate, args[0], &itype))
+        return;
+
+    KeyHandle key(isolate, args[1], REDISMODULE_READ);
+    if (key.type() == REDISMODULE_KEYTYPE_EMPTY)
+        return;
+    if (RedisModule_ModuleTypeGetType(key.key()) != g_vectypes[itype].mt)
+    {
+        ThrowError(isolate, "WRONGTYPE Operation against a key holding the wrong kind of value");
+        return;
+    }
+
+    JSTypeValue *pvalue = (JSTypeValue*)RedisModule_ModuleTypeGetValue(key.key());
+    JSContext *jscontext = (JSContext*)isolate->GetData(0);
+    if (pvalue->jscontext != jscontext && !FAdoptTypeValue(pvalue, jscontext))
+        return;
+    args.GetReturnValue().Set(pvalue->value.Get(isolate));
+}
+
+// Serializes the value for persistence and sends it to replicas and the AOF as MODJS.TYPERESTORE
+static bool FReplicateTypeValue(v8::Isolate *isolate, RedisModuleString *key, JSTypeValue *pvalue)
+{
+    SerializedValue sv;
+    std::string strErr;
+    if (!FSerializeTypeValue(pvalue, &sv, &strErr))
+    {
+        ThrowError(isolate, ("failed to save value: " + strErr).c_str());
+        return false;
+    }
+    pvalue->svSaved = std::move(sv);
+    RedisModule_Replicate(g_ctx, "MODJS.TYPERESTORE", "scb", key, g_vectypes[pvalue->itype].strName.c_str(),
+        (const char*)pvalue->svSaved.data(), pvalue->svSaved.size());
+    return true;
+}
+
+// typeSet(type, key, value) replaces whatever the key holds, like SET does
+void TypeSetCallback(const v8::FunctionCallbackInfo<v8::Value>& args)
+{
+    v8::Isolate* isolate = args.GetIsolate();
+    size_t itype;
+    if (args.Length() < 3 || !FTypeFromArg(isolate, args[0], &itype))
+        return;
+
+    if (FBlockWrite(args))
+        return;
+    KeyHandle key(isolate, args[1], REDISMODULE_READ | REDISMODULE_WRITE);
+    JSTypeValue *pvalue = new JSTypeValue();
+    pvalue->itype = itype;
+    pvalue->value.Reset(isolate, args[2]);
+    set_value_owner(pvalue, (JSContext*)isolate->GetData(0));
+    if (key.key() == nullptr)
+    {
+        type_free(pvalue);
+        ThrowError(isolate, "ERR failed to set the key, is the command flagged as a write?");
+        return;
+    }
+    if (!FReplicateTypeValue(isolate, key.name(), pvalue))
+    {
+        type_free(pvalue);
+        return;
+    }
+    RedisModule_ModuleTypeSetValue(key.key(), g_vectypes[itype].mt, pvalue);
+}
+
+// typeReplicate(type, key) propagates a value that was changed in place, until then replicas, the AOF and
+//  RDB saves have the value as it was last set or replicated
+void TypeReplicateCallback(const v8::FunctionCallbackInfo<v8::Value>& args)
+{
+    v8::Isolate* isolate = args.GetIsolate();
+    size_t itype;
+    if (args.Length() < 2 || !FTypeFromArg(isolate, args[0], &itype))
+        return;
+
+    if (FBlockWrite(args))
+        return;
+    KeyHandle key(isolate, args[1], REDISMODULE_READ | REDISMODULE_WRITE);
+    if (key.type() == REDISMODULE_KEYTYPE_EMPTY)
+        return;
+    if (RedisModule_ModuleTypeGetType(key.key()) != g_vectypes[itype].mt)
+    {
+        ThrowError(isolate, "WRONGTYPE Operation against a key holding the wrong kind of value");
+        return;
+    }
+
+    JSTypeValue *pvalue = (JSTypeValue*)RedisModule_ModuleTypeGetValue(key.key());
+    JSContext *jscontext = (JSContext*)isolate->GetData(0);
+    if (pvalue->jscontext != jscontext && !FAdoptTypeValue(pvalue, jscontext))
+        return;
+    FReplicateTypeValue(isolate, key.name(), pvalue);
+}
+
+// MODJS.TYPERESTORE key type payload, recreates a value from its persisted bytes.  Used by replication and
+//  the AOF
+int typerestore_command(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+{
+    KeyDBContext ctxsav(ctx);
+
+    if (argc != 4)
+    {
+        RedisModule_WrongArity(ctx);
+        return REDISMODULE_ERR;
+    }
+
+    const char *szType = RedisModule_StringPtrLen(argv[2], nullptr);
+    size_t itype = 0;
+    while (itype < g_vectypes.size() && strcasecmp(g_vectypes[itype].strName.c_str(), szType))
+        ++itype;
+    if (itype == g_vectypes.size())
+    {
+        RedisModule_ReplyWithError(ctx, "ERR unknown type");
+        return REDISMODULE_ERR;
+    }
+
+    size_t cch;
+    const char *rgch = RedisModule_StringPtrLen(argv[3], &cch);
+    uint8_t *pb = (uint8_t*)RedisModule_Alloc(cch);
+    memcpy(pb, rgch, cch);
+    SerializedValue sv;
+    sv.reset(pb, cch);
+    std::string strErr;
+    ContextInUse contextinuse;
+    JSTypeValue *pvalue = load_type_value(contextinuse.get(), itype, sv, &strErr);
+    if (pvalue == nullptr)
+    {
+        RedisModule_ReplyWithError(ctx, ("ERR " + strErr).c_str());
+        return REDISMODULE_ERR;
+    }
+
+    RedisModuleKey *key = (RedisModuleKey*)RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ | REDISMODULE_WRITE);
+    RedisModule_ModuleTypeSetValue(key, g_vectypes[itype].mt, pvalue);
+    RedisModule_CloseKey(key);
+    if (decodedcache_active())
+    {
+        size_t cchKey;
+        const char *rgchKey = RedisModule_StringPtrLen(argv[1], &cchKey);
+        decodedcache_invalidate(RedisModule_GetSelectedDb(ctx), rgchKey, cchKey);
+    }
+    RedisModule_ReplicateVerbatim(ctx);
+    return RedisModule_ReplyWithSimpleString(ctx, "OK");
+}
+
+struct ReloadJob
+{
+    RedisModuleBlockedClient *bc = nullptr;
+    JSContext *jscontext = nullptr;
+    std::vector<JSContext*> vecprebuilt;    // for other server threads with --isolate-per-thread
+    std::string strErr;
+};
+
+// Contexts replaced by MODJS.RELOAD.  A timer frees them once no command is running in them and nothing
+//  else (a blocked client's Promise, a background job, a type value) still refers to them
+static std::mutex g_mutexRetired;
+static std::vector<JSContext*> g_vecretired;
+static std::atomic<bool> g_fReloadInProgress { false };
+static const mstime_t c_msRetiredSweep = 1000;
+static bool g_fRetiredSweepArmed = false;   // guarded by the server lock
+
+static void retire_context(JSContext *jscontext)
+{
+    {
+        // With --isolate-per-thread the old main context is retired by the swap and again by its thread
+        std::unique_lock<std::mutex> lock(g_mutexRetired);
+        if (jscontext->m_fRetired)
+            return;
+        jscontext->m_fRetired = true;
+        g_vecretired.push_back(jscontext);
+    }
+    clear_context_timers(jscontext);
+    cancel_trigger_flush(jscontext);
+}
+
+static bool FContextHasPending(JSContext *jscontext)
+{
+    if (FContextHasBackgroundJobs(jscontext) || FContextHasTypeValues(jscontext) || FTriggerFlushScheduled(jscontext))
+        return true;
+    // Clients that timed out don't hold the context, their Promises are dropped with it
+    std::unique_lock<std::mutex> lock(g_mutexPending);
+    for (auto &pair : g_mappending)
+    {
+        if (pair.second->jscontext == jscontext && !pair.second->fTimedOut)
+            return true;
+    }
+    return false;
+}
+
+// Unblocks the clients of Promises that timed out and can no longer settle once the context is freed
+static void release_timed_out_promises(JSContext *jscontext)
+{
+    std::vector<PendingPromise*> vecpending;
+    {
+        std::unique_lock<std::mutex> lock(g_mutexPending);
+        auto itr = g_mappending.begin();
+        while (itr != g_mappending.end())
         {
-            auto utfFlags = v8::String::Utf8Value(isolate, vFlags);
-            flags = *utfFlags;
+            if (itr->second->jscontext == jscontext)
+            {
+                vecpending.push_back(itr->second);
+                itr = g_mappending.erase(itr);
+            }
+            else
+            {
+                ++itr;
+            }
         }
     }
+    for (PendingPromise *pending : vecpending)
+    {
+        RedisModule_UnblockClient(pending->bc, nullptr);
+        delete pending;
+    }
+}
 
-    int keyFirst = 0;
-    int keyLast = 0;
-    int keyStep = 0;
-    if (args.Length() > 2)
+static void free_retired_contexts()
+{
+    std::vector<JSContext*> vecfree;
     {
-        if (args.Length() != 5)
+        std::unique_lock<std::mutex> lock(g_mutexRetired);
+        if (g_cpinning.load() != 0)
+            return;     // a thread may be about to pin one, try again on the next sweep
+        auto itr = g_vecretired.begin();
+        while (itr != g_vecretired.end())
         {
-            isolate->ThrowException(v8::String::NewFromUtf8(isolate, "incorrect number of arguments to register()").ToLocalChecked());
+            // Pending work is checked first, trigger_flush() pins the context before it clears its flag
+            if (!FContextHasPending(*itr) && (*itr)->m_cinuse.load() == 0)
+            {
+                vecfree.push_back(*itr);
+                itr = g_vecretired.erase(itr);
+            }
+            else
+            {
+                ++itr;
+            }
+        }
+    }
+    for (JSContext *jscontext : vecfree)
+    {
+        release_timed_out_promises(jscontext);
+        delete jscontext;
+    }
+}
+
+static void retired_sweep(RedisModuleCtx *ctx, void *);
+
+// Keeps a timer running while there are retired contexts, so each is freed soon after its last use rather
+//  than by the next reload.  Call with the server lock held
+static void arm_retired_sweep(RedisModuleCtx *ctx)
+{
+    if (g_fRetiredSweepArmed)
+        return;
+    {
+        std::unique_lock<std::mutex> lock(g_mutexRetired);
+        if (g_vecretired.empty())
             return;
+    }
+    g_fRetiredSweepArmed = true;
+    RedisModule_CreateTimer(ctx, c_msRetiredSweep, retired_sweep, nullptr);
+}
+
+static void retired_sweep(RedisModuleCtx *ctx, void *)
+{
+    KeyDBContext ctxsav(ctx);
+    g_fRetiredSweepArmed = false;
+    free_retired_contexts();
+    arm_retired_sweep(ctx);
+}
+
+// Builds the new context off the main thread, the old one keeps serving commands until the swap
+static void reload_thread_main(ReloadJob *job)
+{
+    RedisModuleCtx *ctx = RedisModule_GetThreadSafeContext(job->bc);
+    {
+        KeyDBContext ctxsav(ctx);
+        t_fBackgroundThread = true;
+        t_fInReplicaStartup = true;
+
+        JSContext *jscontext = new JSContext();
+        jscontext->initialize();
+        for (auto &strPath : g_vecstartupscripts)
+        {
+            if (run_startup_script(ctx, jscontext, strPath.c_str()) == REDISMODULE_ERR)
+            {
+                job->strErr = "ERR failed to run " + strPath + ", see the server log for details";
+                break;
+            }
         }
 
-        if (!args[2]->IsInt32() || !args[3]->IsInt32() || !args[4]->IsInt32())
+        t_fInReplicaStartup = false;
+
+        // The server only lets modules create commands while they load, so new names need a restart
+        if (job->strErr.empty())
         {
-            isolate->ThrowException(v8::String::NewFromUtf8(isolate, "expected integer argument").ToLocalChecked());
-            return;
+            for (auto &pair : jscontext->commands())
+            {
+                if (!g_setcommands.count(pair.first))
+                {
+                    job->strErr = "ERR MODJS.RELOAD can't add the new command " + pair.second->m_strName + ", restart the server to register it";
+                    break;
+                }
+            }
         }
 
-        keyFirst = v8::Local<v8::Int32>::Cast(args[2])->Value();
-        keyLast = v8::Local<v8::Int32>::Cast(args[3])->Value();
-        keyStep = v8::Local<v8::Int32>::Cast(args[4])->Value();
+        if (job->strErr.empty() && g_fIsolatePerThread)
+        {
+            size_t cthreads = g_cthreadContexts.load(std::memory_order_relaxed);
+            for (size_t ithread = 0; ithread < cthreads && job->strErr.empty(); ++ithread)
+            {
+                JSContext *jscontextThread = create_thread_context(ctx);
+                if (jscontextThread == nullptr)
+                    job->strErr = "ERR the startup scripts failed in a thread context, see the server log for details";
+                else
+                    job->vecprebuilt.push_back(jscontextThread);
+            }
+        }
+        t_fBackgroundThread = false;
+        if (job->strErr.empty())
+        {
+            job->jscontext = jscontext;
+        }
+        else
+        {
+            clear_context_timers(jscontext);
+            delete jscontext;
+        }
     }
+    RedisModule_FreeThreadSafeContext(ctx);
+    RedisModule_UnblockClient(job->bc, job);
+}
 
-    if (RedisModule_CreateCommand(g_ctx, *fnName, js_command, flags.c_str(), keyFirst, keyLast, keyStep) == REDISMODULE_ERR) {
-        isolate->ThrowException(v8::String::NewFromUtf8(isolate, "failed to register command").ToLocalChecked());
+// Runs between commands, so this is the only point the server sees the scripts change
+static void swap_context(RedisModuleCtx *ctx, ReloadJob *job)
+{
+    // Every command already exists, reload_thread_main rejects new ones.  They find their new function
+    //  through the lookup in js_command
+    JSContext *jscontextNew = job->jscontext;
+
+    free_retired_contexts();
+
+    // Published before the old contexts are retired, a thread that pins one after this finds the new one
+    JSContext *jscontextOld = g_jscontext.exchange(jscontextNew);
+    uint64_t epoch = g_reloadEpoch.fetch_add(1) + 1;
+    std::vector<JSContext*> vecunused;
+    {
+        std::unique_lock<std::mutex> lock(g_mutexPrebuilt);
+        vecunused.swap(g_vecprebuilt);
+        g_vecprebuilt.swap(job->vecprebuilt);
+        g_epochPrebuilt = epoch;
     }
+    for (JSContext *jscontext : vecunused)
+        delete jscontext;   // never handed to a thread
 
-    RedisModule_Log(g_ctx, "verbose", "Function %s registered", *fnName);
+    if (t_jscontext != nullptr && t_jscontext != jscontextOld)
+        retire_context(t_jscontext);
+    retire_context(jscontextOld);
+    t_jscontext = jscontextNew;
+    t_reloadEpoch = epoch;
+    update_keyspace_subscriptions(ctx);
+    arm_deferred_timers(ctx, jscontextNew);
+    arm_retired_sweep(ctx);
 }
 
-int evaljs_command(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+static int reload_reply(RedisModuleCtx *ctx, RedisModuleString **, int)
 {
     KeyDBContext ctxsav(ctx);
+    ReloadJob *job = (ReloadJob*)RedisModule_GetBlockedClientPrivateData(ctx);
+    if (job->jscontext == nullptr)
+        return RedisModule_ReplyWithError(ctx, job->strErr.c_str());
 
-    if (argc != 2)
-    {
-        RedisModule_WrongArity(ctx);
-        return REDISMODULE_ERR;
-    }
+    swap_context(ctx, job);
+    job->jscontext = nullptr;
+    RedisModule_Log(ctx, "notice", "ModJS scripts reloaded");
+    return RedisModule_ReplyWithSimpleString(ctx, "OK");
+}
 
-    if (g_jscontext == nullptr)
+static void reload_free(RedisModuleCtx *, void *privdata)
+{
+    // If the client went away before we could swap the new context is discarded
+    ReloadJob *job = (ReloadJob*)privdata;
+    if (job->jscontext != nullptr)
     {
-        g_jscontext = new JSContext();
-        g_jscontext->initialize();
+        clear_context_timers(job->jscontext);
+        delete job->jscontext;
     }
+    for (JSContext *jscontext : job->vecprebuilt)
+        delete jscontext;
+    delete job;
+    g_fReloadInProgress = false;
+}
 
-    v8::Locker locker(g_jscontext->getIsolate());
+// MODJS.RELOAD reruns bootstrap.js and the startup scripts in a new context and swaps it in
+int reload_command(RedisModuleCtx *ctx, RedisModuleString **, int argc)
+{
+    KeyDBContext ctxsav(ctx);
 
-    size_t cch = 0;
-    const char *rgch = RedisModule_StringPtrLen(argv[1], &cch);
-    try
+    if (argc != 1)
     {
-        v8::HandleScope scope(g_jscontext->getIsolate());
-        v8::Local<v8::Value> result = g_jscontext->run(rgch, cch);
-        auto context = g_jscontext->getCurrentContext();
-        processResult(ctx, g_jscontext->getIsolate(), context, result);
+        RedisModule_WrongArity(ctx);
+        return REDISMODULE_ERR;
     }
-    catch (std::string strerr)
+
+    if (RedisModule_GetContextFlags(ctx) & (REDISMODULE_CTX_FLAGS_LUA | REDISMODULE_CTX_FLAGS_MULTI))
     {
-        RedisModule_ReplyWithError(ctx, strerr.c_str());
+        RedisModule_ReplyWithError(ctx, "ERR MODJS.RELOAD can't be used in a transaction or script");
         return REDISMODULE_ERR;
     }
-    catch (std::nullptr_t)
+
+    bool fExpected = false;
+    if (!g_fReloadInProgress.compare_exchange_strong(fExpected, true))
     {
-        RedisModule_ReplyWithError(ctx, "Unknown Error");
+        RedisModule_ReplyWithError(ctx, "ERR a reload is already in progress");
         return REDISMODULE_ERR;
     }
+
+    ReloadJob *job = new ReloadJob();
+    job->bc = RedisModule_BlockClient(ctx, reload_reply, nullptr, reload_free, 0);
+    std::thread(reload_thread_main, job).detach();
     return REDISMODULE_OK;
 }
 
-int run_startup_script(RedisModuleCtx *ctx, const char *szPath)
+// MODJS.PROFILE START [sampling-interval-us] | STOP <path>
+int profile_command(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
 {
     KeyDBContext ctxsav(ctx);
 
-    std::ifstream file(szPath, std::ios::binary | std::ios::ate);
-    std::streamsize size = file.tellg();
-    if (size == -1)
+    if (argc < 2)
     {
-        RedisModule_Log(ctx, "warning", "startup script does not exist");
-        return REDISMODULE_ERR; // Failed to read file
+        RedisModule_WrongArity(ctx);
+        return REDISMODULE_ERR;
     }
 
-    file.seekg(0, std::ios::beg);
-
-    std::vector<char> buffer(size);
-    if (!file.read(buffer.data(), size))
+    ContextInUse contextinuse;
+    JSContext *jscontext = contextinuse.get();
+    std::string strErr;
+    const char *szSubcommand = RedisModule_StringPtrLen(argv[1], nullptr);
+    if (!strcasecmp(szSubcommand, "start"))
     {
-        RedisModule_Log(ctx, "warning", "failed to read startup script");
-        return REDISMODULE_ERR; // Failed to read file
-    }
+        if (argc > 3)
+        {
+            RedisModule_WrongArity(ctx);
+            return REDISMODULE_ERR;
+        }
 
-    v8::HandleScope scope(g_jscontext->getIsolate());
-    try
+        long long usInterval = 1000;
+        if (argc == 3 && (RedisModule_StringToLongLong(argv[2], &usInterval) == REDISMODULE_ERR || usInterval < 50 || usInterval > 1000000))
+        {
+            RedisModule_ReplyWithError(ctx, "ERR sampling interval must be between 50 and 1000000 microseconds");
+            return REDISMODULE_ERR;
+        }
+
+        v8::Locker locker(jscontext->getIsolate());
+        if (!profiler_start(jscontext->getIsolate(), (int)usInterval, &strErr))
+        {
+            RedisModule_ReplyWithError(ctx, strErr.c_str());
+            return REDISMODULE_ERR;
+        }
+        RedisModule_ReplyWithSimpleString(ctx, "OK");
+    }
+    else if (!strcasecmp(szSubcommand, "stop"))
     {
-        g_jscontext->run(buffer.data(), buffer.size(), true /* don't cache */);
+        if (argc != 3)
+        {
+            RedisModule_WrongArity(ctx);
+            return REDISMODULE_ERR;
+        }
+
+        const char *szName = RedisModule_StringPtrLen(argv[2], nullptr);
+        size_t csamples = 0;
+        v8::Locker locker(jscontext->getIsolate());
+        if (!profiler_stop(jscontext->getIsolate(), szName, &strErr, &csamples))
+        {
+            RedisModule_ReplyWithError(ctx, strErr.c_str());
+            return REDISMODULE_ERR;
+        }
+        RedisModule_ReplyWithLongLong(ctx, (long long)csamples);
     }
-    catch (std::string str)
+    else
     {
-        RedisModule_Log(ctx, "warning", "%s", str.c_str());
+        RedisModule_ReplyWithError(ctx, "ERR unknown subcommand, try START or STOP");
         return REDISMODULE_ERR;
     }
     return REDISMODULE_OK;
 }
 
+static void modjs_info(RedisModuleInfoCtx *ctx, int for_crash_report)
+{
+    RedisModule_InfoAddSection(ctx, (char*)"");
+
+    ScriptCacheStats cachestats = scriptcache_stats();
+    RedisModule_InfoAddFieldULongLong(ctx, (char*)"evaljs_cache_hits", cachestats.hits);
+    RedisModule_InfoAddFieldULongLong(ctx, (char*)"evaljs_cache_misses", cachestats.misses);
+    RedisModule_InfoAddFieldULongLong(ctx, (char*)"evaljs_cache_evictions", cachestats.evictions);
+    RedisModule_InfoAddFieldULongLong(ctx, (char*)"require_calls", stats_require_count());
+
+    DecodedCacheStats decodedstats = decodedcache_stats();
+    RedisModule_InfoAddFieldULongLong(ctx, (char*)"decoded_cache_hits", decodedstats.hits);
+    RedisModule_InfoAddFieldULongLong(ctx, (char*)"decoded_cache_misses", decodedstats.misses);
+    RedisModule_InfoAddFieldULongLong(ctx, (char*)"decoded_cache_evictions", decodedstats.evictions);
+    RedisModule_InfoAddFieldULongLong(ctx, (char*)"decoded_cache_invalidations", decodedstats.invalidations);
+    RedisModule_InfoAddFieldULongLong(ctx, (char*)"scripts_terminated", watchdog_terminated_count());
+
+    IsolateStatsTotals isolatestats = stats_isolate_totals();
+    RedisModule_InfoAddFieldULongLong(ctx, (char*)"isolates", isolatestats.cisolates);
+    RedisModule_InfoAddFieldULongLong(ctx, (char*)"heap_used_bytes", isolatestats.cbHeapUsed);
+    RedisModule_InfoAddFieldULongLong(ctx, (char*)"heap_total_bytes", isolatestats.cbHeapTotal);
+    RedisModule_InfoAddFieldULongLong(ctx, (char*)"heap_limit_bytes", isolatestats.cbHeapLimit);
+    RedisModule_InfoAddFieldULongLong(ctx, (char*)"external_memory_bytes", isolatestats.cbExternal);
+    RedisModule_InfoAddFieldULongLong(ctx, (char*)"gc_count", isolatestats.cgc);
+    RedisModule_InfoAddFieldULongLong(ctx, (char*)"gc_pause_total_us", isolatestats.usGcTotal);
+    RedisModule_InfoAddFieldULongLong(ctx, (char*)"gc_pause_max_us", isolatestats.usGcMax);
+
+    if (for_crash_report)
+        return;
+
+    RedisModule_InfoAddFieldULongLong(ctx, (char*)"timers", timer_count());
+    RedisModule_InfoAddFieldULongLong(ctx, (char*)"background_jobs_completed", g_cjobsCompleted.load(std::memory_order_relaxed));
+    RedisModule_InfoAddFieldULongLong(ctx, (char*)"background_jobs_queued", background_queue_length());
+
+    std::vector<CommandStats*> veccmds;
+    stats_enum_commands(veccmds);
+    std::string strField;
+    for (CommandStats *pstats : veccmds)
+    {
+        strField = "cmdstat_" + pstats->strName;
+        RedisModule_InfoBeginDictField(ctx, &strField[0]);
+        RedisModule_InfoAddFieldULongLong(ctx, (char*)"calls", pstats->ccalls.load(std::memory_order_relaxed));
+        RedisModule_InfoAddFieldULongLong(ctx, (char*)"errors", pstats->cerrors.load(std::memory_order_relaxed));
+        RedisModule_InfoAddFieldULongLong(ctx, (char*)"p50_us", pstats->histogram.percentile(0.5));
+        RedisModule_InfoAddFieldULongLong(ctx, (char*)"p99_us", pstats->histogram.percentile(0.99));
+        RedisModule_InfoAddFieldULongLong(ctx, (char*)"p999_us", pstats->histogram.percentile(0.999));
+        RedisModule_InfoEndDictField(ctx);
+    }
+}
+
 int ReplyWithCString(RedisModuleCtx *ctx, const char *sz)
 {
     return RedisModule_ReplyWithStringBuffer(ctx, sz, strlen(sz));
@@ -381,10 +4075,41 @@ extern "C" int __attribute__((visibility("default"))) RedisModule_OnLoad(RedisMo
     if (RedisModule_CreateCommand(ctx,"evaljs", evaljs_command,"write deny-oom random",0,0,0) == REDISMODULE_ERR)
         return REDISMODULE_ERR;
 
+    if (RedisModule_CreateCommand(ctx,"evalshajs", evalshajs_command,"write deny-oom random",0,0,0) == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+
+    if (RedisModule_CreateCommand(ctx,"modjs.script", script_command,"readonly",0,0,0) == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+
+    if (RedisModule_CreateCommand(ctx,"modjs.profile", profile_command,"admin",0,0,0) == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+
+    if (RedisModule_CreateCommand(ctx,"modjs.reload", reload_command,"admin",0,0,0) == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+
+    if (RedisModule_CreateCommand(ctx,"modjs.typerestore", typerestore_command,"write deny-oom",1,1,1) == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+
+    if (RedisModule_RegisterInfoFunc(ctx, modjs_info) == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+
+    KeyDBContext ctxsav(ctx);
+
+    for (int iarg = 0; iarg < argc; ++iarg)
+    {
+        const char *szArg = RedisModule_StringPtrLen(argv[iarg], nullptr);
+        if (!strncmp(szArg, "--", 2) && !FProcessModuleOption(ctx, szArg))
+            return REDISMODULE_ERR;
+    }
+
+    javascript_set_heap_limits(g_cbMaxOldSpace, g_cbMaxYoungSpace);
+    javascript_set_array_buffer_limit(g_cbMaxArrayBuffers);
     javascript_initialize();
 
-    g_jscontext = new JSContext();
-    g_jscontext->initialize();
+    JSContext *jscontext = new JSContext();
+    jscontext->initialize();
+    g_jscontext.store(jscontext, std::memory_order_release);
+    t_jscontext = jscontext;
 
     RedisModule_Log(g_ctx, "warning", "Initialized ModJS v0.1.0");
 
@@ -398,7 +4123,8 @@ extern "C" int __attribute__((visibility("default"))) RedisModule_OnLoad(RedisMo
             path.remove_filename();
             path /= "bootstrap.js";
             std::string strPath = path.string();
-            if (run_startup_script(ctx, strPath.c_str()) == REDISMODULE_ERR)
+            g_vecstartupscripts.push_back(strPath);
+            if (run_startup_script(ctx, jscontext, strPath.c_str()) == REDISMODULE_ERR)
             {
                 RedisModule_Log(ctx, "warning", "failed to run bootstrap.js, ensure this is located in the same location as the .so");
                 return REDISMODULE_ERR;
@@ -416,11 +4142,15 @@ extern "C" int __attribute__((visibility("default"))) RedisModule_OnLoad(RedisMo
         // Process the startup script
         size_t cchPath;
         const char *rgchPath = RedisModule_StringPtrLen(argv[iarg], &cchPath);
+        if (!strncmp(rgchPath, "--", 2))
+            continue;   // options were handled above
 
-        if (run_startup_script(ctx, rgchPath) == REDISMODULE_ERR)
+        g_vecstartupscripts.push_back(std::string(rgchPath, cchPath));
+        if (run_startup_script(ctx, jscontext, rgchPath) == REDISMODULE_ERR)
             return REDISMODULE_ERR;
     }
 
     g_fInStartup = false;
+    update_keyspace_subscriptions(ctx);
     return REDISMODULE_OK;
 }
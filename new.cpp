@@ -1,18 +1,29 @@
 #include <cstddef>  // std::size_t
 #include <new>
 #include <stdio.h>
+#include <stdint.h>
 
 extern void *(*RedisModule_Alloc)(size_t bytes);
 extern void (*RedisModule_Free)(void *ptr);
 extern void *(*RedisModule_Calloc)(size_t nmemb, size_t size);
 
+// Counts allocations made by this thread so we can check the hot paths stay allocation free
+static thread_local uint64_t t_cnew = 0;
+
+uint64_t alloc_count_thread()
+{
+    return t_cnew;
+}
+
 void *operator new(size_t size)
 {
+    ++t_cnew;
     return RedisModule_Alloc(size);
 }
 
 void* operator new(std::size_t size, const std::nothrow_t&) noexcept
 {
+    ++t_cnew;
     return RedisModule_Alloc(size);
 }
 
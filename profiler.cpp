@@ -0,0 +1,315 @@
+#include "profiler.h"
+#include "stats.h"
+#include <v8-profiler.h>
+#include <atomic>
+#include <vector>
+#include <unordered_map>
+#include <map>
+#include <algorithm>
+#include <fstream>
+#include <stdio.h>
+#include <string.h>
+
+struct CommandInterval
+{
+    int64_t usStart;
+    int64_t usEnd;
+    const char *szName;
+};
+
+static const char szProfileTitle[] = "modjs";
+// Bounds memory on a busy server, samples after this are reported without a command
+static const size_t cintervalsMax = 4 * 1024 * 1024;
+
+static std::string g_strProfileDir;
+static std::atomic<v8::Isolate*> g_isolateProfiled { nullptr };
+static v8::CpuProfiler *g_profiler = nullptr;
+static std::vector<CommandInterval> g_vecintervals;   // only touched with the profiled isolate locked
+
+bool profiler_active(v8::Isolate *isolate)
+{
+    return g_isolateProfiled.load(std::memory_order_relaxed) == isolate;
+}
+
+void profiler_record_command(const char *szName, uint64_t usStart, uint64_t usEnd)
+{
+    // Back to back calls of the same command are merged, the gaps between them aren't running JS
+    if (!g_vecintervals.empty())
+    {
+        CommandInterval &last = g_vecintervals.back();
+        if (last.szName == szName && last.usEnd <= (int64_t)usStart)
+        {
+            last.usEnd = (int64_t)usEnd;
+            return;
+        }
+    }
+    if (g_vecintervals.size() < cintervalsMax)
+        g_vecintervals.push_back(CommandInterval{(int64_t)usStart, (int64_t)usEnd, szName});
+}
+
+ProfilerCommandScope::ProfilerCommandScope(v8::Isolate *isolate, const char *szName)
+{
+    if (profiler_active(isolate))
+    {
+        m_szName = szName;
+        m_usStart = stats_now_us();
+    }
+}
+
+ProfilerCommandScope::~ProfilerCommandScope()
+{
+    if (m_szName != nullptr)
+        profiler_record_command(m_szName, m_usStart, stats_now_us());
+}
+
+void profiler_set_directory(const char *szDir)
+{
+    g_strProfileDir = szDir;
+}
+
+bool profiler_start(v8::Isolate *isolate, int usInterval, std::string *pstrErr)
+{
+    if (g_strProfileDir.empty())
+    {
+        *pstrErr = "ERR profiling is disabled, set a directory for profiles with --profile-dir";
+        return false;
+    }
+
+    v8::Isolate *isolateNull = nullptr;
+    if (!g_isolateProfiled.compare_exchange_strong(isolateNull, isolate))
+    {
+        *pstrErr = "ERR a profile is already running";
+        return false;
+    }
+
+    v8::HandleScope scope(isolate);
+    g_vecintervals.clear();
+    g_profiler = v8::CpuProfiler::New(isolate);
+    g_profiler->SetSamplingInterval(usInterval);
+    g_profiler->StartProfiling(v8::String::NewFromUtf8(isolate, szProfileTitle).ToLocalChecked(), true /* record_samples */);
+    return true;
+}
+
+static void AppendJsonString(std::string &str, const char *sz)
+{
+    str += '"';
+    for (const char *pch = sz; *pch != '\0'; ++pch)
+    {
+        unsigned char ch = (unsigned char)*pch;
+        switch (ch)
+        {
+        case '"': str += "\\\""; break;
+        case '\\': str += "\\\\"; break;
+        case '\n': str += "\\n"; break;
+        case '\r': str += "\\r"; break;
+        case '\t': str += "\\t"; break;
+        default:
+            if (ch < 0x20)
+            {
+                char rgch[8];
+                snprintf(rgch, sizeof(rgch), "\\u%04x", ch);
+                str += rgch;
+            }
+            else
+            {
+                str += (char)ch;
+            }
+        }
+    }
+    str += '"';
+}
+
+// Chrome DevTools .cpuprofile format
+static std::string ProfileToJson(const v8::CpuProfile *profile, const std::vector<const char*> &vecsampletags)
+{
+    std::string str;
+    str += "{\"nodes\":[";
+    std::vector<const v8::CpuProfileNode*> stack;
+    stack.push_back(profile->GetTopDownRoot());
+    bool fFirst = true;
+    while (!stack.empty())
+    {
+        const v8::CpuProfileNode *node = stack.back();
+        stack.pop_back();
+
+        if (!fFirst)
+            str += ',';
+        fFirst = false;
+        str += "{\"id\":" + std::to_string(node->GetNodeId());
+        str += ",\"callFrame\":{\"functionName\":";
+        AppendJsonString(str, node->GetFunctionNameStr());
+        str += ",\"scriptId\":\"" + std::to_string(node->GetScriptId()) + "\"";
+        str += ",\"url\":";
+        AppendJsonString(str, node->GetScriptResourceNameStr());
+        // V8 numbers lines and columns from 1, DevTools from 0
+        str += ",\"lineNumber\":" + std::to_string(node->GetLineNumber() - 1);
+        str += ",\"columnNumber\":" + std::to_string(node->GetColumnNumber() - 1);
+        str += "},\"hitCount\":" + std::to_string(node->GetHitCount());
+        str += ",\"children\":[";
+        int cchildren = node->GetChildrenCount();
+        for (int ichild = 0; ichild < cchildren; ++ichild)
+        {
+            const v8::CpuProfileNode *child = node->GetChild(ichild);
+            if (ichild != 0)
+                str += ',';
+            str += std::to_string(child->GetNodeId());
+            stack.push_back(child);
+        }
+        str += "]}";
+    }
+
+    str += "],\"startTime\":" + std::to_string(profile->GetStartTime());
+    str += ",\"endTime\":" + std::to_string(profile->GetEndTime());
+
+    int csamples = profile->GetSamplesCount();
+    str += ",\"samples\":[";
+    for (int isample = 0; isample < csamples; ++isample)
+    {
+        if (isample != 0)
+            str += ',';
+        str += std::to_string(profile->GetSample(isample)->GetNodeId());
+    }
+    str += "],\"timeDeltas\":[";
+    int64_t usPrev = profile->GetStartTime();
+    for (int isample = 0; isample < csamples; ++isample)
+    {
+        int64_t us = profile->GetSampleTimestamp(isample);
+        if (isample != 0)
+            str += ',';
+        str += std::to_string(us - usPrev);
+        usPrev = us;
+    }
+    // Not part of the DevTools format, the command that was running when each sample was taken
+    str += "],\"sampleCommands\":[";
+    for (int isample = 0; isample < csamples; ++isample)
+    {
+        if (isample != 0)
+            str += ',';
+        AppendJsonString(str, vecsampletags[isample] != nullptr ? vecsampletags[isample] : "");
+    }
+    str += "]}";
+    return str;
+}
+
+static const std::string &FoldedStack(const v8::CpuProfileNode *node, std::unordered_map<const v8::CpuProfileNode*, std::string> &mapstack)
+{
+    auto itr = mapstack.find(node);
+    if (itr != mapstack.end())
+        return itr->second;
+
+    std::string str;
+    const v8::CpuProfileNode *parent = node->GetParent();
+    if (parent != nullptr && parent->GetParent() != nullptr)
+        str = FoldedStack(parent, mapstack) + ";";
+
+    const char *szFn = node->GetFunctionNameStr();
+    std::string strFrame = (*szFn != '\0') ? szFn : "(anonymous)";
+    const char *szUrl = node->GetScriptResourceNameStr();
+    if (*szUrl != '\0')
+        strFrame += std::string(" ") + szUrl + ":" + std::to_string(node->GetLineNumber());
+    std::replace(strFrame.begin(), strFrame.end(), ';', ':');
+    str += strFrame;
+    return mapstack.emplace(node, std::move(str)).first->second;
+}
+
+// One line per unique stack with the command as the outermost frame, as consumed by flamegraph.pl
+static std::string ProfileToFolded(const v8::CpuProfile *profile, const std::vector<const char*> &vecsampletags)
+{
+    std::unordered_map<const v8::CpuProfileNode*, std::string> mapstack;
+    std::map<std::string, uint64_t> mapcount;
+    int csamples = profile->GetSamplesCount();
+    for (int isample = 0; isample < csamples; ++isample)
+    {
+        const v8::CpuProfileNode *node = profile->GetSample(isample);
+        std::string strKey = (vecsampletags[isample] != nullptr) ? vecsampletags[isample] : "(none)";
+        if (node->GetParent() != nullptr)
+            strKey += ";" + FoldedStack(node, mapstack);
+        ++mapcount[strKey];
+    }
+
+    std::string str;
+    for (auto &pair : mapcount)
+        str += pair.first + " " + std::to_string(pair.second) + "\n";
+    return str;
+}
+
+static void TagSamples(const v8::CpuProfile *profile, std::vector<const char*> &vecsampletags)
+{
+    // Nested commands (a command calling another through keydb.call) are recorded when the inner one ends
+    std::sort(g_vecintervals.begin(), g_vecintervals.end(), [](const CommandInterval &a, const CommandInterval &b) {
+        return a.usStart < b.usStart;
+    });
+
+    int csamples = profile->GetSamplesCount();
+    vecsampletags.resize(csamples, nullptr);
+    for (int isample = 0; isample < csamples; ++isample)
+    {
+        int64_t us = profile->GetSampleTimestamp(isample);
+        auto itr = std::upper_bound(g_vecintervals.begin(), g_vecintervals.end(), us, [](int64_t us, const CommandInterval &interval) {
+            return us < interval.usStart;
+        });
+        // Walk back a little in case we're inside an outer command after a nested one finished
+        for (int cstep = 0; cstep < 8 && itr != g_vecintervals.begin(); ++cstep)
+        {
+            --itr;
+            if (itr->usEnd >= us)
+            {
+                vecsampletags[isample] = itr->szName;
+                break;
+            }
+        }
+    }
+}
+
+static bool FWriteFile(const std::string &strPath, const std::string &strContents, std::string *pstrErr)
+{
+    std::ofstream file(strPath, std::ios::out | std::ios::binary | std::ios::trunc);
+    if (file.is_open())
+        file.write(strContents.data(), strContents.size());
+    if (!file.is_open() || !file.good())
+    {
+        *pstrErr = "ERR failed to write " + strPath;
+        return false;
+    }
+    return true;
+}
+
+bool profiler_stop(v8::Isolate *isolate, const char *szName, std::string *pstrErr, size_t *pcsamples)
+{
+    if (!profiler_active(isolate))
+    {
+        *pstrErr = "ERR no profile is running";
+        return false;
+    }
+
+    // Clients choose the name, so it must not be able to leave the directory.  The profile keeps running
+    //  so the client can retry with a valid name
+    if (*szName == '\0' || strchr(szName, '/') != nullptr || strstr(szName, "..") != nullptr)
+    {
+        *pstrErr = "ERR the profile name may not be empty or contain '/' or '..'";
+        return false;
+    }
+
+    v8::HandleScope scope(isolate);
+    v8::CpuProfile *profile = g_profiler->StopProfiling(v8::String::NewFromUtf8(isolate, szProfileTitle).ToLocalChecked());
+    bool fSuccess = true;
+    *pcsamples = 0;
+    if (profile != nullptr)
+    {
+        // Sample timestamps are from the same monotonic clock as stats_now_us()
+        std::vector<const char*> vecsampletags;
+        TagSamples(profile, vecsampletags);
+        *pcsamples = (size_t)profile->GetSamplesCount();
+
+        std::string strPath = g_strProfileDir + "/" + szName;
+        fSuccess = FWriteFile(strPath, ProfileToJson(profile, vecsampletags), pstrErr)
+            && FWriteFile(strPath + ".folded", ProfileToFolded(profile, vecsampletags), pstrErr);
+        profile->Delete();
+    }
+
+    g_profiler->Dispose();
+    g_profiler = nullptr;
+    std::vector<CommandInterval>().swap(g_vecintervals);
+    g_isolateProfiled.store(nullptr);
+    return fSuccess;
+}
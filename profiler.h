@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <v8.h>
+
+/*
+ * Sampling CPU profiler for MODJS.PROFILE.  One isolate may be profiled at a time, while it is running
+ *  each command invocation is recorded so samples can be attributed to the command that was executing.
+ */
+// Profiles are only written inside this directory, without one MODJS.PROFILE is disabled
+void profiler_set_directory(const char *szDir);
+
+bool profiler_start(v8::Isolate *isolate, int usInterval, std::string *pstrErr);
+
+// Writes the profile to szName in the profile directory as .cpuprofile JSON, and to szName.folded as folded
+//  stacks for flamegraphs.  The name may not contain '/' or ".."
+bool profiler_stop(v8::Isolate *isolate, const char *szName, std::string *pstrErr, size_t *pcsamples);
+
+bool profiler_active(v8::Isolate *isolate);
+void profiler_record_command(const char *szName, uint64_t usStart, uint64_t usEnd);
+
+// Records the enclosing command invocation if its isolate is being profiled.  szName must outlive
+//  the profile, e.g. CommandStats::strName
+class ProfilerCommandScope
+{
+    const char *m_szName = nullptr;
+    uint64_t m_usStart = 0;
+
+public:
+    ProfilerCommandScope(v8::Isolate *isolate, const char *szName);
+    ~ProfilerCommandScope();
+};
@@ -0,0 +1,204 @@
+#include "scriptcache.h"
+#include "xxhash64.h"
+#include <atomic>
+#include <iterator>
+#include <mutex>
+
+static size_t g_cmaxScripts = 128;
+
+static std::mutex g_mutexSources;
+static std::unordered_map<ScriptHash, std::string, ScriptHashHasher> g_mapsource;
+
+// Bumped by a flush, each ScriptCache clears itself the next time it notices
+static std::atomic<uint64_t> g_epoch { 0 };
+
+static std::atomic<uint64_t> g_chits { 0 };
+static std::atomic<uint64_t> g_cmisses { 0 };
+static std::atomic<uint64_t> g_cevictions { 0 };
+
+void hash_script(const char *rgch, size_t cch, ScriptHash *phash)
+{
+    SHA256_CTX ctx;
+    sha256_init(&ctx);
+    sha256_update(&ctx, (const BYTE*)rgch, cch);
+    sha256_final(&ctx, phash->rgb);
+}
+
+static int hex_digit(char ch)
+{
+    if (ch >= '0' && ch <= '9')
+        return ch - '0';
+    if (ch >= 'a' && ch <= 'f')
+        return ch - 'a' + 10;
+    if (ch >= 'A' && ch <= 'F')
+        return ch - 'A' + 10;
+    return -1;
+}
+
+bool FParseScriptHash(const char *rgch, size_t cch, ScriptHash *phash)
+{
+    if (cch != SHA256_BLOCK_SIZE * 2)
+        return false;
+
+    for (size_t ib = 0; ib < SHA256_BLOCK_SIZE; ++ib)
+    {
+        int hi = hex_digit(rgch[ib * 2]);
+        int lo = hex_digit(rgch[ib * 2 + 1]);
+        if (hi < 0 || lo < 0)
+            return false;
+        phash->rgb[ib] = (BYTE)((hi << 4) | lo);
+    }
+    return true;
+}
+
+std::string script_hash_to_hex(const ScriptHash &hash)
+{
+    static const char rgchHex[] = "0123456789abcdef";
+    std::string str;
+    str.reserve(SHA256_BLOCK_SIZE * 2);
+    for (size_t ib = 0; ib < SHA256_BLOCK_SIZE; ++ib)
+    {
+        str += rgchHex[hash.rgb[ib] >> 4];
+        str += rgchHex[hash.rgb[ib] & 0xf];
+    }
+    return str;
+}
+
+ScriptCache::ScriptCache()
+    : m_epoch(g_epoch.load(std::memory_order_relaxed))
+{}
+
+void ScriptCache::checkEpoch()
+{
+    uint64_t epoch = g_epoch.load(std::memory_order_relaxed);
+    if (epoch != m_epoch)
+    {
+        clear();
+        m_epoch = epoch;
+    }
+}
+
+v8::Local<v8::Script> ScriptCache::hit(v8::Isolate *isolate, std::list<Entry>::iterator itr)
+{
+    // Move to the front of the LRU
+    m_lru.splice(m_lru.begin(), m_lru, itr);
+    g_chits.fetch_add(1, std::memory_order_relaxed);
+    return itr->script.Get(isolate);
+}
+
+bool ScriptCache::FGetScript(v8::Isolate *isolate, const ScriptHash &hash, v8::Local<v8::Script> *pscriptOut)
+{
+    checkEpoch();
+
+    auto itr = m_map.find(hash);
+    if (itr == m_map.end())
+    {
+        g_cmisses.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    *pscriptOut = hit(isolate, itr->second);
+    return !pscriptOut->IsEmpty();
+}
+
+bool ScriptCache::FGetScript(v8::Isolate *isolate, const char *rgch, size_t cch, v8::Local<v8::Script> *pscriptOut)
+{
+    checkEpoch();
+
+    auto itr = m_mapfast.find(xxhash64(rgch, cch));
+    if (itr == m_mapfast.end()
+        || itr->second->strSource.size() != cch
+        || memcmp(itr->second->strSource.data(), rgch, cch) != 0)
+    {
+        g_cmisses.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    *pscriptOut = hit(isolate, itr->second);
+    return !pscriptOut->IsEmpty();
+}
+
+void ScriptCache::insert(v8::Isolate *isolate, const ScriptHash &hash, const char *rgch, size_t cch, v8::Local<v8::Script> script)
+{
+    checkEpoch();
+
+    auto itr = m_map.find(hash);
+    if (itr != m_map.end())
+    {
+        itr->second->script.Reset(isolate, script);
+        m_lru.splice(m_lru.begin(), m_lru, itr->second);
+        m_mapfast[itr->second->hashFast] = itr->second;
+        return;
+    }
+
+    while (!m_lru.empty() && m_lru.size() >= g_cmaxScripts)
+    {
+        auto itrLast = std::prev(m_lru.end());
+        auto itrFast = m_mapfast.find(itrLast->hashFast);
+        if (itrFast != m_mapfast.end() && itrFast->second == itrLast)
+            m_mapfast.erase(itrFast);
+        m_map.erase(itrLast->hash);
+        m_lru.pop_back();
+        g_cevictions.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    uint64_t hashFast = xxhash64(rgch, cch);
+    m_lru.push_front(Entry { hash, hashFast, std::string(rgch, cch), v8::Global<v8::Script>(isolate, script) });
+    m_map.emplace(hash, m_lru.begin());
+    m_mapfast[hashFast] = m_lru.begin();     // on a collision the newest script wins
+}
+
+bool ScriptCache::FContains(const ScriptHash &hash)
+{
+    checkEpoch();
+    return m_map.find(hash) != m_map.end();
+}
+
+void ScriptCache::clear()
+{
+    m_map.clear();
+    m_mapfast.clear();
+    m_lru.clear();
+}
+
+void scriptcache_set_max_entries(size_t cmax)
+{
+    g_cmaxScripts = (cmax > 0) ? cmax : 1;
+}
+
+void scriptcache_register_source(const ScriptHash &hash, const char *rgch, size_t cch)
+{
+    std::unique_lock<std::mutex> lock(g_mutexSources);
+    auto itr = g_mapsource.find(hash);
+    if (itr == g_mapsource.end())
+        g_mapsource.emplace(hash, std::string(rgch, cch));
+}
+
+bool FScriptCacheLookupSource(const ScriptHash &hash, std::string *pstrSource)
+{
+    std::unique_lock<std::mutex> lock(g_mutexSources);
+    auto itr = g_mapsource.find(hash);
+    if (itr == g_mapsource.end())
+        return false;
+    if (pstrSource != nullptr)
+        *pstrSource = itr->second;
+    return true;
+}
+
+void scriptcache_flush()
+{
+    {
+        std::unique_lock<std::mutex> lock(g_mutexSources);
+        g_mapsource.clear();
+    }
+    g_epoch.fetch_add(1, std::memory_order_relaxed);
+}
+
+ScriptCacheStats scriptcache_stats()
+{
+    ScriptCacheStats stats;
+    stats.hits = g_chits.load(std::memory_order_relaxed);
+    stats.misses = g_cmisses.load(std::memory_order_relaxed);
+    stats.evictions = g_cevictions.load(std::memory_order_relaxed);
+    return stats;
+}
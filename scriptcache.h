@@ -0,0 +1,84 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <v8.h>
+#include "sha256.h"
+
+// Scripts are identified by the SHA-256 of their source, the same digest EVALSHAJS takes in hex
+struct ScriptHash
+{
+    BYTE rgb[SHA256_BLOCK_SIZE];
+
+    bool operator==(const ScriptHash &other) const { return memcmp(rgb, other.rgb, SHA256_BLOCK_SIZE) == 0; }
+};
+
+struct ScriptHashHasher
+{
+    size_t operator()(const ScriptHash &hash) const
+    {
+        // The digest is already uniformly distributed
+        size_t val;
+        memcpy(&val, hash.rgb, sizeof(val));
+        return val;
+    }
+};
+
+void hash_script(const char *rgch, size_t cch, ScriptHash *phash);
+bool FParseScriptHash(const char *rgch, size_t cch, ScriptHash *phash);
+std::string script_hash_to_hex(const ScriptHash &hash);
+
+/*
+ * A bounded LRU of compiled scripts for a single isolate.  Compiled scripts can't be shared between
+ *  isolates, so the source of scripts loaded with MODJS.SCRIPT LOAD is also kept in a process wide
+ *  registry and recompiled on demand by any context that doesn't have it.
+ */
+class ScriptCache
+{
+    struct Entry
+    {
+        ScriptHash hash;
+        uint64_t hashFast;
+        std::string strSource;
+        v8::Global<v8::Script> script;
+    };
+
+    std::list<Entry> m_lru;    // most recently used first
+    std::unordered_map<ScriptHash, std::list<Entry>::iterator, ScriptHashHasher> m_map;
+    std::unordered_map<uint64_t, std::list<Entry>::iterator> m_mapfast;
+    uint64_t m_epoch;
+
+    void checkEpoch();
+    v8::Local<v8::Script> hit(v8::Isolate *isolate, std::list<Entry>::iterator itr);
+
+public:
+    ScriptCache();
+
+    // Lookup by digest (EVALSHAJS)
+    bool FGetScript(v8::Isolate *isolate, const ScriptHash &hash, v8::Local<v8::Script> *pscriptOut);
+    // Lookup by source (EVALJS), this uses a fast hash and compares the source instead of computing the SHA-256
+    bool FGetScript(v8::Isolate *isolate, const char *rgch, size_t cch, v8::Local<v8::Script> *pscriptOut);
+    void insert(v8::Isolate *isolate, const ScriptHash &hash, const char *rgch, size_t cch, v8::Local<v8::Script> script);
+    bool FContains(const ScriptHash &hash);
+    void clear();
+};
+
+// Maximum number of compiled scripts kept per isolate
+void scriptcache_set_max_entries(size_t cmax);
+
+// Process wide registry of script sources (MODJS.SCRIPT LOAD)
+void scriptcache_register_source(const ScriptHash &hash, const char *rgch, size_t cch);
+bool FScriptCacheLookupSource(const ScriptHash &hash, std::string *pstrSource);
+void scriptcache_flush();
+
+struct ScriptCacheStats
+{
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+};
+ScriptCacheStats scriptcache_stats();
@@ -0,0 +1,118 @@
+#include "serialize.h"
+#include <utility>
+
+extern void *(*RedisModule_Realloc)(void *ptr, size_t bytes);
+extern void (*RedisModule_Free)(void *ptr);
+bool FGetBufferData(v8::Local<v8::Value> val, const char **prgch, size_t *pcch);
+
+class ModuleSerializerDelegate : public v8::ValueSerializer::Delegate
+{
+    v8::Isolate *m_isolate;
+
+public:
+    ModuleSerializerDelegate(v8::Isolate *isolate)
+        : m_isolate(isolate)
+    {}
+
+    virtual void ThrowDataCloneError(v8::Local<v8::String> message) override
+    {
+        m_isolate->ThrowException(v8::Exception::TypeError(message));
+    }
+
+    virtual void *ReallocateBufferMemory(void *old_buffer, size_t size, size_t *actual_size) override
+    {
+        *actual_size = size;
+        return RedisModule_Realloc(old_buffer, size);
+    }
+
+    virtual void FreeBufferMemory(void *buffer) override
+    {
+        RedisModule_Free(buffer);
+    }
+};
+
+SerializedValue::~SerializedValue()
+{
+    if (m_pb != nullptr)
+        RedisModule_Free(m_pb);
+}
+
+void SerializedValue::swap(SerializedValue &other) noexcept
+{
+    std::swap(m_pb, other.m_pb);
+    std::swap(m_cb, other.m_cb);
+}
+
+void SerializedValue::reset(uint8_t *pb, size_t cb)
+{
+    if (m_pb != nullptr)
+        RedisModule_Free(m_pb);
+    m_pb = pb;
+    m_cb = cb;
+}
+
+uint8_t *SerializedValue::release()
+{
+    uint8_t *pb = m_pb;
+    m_pb = nullptr;
+    m_cb = 0;
+    return pb;
+}
+
+bool serialize_value(v8::Isolate *isolate, v8::Local<v8::Context> context, v8::Local<v8::Value> val, SerializedValue *psv)
+{
+    ModuleSerializerDelegate delegate(isolate);
+    v8::ValueSerializer serializer(isolate, &delegate);
+    serializer.WriteHeader();
+    if (serializer.WriteValue(context, val).IsNothing())
+        return false;
+
+    std::pair<uint8_t*, size_t> buffer = serializer.Release();
+    psv->reset(buffer.first, buffer.second);
+    return true;
+}
+
+v8::MaybeLocal<v8::Value> deserialize_value(v8::Isolate *isolate, v8::Local<v8::Context> context, const uint8_t *pb, size_t cb)
+{
+    v8::ValueDeserializer deserializer(isolate, pb, cb);
+    if (!deserializer.ReadHeader(context).FromMaybe(false))
+        return v8::MaybeLocal<v8::Value>();     // V8 has thrown a DataCloneError
+    return deserializer.ReadValue(context);
+}
+
+static void FreeSerializedBuffer(void *data, size_t, void *)
+{
+    RedisModule_Free(data);
+}
+
+void SerializeCallback(const v8::FunctionCallbackInfo<v8::Value>& args)
+{
+    v8::Isolate *isolate = args.GetIsolate();
+    v8::HandleScope scope(isolate);
+    SerializedValue sv;
+    if (!serialize_value(isolate, isolate->GetCurrentContext(), args[0], &sv))
+        return;
+
+    // The ArrayBuffer takes over the serializer's buffer instead of copying it
+    size_t cb = sv.size();
+    std::shared_ptr<v8::BackingStore> backing = v8::ArrayBuffer::NewBackingStore(sv.release(), cb, FreeSerializedBuffer, nullptr);
+    v8::Local<v8::ArrayBuffer> buffer = v8::ArrayBuffer::New(isolate, std::move(backing));
+    args.GetReturnValue().Set(v8::Uint8Array::New(buffer, 0, cb));
+}
+
+void DeserializeCallback(const v8::FunctionCallbackInfo<v8::Value>& args)
+{
+    v8::Isolate *isolate = args.GetIsolate();
+    v8::HandleScope scope(isolate);
+    const char *rgch;
+    size_t cch;
+    if (!FGetBufferData(args[0], &rgch, &cch))
+    {
+        isolate->ThrowException(v8::Exception::TypeError(v8::String::NewFromUtf8(isolate, "deserialize() expects an ArrayBuffer or typed array").ToLocalChecked()));
+        return;
+    }
+
+    v8::Local<v8::Value> value;
+    if (deserialize_value(isolate, isolate->GetCurrentContext(), (const uint8_t*)rgch, cch).ToLocal(&value))
+        args.GetReturnValue().Set(value);
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <v8.h>
+
+/*
+ * Structured clone of JS values with v8::ValueSerializer, the format postMessage() uses.  Used to pass
+ *  values between isolates, the buffers come from the server's allocator so they count towards used_memory.
+ */
+class SerializedValue
+{
+    uint8_t *m_pb = nullptr;
+    size_t m_cb = 0;
+
+public:
+    SerializedValue() = default;
+    SerializedValue(const SerializedValue &) = delete;
+    SerializedValue &operator=(const SerializedValue &) = delete;
+    SerializedValue(SerializedValue &&other) noexcept { swap(other); }
+    SerializedValue &operator=(SerializedValue &&other) noexcept { swap(other); return *this; }
+    ~SerializedValue();
+
+    const uint8_t *data() const { return m_pb; }
+    size_t size() const { return m_cb; }
+
+    void swap(SerializedValue &other) noexcept;
+    void reset(uint8_t *pb, size_t cb);
+    uint8_t *release();     // the caller frees the buffer with RedisModule_Free
+};
+
+// Returns false with an exception pending in the isolate if the value can't be cloned (e.g. a function)
+bool serialize_value(v8::Isolate *isolate, v8::Local<v8::Context> context, v8::Local<v8::Value> val, SerializedValue *psv);
+
+v8::MaybeLocal<v8::Value> deserialize_value(v8::Isolate *isolate, v8::Local<v8::Context> context, const uint8_t *pb, size_t cb);
+
+// keydb.serialize(value) returns a Uint8Array, keydb.deserialize(buffer) takes any ArrayBuffer or view
+void SerializeCallback(const v8::FunctionCallbackInfo<v8::Value>& args);
+void DeserializeCallback(const v8::FunctionCallbackInfo<v8::Value>& args);
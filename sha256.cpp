@@ -16,6 +16,10 @@
 #include <stdlib.h>
 #include <string.h>
 #include "sha256.h"
+#if defined(__x86_64__)
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
 
 /****************************** MACROS ******************************/
 #define ROTLEFT(a,b) (((a) << (b)) | ((a) >> (32-(b))))
@@ -82,6 +86,102 @@ void sha256_transform(SHA256_CTX *ctx, const BYTE data[])
 	ctx->state[7] += h;
 }
 
+static void sha256_blocks_portable(SHA256_CTX *ctx, const BYTE data[], size_t cblocks)
+{
+	for ( ; cblocks > 0; --cblocks, data += 64)
+		sha256_transform(ctx, data);
+}
+
+#if defined(__x86_64__)
+/*
+ * Intel SHA extensions (SHA-NI).  The state is kept in the ABEF/CDGH layout the instructions expect,
+ *  each sha256rnds2 performs two rounds and sha256msg1/msg2 compute the message schedule.
+ */
+__attribute__((target("sha,sse4.1")))
+static void sha256_blocks_shani(SHA256_CTX *ctx, const BYTE data[], size_t cblocks)
+{
+	const __m128i MASK = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+	__m128i state0, state1, msg, tmp, abef_save, cdgh_save;
+	__m128i w[4];
+
+	tmp = _mm_loadu_si128((const __m128i*)&ctx->state[0]);
+	state1 = _mm_loadu_si128((const __m128i*)&ctx->state[4]);
+	tmp = _mm_shuffle_epi32(tmp, 0xB1);             // CDAB
+	state1 = _mm_shuffle_epi32(state1, 0x1B);       // EFGH
+	state0 = _mm_alignr_epi8(tmp, state1, 8);       // ABEF
+	state1 = _mm_blend_epi16(state1, tmp, 0xF0);    // CDGH
+
+	for ( ; cblocks > 0; --cblocks, data += 64) {
+		abef_save = state0;
+		cdgh_save = state1;
+
+#pragma GCC unroll 16
+		for (int i = 0; i < 16; ++i) {
+			if (i < 4) {
+				w[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + i * 16)), MASK);
+			}
+			else {
+				// w[i&3] still holds the group from four steps ago
+				tmp = _mm_sha256msg1_epu32(w[i & 3], w[(i + 1) & 3]);
+				tmp = _mm_add_epi32(tmp, _mm_alignr_epi8(w[(i + 3) & 3], w[(i + 2) & 3], 4));
+				w[i & 3] = _mm_sha256msg2_epu32(tmp, w[(i + 3) & 3]);
+			}
+			msg = _mm_add_epi32(w[i & 3], _mm_loadu_si128((const __m128i*)&k[i * 4]));
+			state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+			msg = _mm_shuffle_epi32(msg, 0x0E);
+			state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+		}
+
+		state0 = _mm_add_epi32(state0, abef_save);
+		state1 = _mm_add_epi32(state1, cdgh_save);
+	}
+
+	tmp = _mm_shuffle_epi32(state0, 0x1B);          // FEBA
+	state1 = _mm_shuffle_epi32(state1, 0xB1);       // DCHG
+	state0 = _mm_blend_epi16(tmp, state1, 0xF0);    // DCBA
+	state1 = _mm_alignr_epi8(state1, tmp, 8);       // HGFE
+	_mm_storeu_si128((__m128i*)&ctx->state[0], state0);
+	_mm_storeu_si128((__m128i*)&ctx->state[4], state1);
+}
+
+static int cpu_has_shani()
+{
+	unsigned int eax, ebx, ecx, edx;
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+		return 0;
+	if (!(ecx & bit_SSSE3) || !(ecx & bit_SSE4_1))
+		return 0;
+	if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+		return 0;
+	return (ebx & bit_SHA) != 0;
+}
+#endif
+
+typedef void (*sha256_blocks_fn)(SHA256_CTX *ctx, const BYTE data[], size_t cblocks);
+
+// Picks the fastest implementation the CPU supports, falling back to the portable code
+static sha256_blocks_fn select_sha256_blocks()
+{
+#if defined(__x86_64__)
+	if (cpu_has_shani())
+		return sha256_blocks_shani;
+#endif
+	return sha256_blocks_portable;
+}
+
+static sha256_blocks_fn g_sha256_blocks = select_sha256_blocks();
+
+static void sha256_blocks(SHA256_CTX *ctx, const BYTE data[], size_t cblocks)
+{
+	g_sha256_blocks(ctx, data, cblocks);
+}
+
+int sha256_set_portable(int fPortable)
+{
+	g_sha256_blocks = fPortable ? sha256_blocks_portable : select_sha256_blocks();
+	return select_sha256_blocks() != sha256_blocks_portable;
+}
+
 void sha256_init(SHA256_CTX *ctx)
 {
 	ctx->datalen = 0;
@@ -98,17 +198,35 @@ void sha256_init(SHA256_CTX *ctx)
 
 void sha256_update(SHA256_CTX *ctx, const BYTE data[], size_t len)
 {
-	WORD i;
+	size_t cb, cblocks;
 
-	for (i = 0; i < len; ++i) {
-		ctx->data[ctx->datalen] = data[i];
-		ctx->datalen++;
-		if (ctx->datalen == 64) {
-			sha256_transform(ctx, ctx->data);
-			ctx->bitlen += 512;
-			ctx->datalen = 0;
-		}
+	// Top off any partial block left over from a previous update
+	if (ctx->datalen > 0) {
+		cb = 64 - ctx->datalen;
+		if (cb > len)
+			cb = len;
+		memcpy(ctx->data + ctx->datalen, data, cb);
+		ctx->datalen += cb;
+		data += cb;
+		len -= cb;
+		if (ctx->datalen < 64)
+			return;
+		sha256_blocks(ctx, ctx->data, 1);
+		ctx->bitlen += 512;
+		ctx->datalen = 0;
+	}
+
+	// Hash whole blocks straight from the input
+	cblocks = len / 64;
+	if (cblocks > 0) {
+		sha256_blocks(ctx, data, cblocks);
+		ctx->bitlen += 512ULL * cblocks;
+		data += cblocks * 64;
+		len -= cblocks * 64;
 	}
+
+	memcpy(ctx->data, data, len);
+	ctx->datalen = len;
 }
 
 void sha256_final(SHA256_CTX *ctx, BYTE hash[])
@@ -127,7 +245,7 @@ void sha256_final(SHA256_CTX *ctx, BYTE hash[])
 		ctx->data[i++] = 0x80;
 		while (i < 64)
 			ctx->data[i++] = 0x00;
-		sha256_transform(ctx, ctx->data);
+		sha256_blocks(ctx, ctx->data, 1);
 		memset(ctx->data, 0, 56);
 	}
 
@@ -141,7 +259,7 @@ void sha256_final(SHA256_CTX *ctx, BYTE hash[])
 	ctx->data[58] = ctx->bitlen >> 40;
 	ctx->data[57] = ctx->bitlen >> 48;
 	ctx->data[56] = ctx->bitlen >> 56;
-	sha256_transform(ctx, ctx->data);
+	sha256_blocks(ctx, ctx->data, 1);
 
 	// Since this implementation uses little endian byte ordering and SHA uses big endian,
 	// reverse all the bytes when copying the final state to the output hash.
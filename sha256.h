@@ -32,4 +32,8 @@ void sha256_init(SHA256_CTX *ctx);
 void sha256_update(SHA256_CTX *ctx, const BYTE data[], size_t len);
 void sha256_final(SHA256_CTX *ctx, BYTE hash[]);
 
+// Forces the portable code even when the CPU has SHA extensions, for bench/sha256_bench.  Not thread safe,
+//  call it before hashing anything.  Returns nonzero if an accelerated implementation is available.
+int sha256_set_portable(int fPortable);
+
 #endif   // SHA256_H
@@ -0,0 +1,180 @@
+#include "stats.h"
+#include <chrono>
+#include <mutex>
+#include <memory>
+#include <unordered_map>
+#include <algorithm>
+
+static std::mutex g_mutexStats;
+static std::unordered_map<std::string, std::unique_ptr<CommandStats>> g_mapcmdstats;
+static std::vector<IsolateStats*> g_vecisolatestats;
+static std::atomic<uint64_t> g_crequire { 0 };
+
+uint64_t stats_now_us()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+int LatencyHistogram::bucketFromValue(uint64_t us)
+{
+    if (us < (uint64_t)cbucketsLinear)
+        return (int)us;
+
+    // Above the linear range keep the top 5 bits of the value, the leading 1 and 16 sub buckets
+    int msb = 63 - __builtin_clzll(us);
+    if (msb > 40)
+        return cbuckets - 1;
+    int shift = msb - 4;
+    int mantissa = (int)(us >> shift) - csubbuckets;
+    return cbucketsLinear + (msb - 5) * csubbuckets + mantissa;
+}
+
+uint64_t LatencyHistogram::valueFromBucket(int ibucket)
+{
+    if (ibucket < cbucketsLinear)
+        return (uint64_t)ibucket;
+
+    // Report the highest value in the bucket so percentiles never understate latency
+    int octave = (ibucket - cbucketsLinear) / csubbuckets;
+    uint64_t mantissa = (ibucket - cbucketsLinear) % csubbuckets + csubbuckets;
+    int shift = octave + 1;
+    return ((mantissa + 1) << shift) - 1;
+}
+
+void LatencyHistogram::record(uint64_t us)
+{
+    m_rgcount[bucketFromValue(us)].fetch_add(1, std::memory_order_relaxed);
+}
+
+uint64_t LatencyHistogram::percentile(double q) const
+{
+    uint64_t rgcount[cbuckets];
+    uint64_t ctotal = 0;
+    for (int ibucket = 0; ibucket < cbuckets; ++ibucket)
+    {
+        rgcount[ibucket] = m_rgcount[ibucket].load(std::memory_order_relaxed);
+        ctotal += rgcount[ibucket];
+    }
+    if (ctotal == 0)
+        return 0;
+
+    uint64_t ctarget = (uint64_t)(q * ctotal + 0.5);
+    if (ctarget < 1)
+        ctarget = 1;
+    uint64_t csofar = 0;
+    for (int ibucket = 0; ibucket < cbuckets; ++ibucket)
+    {
+        csofar += rgcount[ibucket];
+        if (csofar >= ctarget)
+            return valueFromBucket(ibucket);
+    }
+    return valueFromBucket(cbuckets - 1);
+}
+
+CommandStats *stats_for_command(const char *szName)
+{
+    std::string strName(szName);
+    std::transform(strName.begin(), strName.end(), strName.begin(), ::tolower);
+
+    std::unique_lock<std::mutex> lock(g_mutexStats);
+    auto itr = g_mapcmdstats.find(strName);
+    if (itr != g_mapcmdstats.end())
+        return itr->second.get();
+
+    std::unique_ptr<CommandStats> spstats = std::make_unique<CommandStats>();
+    spstats->strName = strName;
+    CommandStats *pstats = spstats.get();
+    g_mapcmdstats.emplace(strName, std::move(spstats));
+    return pstats;
+}
+
+void stats_enum_commands(std::vector<CommandStats*> &veccmds)
+{
+    std::unique_lock<std::mutex> lock(g_mutexStats);
+    for (auto &pair : g_mapcmdstats)
+        veccmds.push_back(pair.second.get());
+    std::sort(veccmds.begin(), veccmds.end(), [](const CommandStats *a, const CommandStats *b) {
+        return a->strName < b->strName;
+    });
+}
+
+static void GCPrologueCallback(v8::Isolate *, v8::GCType, v8::GCCallbackFlags, void *data)
+{
+    reinterpret_cast<IsolateStats*>(data)->usGcStart = stats_now_us();
+}
+
+static void GCEpilogueCallback(v8::Isolate *isolate, v8::GCType, v8::GCCallbackFlags, void *data)
+{
+    IsolateStats *pstats = reinterpret_cast<IsolateStats*>(data);
+    if (pstats->usGcStart == 0)
+        return;
+    uint64_t us = stats_now_us() - pstats->usGcStart;
+    pstats->usGcStart = 0;
+
+    pstats->cgc.fetch_add(1, std::memory_order_relaxed);
+    pstats->usGcTotal.fetch_add(us, std::memory_order_relaxed);
+    if (us > pstats->usGcMax.load(std::memory_order_relaxed))
+        pstats->usGcMax.store(us, std::memory_order_relaxed);
+    stats_update_heap(isolate, pstats);
+}
+
+IsolateStats *stats_attach_isolate(v8::Isolate *isolate)
+{
+    IsolateStats *pstats = new IsolateStats();
+    isolate->AddGCPrologueCallback(GCPrologueCallback, pstats);
+    isolate->AddGCEpilogueCallback(GCEpilogueCallback, pstats);
+    stats_update_heap(isolate, pstats);
+
+    std::unique_lock<std::mutex> lock(g_mutexStats);
+    g_vecisolatestats.push_back(pstats);
+    return pstats;
+}
+
+void stats_detach_isolate(v8::Isolate *isolate, IsolateStats *pstats)
+{
+    isolate->RemoveGCPrologueCallback(GCPrologueCallback, pstats);
+    isolate->RemoveGCEpilogueCallback(GCEpilogueCallback, pstats);
+    {
+        std::unique_lock<std::mutex> lock(g_mutexStats);
+        g_vecisolatestats.erase(std::remove(g_vecisolatestats.begin(), g_vecisolatestats.end(), pstats), g_vecisolatestats.end());
+    }
+    delete pstats;
+}
+
+void stats_update_heap(v8::Isolate *isolate, IsolateStats *pstats)
+{
+    v8::HeapStatistics heapstats;
+    isolate->GetHeapStatistics(&heapstats);
+    pstats->cbHeapUsed.store(heapstats.used_heap_size(), std::memory_order_relaxed);
+    pstats->cbHeapTotal.store(heapstats.total_heap_size(), std::memory_order_relaxed);
+    pstats->cbHeapLimit.store(heapstats.heap_size_limit(), std::memory_order_relaxed);
+    pstats->cbExternal.store(heapstats.external_memory(), std::memory_order_relaxed);
+}
+
+IsolateStatsTotals stats_isolate_totals()
+{
+    IsolateStatsTotals totals;
+    std::unique_lock<std::mutex> lock(g_mutexStats);
+    for (const IsolateStats *pstats : g_vecisolatestats)
+    {
+        ++totals.cisolates;
+        totals.cbHeapUsed += pstats->cbHeapUsed.load(std::memory_order_relaxed);
+        totals.cbHeapTotal += pstats->cbHeapTotal.load(std::memory_order_relaxed);
+        totals.cbHeapLimit += pstats->cbHeapLimit.load(std::memory_order_relaxed);
+        totals.cbExternal += pstats->cbExternal.load(std::memory_order_relaxed);
+        totals.cgc += pstats->cgc.load(std::memory_order_relaxed);
+        totals.usGcTotal += pstats->usGcTotal.load(std::memory_order_relaxed);
+        totals.usGcMax = std::max(totals.usGcMax, pstats->usGcMax.load(std::memory_order_relaxed));
+    }
+    return totals;
+}
+
+void stats_count_require()
+{
+    g_crequire.fetch_add(1, std::memory_order_relaxed);
+}
+
+uint64_t stats_require_count()
+{
+    return g_crequire.load(std::memory_order_relaxed);
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <v8.h>
+
+/*
+ * Counters reported in the modjs INFO section.  Everything is updated with relaxed atomics since commands
+ *  may run on several threads with --isolate-per-thread, and INFO only needs a consistent enough view.
+ */
+
+// Log-linear histogram of latencies in microseconds in the style of HdrHistogram.  Each power of two is
+//  split into 16 buckets so percentiles are accurate to within ~6%, up to 2^40us
+class LatencyHistogram
+{
+public:
+    static const int cbucketsLinear = 32;
+    static const int csubbuckets = 16;
+    static const int cbuckets = cbucketsLinear + (40 - 5 + 1) * csubbuckets;
+
+    void record(uint64_t us);
+    uint64_t percentile(double q) const;   // q in [0, 1]
+
+private:
+    static int bucketFromValue(uint64_t us);
+    static uint64_t valueFromBucket(int ibucket);
+
+    std::atomic<uint64_t> m_rgcount[cbuckets] = {};
+};
+
+struct CommandStats
+{
+    std::string strName;
+    std::atomic<uint64_t> ccalls { 0 };
+    std::atomic<uint64_t> cerrors { 0 };
+    LatencyHistogram histogram;
+};
+
+// Stats are per command name and shared by every isolate, the pointer is valid for the life of the process
+CommandStats *stats_for_command(const char *szName);
+void stats_enum_commands(std::vector<CommandStats*> &veccmds);
+
+// Heap and GC stats for one isolate, the heap figures are refreshed after every GC
+struct IsolateStats
+{
+    std::atomic<uint64_t> cbHeapUsed { 0 };
+    std::atomic<uint64_t> cbHeapTotal { 0 };
+    std::atomic<uint64_t> cbHeapLimit { 0 };
+    std::atomic<uint64_t> cbExternal { 0 };
+    std::atomic<uint64_t> cgc { 0 };
+    std::atomic<uint64_t> usGcTotal { 0 };
+    std::atomic<uint64_t> usGcMax { 0 };
+    uint64_t usGcStart = 0;     // only touched on the isolate's thread
+};
+
+// Installs the GC callbacks on the isolate and returns its stats
+IsolateStats *stats_attach_isolate(v8::Isolate *isolate);
+void stats_detach_isolate(v8::Isolate *isolate, IsolateStats *pstats);
+void stats_update_heap(v8::Isolate *isolate, IsolateStats *pstats);
+
+struct IsolateStatsTotals
+{
+    uint64_t cisolates = 0;
+    uint64_t cbHeapUsed = 0;
+    uint64_t cbHeapTotal = 0;
+    uint64_t cbHeapLimit = 0;
+    uint64_t cbExternal = 0;
+    uint64_t cgc = 0;
+    uint64_t usGcTotal = 0;
+    uint64_t usGcMax = 0;
+};
+IsolateStatsTotals stats_isolate_totals();
+
+void stats_count_require();
+uint64_t stats_require_count();
+
+uint64_t stats_now_us();
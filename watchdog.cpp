@@ -0,0 +1,155 @@
+#include "watchdog.h"
+#include "stats.h"
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <vector>
+#include <algorithm>
+
+// How often the watchdog checks deadlines, budgets are enforced to within about this
+static const int msWatchdogTick = 2;
+static const int cframesMax = 16;
+
+static std::mutex g_mutexWatchdog;
+static std::vector<WatchdogSlot*> g_vecslots;
+static std::once_flag g_onceWatchdogThread;
+static long long g_msDefault = 0;
+static std::atomic<uint64_t> g_cterminated { 0 };
+
+void watchdog_set_default_ms(long long ms)
+{
+    g_msDefault = ms;
+}
+
+long long watchdog_default_ms()
+{
+    return g_msDefault;
+}
+
+uint64_t watchdog_terminated_count()
+{
+    return g_cterminated.load(std::memory_order_relaxed);
+}
+
+// Runs on the isolate's thread inside the script, so we can still see its stack
+static void WatchdogInterrupt(v8::Isolate *isolate, void *data)
+{
+    WatchdogSlot *pslot = reinterpret_cast<WatchdogSlot*>(data);
+    uint64_t usDeadline = pslot->usDeadline.load();
+    if (usDeadline == 0 || pslot->seqArmed.load() != pslot->seqFired.load())
+        return; // the invocation finished before the interrupt ran
+    if (usDeadline > stats_now_us())
+    {
+        // Meant for an earlier invocation that ended as the next began, let the watchdog fire again
+        pslot->seqFired.store(0);
+        return;
+    }
+
+    v8::HandleScope scope(isolate);
+    v8::Local<v8::StackTrace> trace = v8::StackTrace::CurrentStackTrace(isolate, cframesMax);
+    pslot->strStack.clear();
+    for (int iframe = 0; iframe < trace->GetFrameCount(); ++iframe)
+    {
+        v8::Local<v8::StackFrame> frame = trace->GetFrame(isolate, iframe);
+        v8::String::Utf8Value fnName(isolate, frame->GetFunctionName());
+        v8::String::Utf8Value scriptName(isolate, frame->GetScriptName());
+        if (iframe != 0)
+            pslot->strStack += ", ";
+        pslot->strStack += "at ";
+        pslot->strStack += (*fnName != nullptr && fnName.length() > 0) ? *fnName : "<anonymous>";
+        pslot->strStack += " (";
+        pslot->strStack += (*scriptName != nullptr && scriptName.length() > 0) ? *scriptName : "<script>";
+        pslot->strStack += ":" + std::to_string(frame->GetLineNumber()) + ":" + std::to_string(frame->GetColumn()) + ")";
+    }
+
+    pslot->fTerminated = true;
+    g_cterminated.fetch_add(1, std::memory_order_relaxed);
+    isolate->TerminateExecution();
+}
+
+static void WatchdogThreadMain()
+{
+    for (;;)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(msWatchdogTick));
+        uint64_t usNow = stats_now_us();
+
+        std::unique_lock<std::mutex> lock(g_mutexWatchdog);
+        for (WatchdogSlot *pslot : g_vecslots)
+        {
+            uint64_t usDeadline = pslot->usDeadline.load();
+            if (usDeadline == 0 || usDeadline > usNow)
+                continue;
+            uint64_t seq = pslot->seqArmed.load();
+            if (pslot->seqFired.load() == seq)
+                continue;   // already interrupted
+            pslot->seqFired.store(seq);
+            pslot->isolate->RequestInterrupt(WatchdogInterrupt, pslot);
+        }
+    }
+}
+
+WatchdogSlot *watchdog_attach(v8::Isolate *isolate)
+{
+    WatchdogSlot *pslot = new WatchdogSlot();
+    pslot->isolate = isolate;
+
+    std::unique_lock<std::mutex> lock(g_mutexWatchdog);
+    g_vecslots.push_back(pslot);
+    return pslot;
+}
+
+void watchdog_detach(WatchdogSlot *pslot)
+{
+    {
+        std::unique_lock<std::mutex> lock(g_mutexWatchdog);
+        g_vecslots.erase(std::remove(g_vecslots.begin(), g_vecslots.end(), pslot), g_vecslots.end());
+    }
+    delete pslot;
+}
+
+bool watchdog_consume_termination(WatchdogSlot *pslot, std::string *pstrErr)
+{
+    if (!pslot->fTerminated)
+        return false;
+
+    *pstrErr = "ERR script exceeded its time limit of " + std::to_string(pslot->msBudget) + "ms";
+    if (!pslot->strStack.empty())
+        *pstrErr += ", " + pslot->strStack;
+
+    // An outer invocation is still on the stack, it has to unwind before JS can run again
+    if (pslot->cdepth <= 1)
+    {
+        pslot->fTerminated = false;
+        pslot->isolate->CancelTerminateExecution();
+    }
+    return true;
+}
+
+WatchdogScope::WatchdogScope(WatchdogSlot *pslot, long long msBudget)
+    : m_pslot(pslot)
+{
+    if (m_pslot->cdepth++ > 0 || msBudget <= 0)
+        return;
+
+    // Started on first use so servers without budgets don't get an extra thread
+    std::call_once(g_onceWatchdogThread, []{ std::thread(WatchdogThreadMain).detach(); });
+
+    m_pslot->msBudget = msBudget;
+    m_pslot->seqArmed.fetch_add(1);
+    m_pslot->usDeadline.store(stats_now_us() + (uint64_t)msBudget * 1000);
+}
+
+WatchdogScope::~WatchdogScope()
+{
+    if (--m_pslot->cdepth > 0)
+        return;
+    m_pslot->usDeadline.store(0);
+
+    // The interrupt may have landed just as the script finished, don't let it kill the next one
+    if (m_pslot->fTerminated)
+    {
+        m_pslot->fTerminated = false;
+        m_pslot->isolate->CancelTerminateExecution();
+    }
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <string>
+#include <v8.h>
+
+/*
+ * Stops scripts that run past their time budget.  A background thread checks every isolate's deadline and
+ *  interrupts the isolate once it passes, the interrupt records the JS stack and terminates execution.
+ */
+struct WatchdogSlot
+{
+    v8::Isolate *isolate = nullptr;
+    std::atomic<uint64_t> usDeadline { 0 };     // 0 when no budgeted invocation is running
+    std::atomic<uint64_t> seqArmed { 0 };       // bumped on every invocation so stale interrupts are ignored
+    std::atomic<uint64_t> seqFired { 0 };
+    long long msBudget = 0;
+    int cdepth = 0;
+    bool fTerminated = false;
+    std::string strStack;
+};
+
+// Budget for invocations that don't set their own, 0 for no limit
+void watchdog_set_default_ms(long long ms);
+long long watchdog_default_ms();
+
+WatchdogSlot *watchdog_attach(v8::Isolate *isolate);
+void watchdog_detach(WatchdogSlot *pslot);
+
+// True if the watchdog terminated the current invocation, *pstrErr gets an error with the stack when it fired.
+//  Execution is resumed once the outermost invocation has unwound
+bool watchdog_consume_termination(WatchdogSlot *pslot, std::string *pstrErr);
+
+uint64_t watchdog_terminated_count();
+
+// Arms the watchdog for the duration of an invocation, nested invocations run under the outer one's budget
+class WatchdogScope
+{
+    WatchdogSlot *m_pslot;
+
+public:
+    WatchdogScope(WatchdogSlot *pslot, long long msBudget);
+    ~WatchdogScope();
+};
@@ -0,0 +1,104 @@
+#include "xxhash64.h"
+#include <string.h>
+
+static const uint64_t PRIME1 = 11400714785074694791ULL;
+static const uint64_t PRIME2 = 14029467366897019727ULL;
+static const uint64_t PRIME3 = 1609587929392839161ULL;
+static const uint64_t PRIME4 = 9650029242287828579ULL;
+static const uint64_t PRIME5 = 2870177450012600261ULL;
+
+static inline uint64_t rotl64(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t read64(const unsigned char *p)
+{
+    uint64_t val;
+    memcpy(&val, p, sizeof(val));
+    return val;
+}
+
+static inline uint32_t read32(const unsigned char *p)
+{
+    uint32_t val;
+    memcpy(&val, p, sizeof(val));
+    return val;
+}
+
+static inline uint64_t round64(uint64_t acc, uint64_t input)
+{
+    acc += input * PRIME2;
+    acc = rotl64(acc, 31);
+    return acc * PRIME1;
+}
+
+static inline uint64_t merge_round64(uint64_t acc, uint64_t val)
+{
+    acc ^= round64(0, val);
+    return acc * PRIME1 + PRIME4;
+}
+
+uint64_t xxhash64(const void *pv, size_t cb, uint64_t seed)
+{
+    const unsigned char *p = (const unsigned char*)pv;
+    const unsigned char *pEnd = p + cb;
+    uint64_t h64;
+
+    if (cb >= 32)
+    {
+        const unsigned char *pLimit = pEnd - 32;
+        uint64_t v1 = seed + PRIME1 + PRIME2;
+        uint64_t v2 = seed + PRIME2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - PRIME1;
+
+        do
+        {
+            v1 = round64(v1, read64(p)); p += 8;
+            v2 = round64(v2, read64(p)); p += 8;
+            v3 = round64(v3, read64(p)); p += 8;
+            v4 = round64(v4, read64(p)); p += 8;
+        } while (p <= pLimit);
+
+        h64 = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+        h64 = merge_round64(h64, v1);
+        h64 = merge_round64(h64, v2);
+        h64 = merge_round64(h64, v3);
+        h64 = merge_round64(h64, v4);
+    }
+    else
+    {
+        h64 = seed + PRIME5;
+    }
+
+    h64 += (uint64_t)cb;
+
+    while (p + 8 <= pEnd)
+    {
+        h64 ^= round64(0, read64(p));
+        h64 = rotl64(h64, 27) * PRIME1 + PRIME4;
+        p += 8;
+    }
+
+    if (p + 4 <= pEnd)
+    {
+        h64 ^= (uint64_t)read32(p) * PRIME1;
+        h64 = rotl64(h64, 23) * PRIME2 + PRIME3;
+        p += 4;
+    }
+
+    while (p < pEnd)
+    {
+        h64 ^= (*p) * PRIME5;
+        h64 = rotl64(h64, 11) * PRIME1;
+        ++p;
+    }
+
+    h64 ^= h64 >> 33;
+    h64 *= PRIME2;
+    h64 ^= h64 >> 29;
+    h64 *= PRIME3;
+    h64 ^= h64 >> 32;
+    return h64;
+}
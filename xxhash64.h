@@ -0,0 +1,7 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// XXH64, a fast non-cryptographic hash.  Used where we need a quick lookup key and verify the match ourselves
+uint64_t xxhash64(const void *pv, size_t cb, uint64_t seed = 0);